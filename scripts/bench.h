@@ -0,0 +1,65 @@
+// Shared harness of the lookup benchmarks (dispatch_bench.c, prop_bench.c): registers more and more entries and
+// times the same pseudo random sequence of lookups through the fast path and through a scan of the list
+#ifndef VCAM_BENCH_H
+#define VCAM_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vcam.h>
+
+#define LOOKUPS 8000000
+
+struct LookupBench {
+	/// @brief Table header, the first column is the entry count
+	const char *header;
+	/// @brief Register entries until there are at least n, returns how many there are
+	int (*grow)(vcam *cam, int n);
+	/// @brief Write the code of every registered entry into codes
+	void (*codes)(vcam *cam, int *codes, int n);
+	uintptr_t (*lookup)(vcam *cam, int code);
+	/// @brief Lookup like it was done before the fast path
+	uintptr_t (*scan)(vcam *cam, int code);
+};
+
+static volatile uintptr_t bench_sink;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Returns ns per lookup, the sequence of codes is the same on every call
+static double bench_lookups(vcam *cam, uintptr_t (*lookup)(vcam *cam, int code), const int *codes, int n, int count) {
+	uint32_t x = 1;
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; i++) {
+		x = x * 1664525 + 1013904223;
+		bench_sink += lookup(cam, codes[(x >> 8) % (uint32_t)n]);
+	}
+	return (double)(now_ns() - start) / count;
+}
+
+static int bench_run(const struct LookupBench *b, const int *sizes, int nsizes) {
+	vcam *cam = vcam_init_standard();
+	int *codes = malloc(sizeof(int) * 65536);
+
+	printf("%s\n", b->header);
+	for (int s = 0; s < nsizes; s++) {
+		int n = b->grow(cam, sizes[s]);
+		b->codes(cam, codes, n);
+		double fast = bench_lookups(cam, b->lookup, codes, n, LOOKUPS);
+		// The scan is O(n), fewer lookups keep the big sizes quick
+		double scan = bench_lookups(cam, b->scan, codes, n, LOOKUPS / n * 16);
+		printf("%7d   %17.1f   %19.1f\n", n, fast, scan);
+	}
+
+	free(codes);
+	vcam_close(cam);
+	free(cam);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// Opcode dispatch benchmark: looks up registered opcodes as vcam_process_output does, with more and more opcodes
+// registered, next to a scan of the handler list like dispatch did before the table
+// make libusb-vcam.so
+// cc -O2 -I. -Isrc -Iusb scripts/dispatch_bench.c -L. -lusb-vcam -Wl,-rpath=. -o dispatch_bench && ./dispatch_bench
+#include "bench.h"
+
+static int dummy_write(vcam *cam, ptpcontainer *ptp) {
+	(void)cam; (void)ptp;
+	return 0;
+}
+
+// Vendor opcodes go in after the standard set, spread over the 0x9xxx and 0xCxxx pages
+static int grow(vcam *cam, int n) {
+	static int next = 0x9000;
+	while (cam->opcodes->length < n) {
+		if (vcam_get_opcode(cam, next) == NULL)
+			vcam_register_opcode(cam, next, dummy_write, NULL);
+		next++;
+		if (next == 0xa000) next = 0xc000;
+	}
+	return cam->opcodes->length;
+}
+
+static void codes(vcam *cam, int *codes, int n) {
+	for (int i = 0; i < n; i++)
+		codes[i] = cam->opcodes->handlers[i].code;
+}
+
+static uintptr_t table_find(vcam *cam, int code) {
+	return (uintptr_t)vcam_get_opcode(cam, code);
+}
+
+static uintptr_t linear_find(vcam *cam, int code) {
+	for (int i = 0; i < cam->opcodes->length; i++) {
+		if (cam->opcodes->handlers[i].code == code) return (uintptr_t)&cam->opcodes->handlers[i];
+	}
+	return 0;
+}
+
+int main(void) {
+	const struct LookupBench b = {
+		.header = "opcodes   table ns/lookup   list scan ns/lookup",
+		.grow = grow,
+		.codes = codes,
+		.lookup = table_find,
+		.scan = linear_find,
+	};
+	const int sizes[] = {64, 256, 1024, 4096, 16384};
+	return bench_run(&b, sizes, sizeof(sizes) / sizeof(sizes[0]));
+}
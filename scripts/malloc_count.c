@@ -0,0 +1,45 @@
+// Counts heap allocations of a process, to check the transaction path doesn't allocate
+// cc -shared -fPIC scripts/malloc_count.c -o malloc_count.so
+// LD_PRELOAD=./malloc_count.so ./vcam canon_1300d tcp --sessions 100 &
+// ./ptpip_load 127.0.0.1 100 1000 $!
+// SIGUSR2 prints the allocations since the previous SIGUSR2 and starts counting again,
+// ptpip_load sends it after its warmup round and after the last round.
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static void report(int sig) {
+	(void)sig;
+	char buffer[64];
+	unsigned long n = __atomic_exchange_n(&allocations, 0, __ATOMIC_RELAXED);
+	int length = snprintf(buffer, sizeof(buffer), "malloc_count: %lu allocations\n", n);
+	write(2, buffer, (size_t)length);
+}
+
+__attribute__((constructor)) static void init(void) {
+	signal(SIGUSR2, report);
+}
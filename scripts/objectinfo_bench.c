@@ -0,0 +1,145 @@
+// ObjectInfo benchmark: enumerates a card like Windows and gphoto2 do (GetObjectHandles, then GetObjectInfo for
+// every handle) twice, the first pass fills the ObjectInfo cache and the second one is served from it
+// make libusb-vcam.so
+// cc -O2 -I. -Isrc -Iusb scripts/objectinfo_bench.c -L. -lusb-vcam -lexif -Wl,-rpath=. -o objectinfo_bench
+// ./objectinfo_bench bin/test.jpg 1000
+// The card is made of copies of the JPEG in a temporary folder. vcam's log is sent to /dev/null.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vcam.h>
+
+#define PTP_OC_OpenSession			0x1002
+#define PTP_OC_GetObjectHandles		0x1007
+#define PTP_OC_GetObjectInfo		0x1008
+#define PTP_RC_OK					0x2001
+
+static uint32_t transaction = 0;
+
+// Run a command, the data phase (if any) goes to data. Returns the response code.
+static uint16_t command(vcam *cam, uint16_t code, int nparams, const uint32_t *params, uint8_t *data, uint32_t *data_length) {
+	uint8_t c[32];
+	uint32_t length = 12 + 4 * (uint32_t)nparams;
+	uint16_t type = 1;
+	memcpy(c, &length, 4);
+	memcpy(c + 4, &type, 2);
+	memcpy(c + 6, &code, 2);
+	memcpy(c + 8, &transaction, 4);
+	memcpy(c + 12, params, 4 * (size_t)nparams);
+	transaction++;
+	vcam_write(cam, 2, c, (int)length);
+
+	while (vcam_read_pending(cam) >= 12) {
+		uint8_t header[12];
+		vcam_read(cam, 1, header, 12);
+		memcpy(&length, header, 4);
+		memcpy(&type, header + 4, 2);
+		if (type == 3) {
+			uint16_t rc;
+			memcpy(&rc, header + 6, 2);
+			// Response parameters aren't used here
+			uint8_t rest[20];
+			vcam_read(cam, 1, rest, (int)length - 12);
+			return rc;
+		}
+		uint32_t n = length - 12;
+		if (data != NULL) vcam_read(cam, 1, data, (int)n);
+		else {
+			uint8_t skip[4096];
+			for (uint32_t left = n; left; left -= (uint32_t)vcam_read(cam, 1, skip, left > sizeof(skip) ? sizeof(skip) : (int)left));
+		}
+		if (data_length) (*data_length) = n;
+	}
+	return 0;
+}
+
+// GetObjectInfo for every handle, returns microseconds taken
+static uint64_t enumerate(vcam *cam, const uint8_t *handles, uint32_t count) {
+	uint8_t info[2048];
+	uint64_t start = now_us();
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t handle;
+		memcpy(&handle, handles + 4 + 4 * i, 4);
+		if (command(cam, PTP_OC_GetObjectInfo, 1, &handle, info, NULL) != PTP_RC_OK) {
+			fprintf(stderr, "GetObjectInfo 0x%x failed\n", handle);
+			exit(1);
+		}
+	}
+	return now_us() - start;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: objectinfo_bench <jpeg> <number of copies>\n");
+		return 1;
+	}
+	int copies = atoi(argv[2]);
+
+	FILE *f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *jpeg = malloc((size_t)size);
+	if (fread(jpeg, 1, (size_t)size, f) != (size_t)size) return 1;
+	fclose(f);
+
+	char card[] = "/tmp/vcam_cardXXXXXX";
+	if (mkdtemp(card) == NULL) return 1;
+	char path[256];
+	snprintf(path, sizeof(path), "%s/DCIM", card);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/DCIM/100CANON", card);
+	mkdir(path, 0755);
+	for (int i = 0; i < copies; i++) {
+		snprintf(path, sizeof(path), "%s/DCIM/100CANON/IMG_%05d.JPG", card, i);
+		f = fopen(path, "wb");
+		fwrite(jpeg, 1, (size_t)size, f);
+		fclose(f);
+	}
+
+	if (freopen("/dev/null", "w", stdout) == NULL) return 1;
+
+	vcam *cam = vcam_init_standard();
+	cam->vcamera_filesystem = card;
+
+	uint32_t session = 1;
+	command(cam, PTP_OC_OpenSession, 1, &session, NULL, NULL);
+
+	uint64_t start = now_us();
+	uint32_t handles_params[3] = {0xffffffff, 0, 0};
+	uint8_t *handles = malloc(4 + 4 * ((size_t)copies + 16));
+	uint32_t handles_length = 0;
+	command(cam, PTP_OC_GetObjectHandles, 3, handles_params, handles, &handles_length);
+	uint64_t scan = now_us() - start;
+	uint32_t count;
+	memcpy(&count, handles, 4);
+
+	uint64_t cold = enumerate(cam, handles, count);
+	uint64_t warm = enumerate(cam, handles, count);
+
+	fprintf(stderr, "%u objects of %ld bytes, GetObjectHandles %.1f ms\n", count, size, (double)scan / 1000);
+	fprintf(stderr, "cold: %.1f ms, %.1f us per GetObjectInfo\n", (double)cold / 1000, (double)cold / count);
+	fprintf(stderr, "warm: %.1f ms, %.1f us per GetObjectInfo\n", (double)warm / 1000, (double)warm / count);
+
+	vcam_close(cam);
+	free(cam);
+	free(handles);
+	free(jpeg);
+	for (int i = 0; i < copies; i++) {
+		snprintf(path, sizeof(path), "%s/DCIM/100CANON/IMG_%05d.JPG", card, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/DCIM/100CANON", card);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/DCIM", card);
+	rmdir(path);
+	rmdir(card);
+	return 0;
+}
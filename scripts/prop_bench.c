@@ -0,0 +1,53 @@
+// Property lookup benchmark: reads property values through vcam_get_prop_data with more and more properties
+// registered, next to a scan of the property list like every lookup did before the index
+// make libusb-vcam.so
+// cc -O2 -I. -Isrc -Iusb scripts/prop_bench.c -L. -lusb-vcam -Wl,-rpath=. -o prop_bench && ./prop_bench
+#include <ptp.h>
+#include "bench.h"
+
+// EOS style vendor properties, 0xD100 and up
+static int grow(vcam *cam, int n) {
+	static int next = 0xd100;
+	while (cam->props->length < n) {
+		if (vcam_get_prop(cam, next) == NULL) {
+			uint16_t value = (uint16_t)next;
+			struct PtpPropDesc desc = {0};
+			desc.DevicePropertyCode = (uint16_t)next;
+			desc.DataType = PTP_TC_UINT16;
+			desc.GetSet = 1;
+			vcam_register_prop(cam, next, &desc);
+			vcam_set_prop_data(cam, next, &value, sizeof(value));
+		}
+		next++;
+	}
+	return cam->props->length;
+}
+
+static void codes(vcam *cam, int *codes, int n) {
+	for (int i = 0; i < n; i++)
+		codes[i] = cam->props->handlers[i]->code;
+}
+
+static uintptr_t index_find(vcam *cam, int code) {
+	int length;
+	return (uintptr_t)vcam_get_prop_data(cam, code, &length);
+}
+
+static uintptr_t linear_find(vcam *cam, int code) {
+	for (int i = 0; i < cam->props->length; i++) {
+		if (cam->props->handlers[i]->code == code) return (uintptr_t)cam->props->handlers[i];
+	}
+	return 0;
+}
+
+int main(void) {
+	const struct LookupBench b = {
+		.header = "  props   index ns/lookup   list scan ns/lookup",
+		.grow = grow,
+		.codes = codes,
+		.lookup = index_find,
+		.scan = linear_find,
+	};
+	const int sizes[] = {64, 256, 1024, 4096, 8192};
+	return bench_run(&b, sizes, sizeof(sizes) / sizeof(sizes[0]));
+}
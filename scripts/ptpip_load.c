@@ -0,0 +1,212 @@
+// Load test for the PTP/IP server: opens many initiators at once and times their commands
+// cc scripts/ptpip_load.c -o ptpip_load
+// ./vcam canon_1300d tcp --sessions 500 &
+// ./ptpip_load 127.0.0.1 500 100 [pid]
+// Every round sends GetDeviceInfo on all connections before reading any response,
+// so each command waits behind the others like it would with that many live clients.
+// With a pid, SIGUSR2 is sent to it after the first round and after the last one, see malloc_count.c
+#include <arpa/inet.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define PTP_IP_PORT 15740
+
+#define PTPIP_INIT_COMMAND_REQ	0x1
+#define PTPIP_INIT_COMMAND_ACK	0x2
+#define PTPIP_INIT_EVENT_REQ	0x3
+#define PTPIP_INIT_EVENT_ACK	0x4
+#define PTPIP_COMMAND_REQUEST	0x6
+#define PTPIP_COMMAND_RESPONSE	0x7
+
+#define PTP_OC_GetDeviceInfo	0x1001
+#define PTP_OC_OpenSession		0x1002
+
+struct Conn {
+	int cmd;
+	int event;
+	uint32_t transaction;
+	uint64_t sent;
+};
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int connect_to(const char *ip, int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &sa.sin_addr);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+	return fd;
+}
+
+static int recv_all(int fd, void *buffer, size_t length) {
+	size_t got = 0;
+	while (got < length) {
+		ssize_t size = recv(fd, (uint8_t *)buffer + got, length - got, 0);
+		if (size <= 0) return -1;
+		got += (size_t)size;
+	}
+	return 0;
+}
+
+// Read one packet, returns its type and skips its body
+static int recv_packet(int fd, uint8_t *buffer, size_t max) {
+	uint32_t header[2];
+	if (recv_all(fd, header, 8)) return -1;
+	if (header[0] < 8) return -1;
+	size_t left = header[0] - 8;
+	while (left) {
+		size_t n = left < max ? left : max;
+		if (recv_all(fd, buffer, n)) return -1;
+		left -= n;
+	}
+	return (int)header[1];
+}
+
+static int send_command(struct Conn *c, uint16_t code, int nparams, uint32_t param) {
+	uint8_t packet[22];
+	uint32_t length = 18 + (uint32_t)nparams * 4;
+	uint32_t type = PTPIP_COMMAND_REQUEST;
+	uint32_t data_phase = 1;
+	memcpy(packet, &length, 4);
+	memcpy(packet + 4, &type, 4);
+	memcpy(packet + 8, &data_phase, 4);
+	memcpy(packet + 12, &code, 2);
+	memcpy(packet + 14, &c->transaction, 4);
+	memcpy(packet + 18, &param, 4);
+	c->transaction++;
+	c->sent = now_us();
+	return send(c->cmd, packet, length, 0) == (ssize_t)length ? 0 : -1;
+}
+
+static int wait_response(struct Conn *c) {
+	uint8_t buffer[4096];
+	while (1) {
+		int type = recv_packet(c->cmd, buffer, sizeof(buffer));
+		if (type < 0) return -1;
+		if (type == PTPIP_COMMAND_RESPONSE) return 0;
+	}
+}
+
+static int open_conn(struct Conn *c, const char *ip) {
+	c->cmd = connect_to(ip, PTP_IP_PORT);
+	if (c->cmd < 0) return -1;
+
+	uint8_t init[40] = {0};
+	uint32_t length = sizeof(init);
+	uint32_t type = PTPIP_INIT_COMMAND_REQ;
+	memcpy(init, &length, 4);
+	memcpy(init + 4, &type, 4);
+	if (send(c->cmd, init, sizeof(init), 0) != sizeof(init)) return -1;
+
+	uint8_t ack[64];
+	uint32_t header[2];
+	if (recv_all(c->cmd, header, 8) || header[1] != PTPIP_INIT_COMMAND_ACK || header[0] > sizeof(ack) + 8) return -1;
+	if (recv_all(c->cmd, ack, header[0] - 8)) return -1;
+	uint32_t conn_number;
+	memcpy(&conn_number, ack, 4);
+
+	c->event = connect_to(ip, PTP_IP_PORT);
+	if (c->event < 0) return -1;
+	uint32_t event_req[3] = {12, PTPIP_INIT_EVENT_REQ, conn_number};
+	if (send(c->event, event_req, sizeof(event_req), 0) != sizeof(event_req)) return -1;
+	if (recv_all(c->event, header, 8) || header[1] != PTPIP_INIT_EVENT_ACK) return -1;
+
+	c->transaction = 0;
+	if (send_command(c, PTP_OC_OpenSession, 1, 1)) return -1;
+	return wait_response(c);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+	const char *ip = argc > 1 ? argv[1] : "127.0.0.1";
+	int n = argc > 2 ? atoi(argv[2]) : 100;
+	int rounds = argc > 3 ? atoi(argv[3]) : 50;
+	pid_t server = argc > 4 ? (pid_t)atoi(argv[4]) : 0;
+
+	struct Conn *conns = calloc((size_t)n, sizeof(struct Conn));
+	uint64_t *latency = malloc(sizeof(uint64_t) * (size_t)n * (size_t)rounds);
+	if (conns == NULL || latency == NULL) abort();
+
+	int open = 0;
+	for (int i = 0; i < n; i++) {
+		if (open_conn(&conns[i], ip)) {
+			printf("Connection %d failed\n", i);
+			break;
+		}
+		open++;
+	}
+
+	size_t samples = 0;
+	size_t warm = 0;
+	int failed = 0;
+	uint64_t start = now_us();
+	for (int r = 0; r < rounds && !failed; r++) {
+		for (int i = 0; i < open; i++) {
+			if (send_command(&conns[i], PTP_OC_GetDeviceInfo, 0, 0)) failed = 1;
+		}
+		for (int i = 0; i < open && !failed; i++) {
+			if (wait_response(&conns[i])) {
+				printf("Connection %d dropped\n", i);
+				failed = 1;
+				break;
+			}
+			latency[samples++] = now_us() - conns[i].sent;
+		}
+		// Sessions, buffers and caches are set up by now
+		if (r == 0 && server) {
+			kill(server, SIGUSR2);
+			warm = samples;
+		}
+	}
+	if (server) {
+		// Let the server finish with the last responses before it reports
+		usleep(100000);
+		kill(server, SIGUSR2);
+		printf("%zu commands after the first round\n", samples - warm);
+	}
+	uint64_t elapsed = now_us() - start;
+
+	qsort(latency, samples, sizeof(uint64_t), cmp_u64);
+	printf("%d/%d connections served, %zu commands in %.2f s\n", open, n, samples, (double)elapsed / 1e6);
+	if (samples) {
+		printf("latency p50 %lu us, p99 %lu us, max %lu us\n",
+			(unsigned long)latency[samples / 2],
+			(unsigned long)latency[(samples * 99 - 1) / 100],
+			(unsigned long)latency[samples - 1]);
+	}
+
+	for (int i = 0; i < open; i++) {
+		close(conns[i].cmd);
+		close(conns[i].event);
+	}
+	free(conns);
+	free(latency);
+	return failed || open != n;
+}
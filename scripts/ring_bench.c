@@ -0,0 +1,84 @@
+// Bulk queue benchmark: queues a GetObject sized data phase and reads it back in URB sized steps, through
+// VcamRing and through the flat realloc+memmove buffer the bulk queues used before
+// make libusb-vcam.so
+// cc -O2 -I. -Isrc -Iusb scripts/ring_bench.c -L. -lusb-vcam -Wl,-rpath=. -o ring_bench && ./ring_bench
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <bulk.h>
+
+// Skip the flat buffer once it would have to move more than this many bytes in total
+#define FLAT_MAX_COPY (32ULL << 30)
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// The old inbulk: append with realloc, and move the rest down after every read
+struct Flat {
+	uint8_t *data;
+	size_t length;
+};
+
+static void flat_append(struct Flat *f, const void *data, size_t n) {
+	f->data = realloc(f->data, f->length + n);
+	if (f->data == NULL) abort();
+	memcpy(f->data + f->length, data, n);
+	f->length += n;
+}
+
+static size_t flat_read(struct Flat *f, void *dest, size_t n) {
+	if (n > f->length) n = f->length;
+	memcpy(dest, f->data, n);
+	memmove(f->data, f->data + n, f->length - n);
+	f->length -= n;
+	return n;
+}
+
+static double mbps(size_t bytes, uint64_t ns) {
+	return (double)bytes / ((double)ns / 1e9) / 1e6;
+}
+
+int main(void) {
+	size_t sizes[] = {1 << 20, 4 << 20, 16 << 20, 64 << 20};
+	size_t steps[] = {512, 16384, VCAM_RING_STEP};
+	uint8_t header[12] = {0};
+	uint8_t *urb = malloc(VCAM_RING_STEP);
+
+	printf("object MiB   read size   flat MB/s   ring MB/s\n");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint8_t *object = malloc(sizes[s]);
+		memset(object, 0xab, sizes[s]);
+		for (size_t k = 0; k < sizeof(steps) / sizeof(steps[0]); k++) {
+			size_t total = sizes[s] + sizeof(header);
+			char flat_result[32] = "-";
+			if ((unsigned long long)(total / steps[k]) * (total / 2) <= FLAT_MAX_COPY) {
+				struct Flat f = {0};
+				uint64_t start = now_ns();
+				flat_append(&f, header, sizeof(header));
+				flat_append(&f, object, sizes[s]);
+				while (flat_read(&f, urb, steps[k]));
+				snprintf(flat_result, sizeof(flat_result), "%.0f", mbps(total, now_ns() - start));
+				free(f.data);
+			}
+
+			struct VcamRing r = {0};
+			uint64_t start = now_ns();
+			vcam_ring_append(&r, header, sizeof(header));
+			vcam_ring_append(&r, object, sizes[s]);
+			while (vcam_ring_read(&r, urb, steps[k]));
+			double ring = mbps(total, now_ns() - start);
+			vcam_ring_free(&r);
+
+			printf("%10zu   %9zu   %9s   %9.0f\n", sizes[s] >> 20, steps[k], flat_result, ring);
+		}
+		free(object);
+	}
+
+	free(urb);
+	return 0;
+}
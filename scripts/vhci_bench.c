@@ -0,0 +1,234 @@
+// Bulk throughput benchmark for the vhci backend. It takes the kernel's side of the usbip connection on a unix
+// socket, so it needs neither vhci-hcd nor root, and keeps several transfers in flight like an async host would:
+// cc -O2 scripts/vhci_bench.c -o vhci_bench
+// ./vhci_bench /tmp/vhci.sock [transfers in flight] [transfer KiB] &
+// VCAM_VHCI_HOST=/tmp/vhci.sock ./vcam canon_1300d vhci --fs <folder with a large file> > /dev/null
+// Downloads the largest object with GetObject (IN) and sends as much with SetDevicePropValue (OUT), five times each
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../usb/usbip.h"
+
+#define PTP_OC_OpenSession			0x1002
+#define PTP_OC_GetObjectHandles		0x1007
+#define PTP_OC_GetObjectInfo		0x1008
+#define PTP_OC_GetObject			0x1009
+#define PTP_OC_SetDevicePropValue	0x1016
+#define PTP_DPC_SessionInitiatorInfo	0xd406
+
+#define EP_IN 1
+#define EP_OUT 2
+#define ROUNDS 5
+
+static int fd;
+static uint32_t seqnum = 1;
+static uint32_t transaction = 1;
+static int in_flight = 4;
+static int transfer_size = 1024 * 1024;
+static int outstanding = 0;
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void recv_all(void *data, size_t length) {
+	if (recv(fd, data, length, MSG_WAITALL) != (ssize_t)length) {
+		printf("Device went away\n");
+		exit(1);
+	}
+}
+
+static void send_all(const void *data, size_t length) {
+	if (send(fd, data, length, MSG_NOSIGNAL) != (ssize_t)length) {
+		printf("Device went away\n");
+		exit(1);
+	}
+}
+
+static void submit(uint32_t dir, uint32_t ep, const void *data, int length) {
+	struct usbip_header h = {0};
+	h.base.command = htonl(USBIP_CMD_SUBMIT);
+	h.base.seqnum = htonl(seqnum++);
+	h.base.devid = htonl(1);
+	h.base.direction = htonl(dir);
+	h.base.ep = htonl(ep);
+	h.u.cmd_submit.transfer_buffer_length = (int32_t)htonl((uint32_t)length);
+	send_all(&h, sizeof(h));
+	if (dir == USBIP_DIR_OUT) send_all(data, (size_t)length);
+}
+
+// Wait for the next RET_SUBMIT, IN data goes to `data`
+static int wait_ret(void *data) {
+	struct usbip_header h;
+	recv_all(&h, sizeof(h));
+	if (ntohl(h.base.command) != USBIP_RET_SUBMIT || h.u.ret_submit.status != 0) {
+		printf("Transfer failed\n");
+		exit(1);
+	}
+	int length = (int)ntohl((uint32_t)h.u.ret_submit.actual_length);
+	if (ntohl(h.base.direction) == USBIP_DIR_IN && length) recv_all(data, (size_t)length);
+	return length;
+}
+
+static void command(uint16_t code, int nparams, const uint32_t *params) {
+	uint8_t c[32];
+	uint32_t length = 12 + 4 * (uint32_t)nparams;
+	memcpy(c, &length, 4);
+	uint16_t type = 1;
+	memcpy(c + 4, &type, 2);
+	memcpy(c + 6, &code, 2);
+	memcpy(c + 8, &transaction, 4);
+	memcpy(c + 12, params, 4 * (size_t)nparams);
+	submit(USBIP_DIR_OUT, EP_OUT, c, (int)length);
+	wait_ret(NULL);
+}
+
+// Read the data phase (if any) into `data`, then the response. Keeps in_flight IN transfers queued throughout,
+// the ones left over are picked up by the next transaction.
+static uint16_t read_phases(uint8_t *data, uint32_t *data_length) {
+	uint8_t *buffer = malloc((size_t)transfer_size);
+	uint32_t got = 0, want = 0;
+	int in_data = 0;
+	uint16_t rc = 0;
+	while (1) {
+		while (outstanding < in_flight) {
+			submit(USBIP_DIR_IN, EP_IN, NULL, transfer_size);
+			outstanding++;
+		}
+		int n = wait_ret(buffer);
+		outstanding--;
+		if (!in_data) {
+			uint32_t length;
+			uint16_t type;
+			memcpy(&length, buffer, 4);
+			memcpy(&type, buffer + 4, 2);
+			if (type == 3) {
+				memcpy(&rc, buffer + 6, 2);
+				break;
+			}
+			in_data = 1;
+			want = length - 12;
+			if (data) memcpy(data, buffer + 12, (size_t)n - 12);
+			got = (uint32_t)n - 12;
+		} else {
+			if (data) memcpy(data + got, buffer, (size_t)n);
+			got += (uint32_t)n;
+		}
+		if (in_data && got >= want) in_data = 0;
+	}
+	free(buffer);
+	if (data_length) (*data_length) = got;
+	return rc;
+}
+
+// `container` has 12 bytes of room for the header before the data
+static void send_data(uint16_t code, uint8_t *container, uint32_t length) {
+	uint32_t total = 12 + length;
+	uint16_t type = 2;
+	memcpy(container, &total, 4);
+	memcpy(container + 4, &type, 2);
+	memcpy(container + 6, &code, 2);
+	memcpy(container + 8, &transaction, 4);
+	for (uint32_t of = 0; of < total; of += (uint32_t)transfer_size) {
+		uint32_t n = total - of < (uint32_t)transfer_size ? total - of : (uint32_t)transfer_size;
+		submit(USBIP_DIR_OUT, EP_OUT, container + of, (int)n);
+		wait_ret(NULL);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf("Usage: vhci_bench <socket> [transfers in flight] [transfer KiB]\n");
+		return 1;
+	}
+	if (argc > 2) in_flight = atoi(argv[2]);
+	if (argc > 3) transfer_size = atoi(argv[3]) * 1024;
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	unlink(argv[1]);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 1)) {
+		perror("bind");
+		return 1;
+	}
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0) return 1;
+
+	uint32_t session = 1;
+	command(PTP_OC_OpenSession, 1, &session);
+	read_phases(NULL, NULL);
+	transaction++;
+
+	uint32_t handles_params[3] = {0xffffffff, 0, 0};
+	uint8_t *handles = malloc(1024 * 1024);
+	uint32_t handles_length;
+	command(PTP_OC_GetObjectHandles, 3, handles_params);
+	read_phases(handles, &handles_length);
+	transaction++;
+
+	uint32_t count, largest = 0, largest_size = 0;
+	memcpy(&count, handles, 4);
+	for (uint32_t i = 0; i < count && 4 + 4 * i < handles_length; i++) {
+		uint32_t handle, size;
+		uint8_t info[1024];
+		memcpy(&handle, handles + 4 + 4 * i, 4);
+		command(PTP_OC_GetObjectInfo, 1, &handle);
+		read_phases(info, NULL);
+		transaction++;
+		memcpy(&size, info + 8, 4);
+		if (size > largest_size) {
+			largest = handle;
+			largest_size = size;
+		}
+	}
+	free(handles);
+	if (largest_size == 0) {
+		printf("No objects to download, pass --fs with some files\n");
+		return 1;
+	}
+
+	uint8_t *container = malloc(12 + (size_t)largest_size);
+	uint8_t *object = container + 12;
+	uint64_t start = now_us();
+	for (int i = 0; i < ROUNDS; i++) {
+		command(PTP_OC_GetObject, 1, &largest);
+		uint32_t got;
+		uint16_t rc = read_phases(object, &got);
+		transaction++;
+		if (rc != 0x2001 || got != largest_size) {
+			printf("GetObject failed %x, %u of %u bytes\n", rc, got, largest_size);
+			return 1;
+		}
+	}
+	double seconds = (double)(now_us() - start) / 1e6;
+	printf("IN:  %u bytes x%d, %d x %d KiB transfers in flight: %.0f MB/s\n",
+		largest_size, ROUNDS, in_flight, transfer_size / 1024, largest_size * (double)ROUNDS / seconds / 1e6);
+
+	uint32_t prop = PTP_DPC_SessionInitiatorInfo;
+	start = now_us();
+	for (int i = 0; i < ROUNDS; i++) {
+		command(PTP_OC_SetDevicePropValue, 1, &prop);
+		send_data(PTP_OC_SetDevicePropValue, container, largest_size);
+		read_phases(NULL, NULL);
+		transaction++;
+	}
+	seconds = (double)(now_us() - start) / 1e6;
+	printf("OUT: %u bytes x%d, %d KiB transfers: %.0f MB/s\n",
+		largest_size, ROUNDS, transfer_size / 1024, largest_size * (double)ROUNDS / seconds / 1e6);
+
+	free(container);
+	close(fd);
+	close(listener);
+	unlink(argv[1]);
+	return 0;
+}
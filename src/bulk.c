@@ -0,0 +1,363 @@
+// Ring buffers and segment queues for the bulk endpoints
+// Appending and consuming are O(1) (amortized over growth), so reading a large
+// data phase in small URBs no longer moves the rest of the queue every time.
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "bulk.h"
+
+// Don't hold on to huge buffers once a large transfer has been drained
+#define RING_KEEP_CAPACITY (1024 * 1024)
+
+void vcam_ring_free(struct VcamRing *r) {
+	free(r->data);
+	memset(r, 0, sizeof(struct VcamRing));
+}
+
+// Reallocate to new_capacity with the queued bytes moved to offset 0
+static void ring_resize(struct VcamRing *r, size_t new_capacity) {
+	uint8_t *data = malloc(new_capacity);
+	if (data == NULL) abort();
+	vcam_ring_peek(r, data, r->length);
+	free(r->data);
+	r->data = data;
+	r->capacity = new_capacity;
+	r->head = 0;
+}
+
+static void ring_grow(struct VcamRing *r, size_t n) {
+	if (r->length + n > r->capacity) {
+		size_t capacity = r->capacity ? r->capacity : 4096;
+		while (capacity < r->length + n)
+			capacity *= 2;
+		ring_resize(r, capacity);
+	}
+}
+
+void vcam_ring_append(struct VcamRing *r, const void *data, size_t n) {
+	if (n == 0) return;
+	ring_grow(r, n);
+
+	size_t tail = (r->head + r->length) & (r->capacity - 1);
+	size_t first = r->capacity - tail;
+	if (first > n) first = n;
+	memcpy(r->data + tail, data, first);
+	memcpy(r->data, (const uint8_t *)data + first, n - first);
+	r->length += n;
+}
+
+size_t vcam_ring_peek(const struct VcamRing *r, void *dest, size_t n) {
+	if (n > r->length) n = r->length;
+	if (n == 0) return 0;
+	size_t first = r->capacity - r->head;
+	if (first > n) first = n;
+	memcpy(dest, r->data + r->head, first);
+	memcpy((uint8_t *)dest + first, r->data, n - first);
+	return n;
+}
+
+void vcam_ring_consume(struct VcamRing *r, size_t n) {
+	if (n > r->length) n = r->length;
+	r->length -= n;
+	if (r->length == 0) {
+		r->head = 0;
+		if (r->capacity > RING_KEEP_CAPACITY) vcam_ring_free(r);
+		return;
+	}
+	r->head = (r->head + n) & (r->capacity - 1);
+}
+
+size_t vcam_ring_read(struct VcamRing *r, void *dest, size_t n) {
+	n = vcam_ring_peek(r, dest, n);
+	vcam_ring_consume(r, n);
+	return n;
+}
+
+const uint8_t *vcam_ring_contig(const struct VcamRing *r, size_t *n) {
+	if (r->length == 0) {
+		(*n) = 0;
+		return NULL;
+	}
+	size_t span = r->capacity - r->head;
+	if (span > r->length) span = r->length;
+	if (span > VCAM_RING_STEP) span = VCAM_RING_STEP;
+	(*n) = span;
+	return r->data + r->head;
+}
+
+uint8_t *vcam_ring_linearize(struct VcamRing *r, size_t n) {
+	if (r->length == 0) return NULL;
+	if (r->head + n > r->capacity) {
+		ring_resize(r, r->capacity);
+	}
+	return r->data + r->head;
+}
+
+// Describe up to n bytes starting `offset` bytes into the ring, needs at most two iovecs
+// Returns the number of iovecs filled, *described is the number of bytes they cover
+static int ring_spans(const struct VcamRing *r, size_t offset, size_t n, struct iovec *iov, int max_iov, size_t *described) {
+	size_t start = (r->head + offset) & (r->capacity - 1);
+	size_t first = r->capacity - start;
+	if (first > n) first = n;
+	iov[0].iov_base = r->data + start;
+	iov[0].iov_len = first;
+	(*described) = first;
+	if (first == n || max_iov < 2) return 1;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = n - first;
+	(*described) = n;
+	return 2;
+}
+
+int vcam_ring_reserve(struct VcamRing *r, size_t n, struct iovec iov[2]) {
+	if (n == 0) return 0;
+	ring_grow(r, n);
+	size_t described;
+	return ring_spans(r, r->length, n, iov, 2, &described);
+}
+
+void vcam_ring_commit(struct VcamRing *r, size_t n) {
+	r->length += n;
+}
+
+void vcam_seg_free(void *arg, void *data, size_t length) {
+	(void)arg;
+	(void)length;
+	free(data);
+}
+
+void vcam_seg_munmap(void *arg, void *data, size_t length) {
+	(void)arg;
+	munmap(data, length);
+}
+
+// Make sure the window of a file segment covers its next unsent byte
+// Returns the bytes available there, never 0 for a non-empty segment
+// Files are pread rather than mmap'd: a file on the card being truncated mid-transfer must not SIGBUS
+static uint8_t *file_window(struct VcamBulkQueue *q, struct VcamSeg *seg, size_t *n) {
+	if (seg->buffer == NULL) {
+		if (q->spare != NULL && q->spare_size == seg->window) {
+			seg->buffer = q->spare;
+			q->spare = NULL;
+		} else {
+			seg->buffer = malloc(seg->window);
+			if (seg->buffer == NULL) abort();
+		}
+		seg->buffer_length = 0;
+	}
+
+	if (seg->offset < seg->buffer_offset || seg->offset >= seg->buffer_offset + (off_t)seg->buffer_length) {
+		size_t length = seg->length < seg->window ? seg->length : seg->window;
+		ssize_t rc = pread(seg->fd, seg->buffer, length, seg->offset);
+		// The file got shorter than promised in the container header, pad it
+		if (rc < 0) rc = 0;
+		memset(seg->buffer + rc, 0, length - rc);
+		seg->buffer_offset = seg->offset;
+		seg->buffer_length = length;
+	}
+
+	size_t skip = (size_t)(seg->offset - seg->buffer_offset);
+	(*n) = seg->buffer_length - skip;
+	if ((*n) > seg->length) (*n) = seg->length;
+	return seg->buffer + skip;
+}
+
+static void file_release(struct VcamBulkQueue *q, struct VcamSeg *seg) {
+	// Keep one window around for the next object
+	if (seg->buffer != NULL && q->spare == NULL) {
+		q->spare = seg->buffer;
+		q->spare_size = seg->window;
+	} else {
+		free(seg->buffer);
+	}
+	close(seg->fd);
+}
+
+static inline struct VcamSeg *queue_seg(const struct VcamBulkQueue *q, size_t i) {
+	return &q->segs[(q->seg_head + i) & (q->seg_capacity - 1)];
+}
+
+static struct VcamSeg *queue_push(struct VcamBulkQueue *q) {
+	if (q->seg_count == q->seg_capacity) {
+		size_t capacity = q->seg_capacity ? q->seg_capacity * 2 : 16;
+		struct VcamSeg *segs = malloc(sizeof(struct VcamSeg) * capacity);
+		if (segs == NULL) abort();
+		for (size_t i = 0; i < q->seg_count; i++)
+			segs[i] = *queue_seg(q, i);
+		free(q->segs);
+		q->segs = segs;
+		q->seg_capacity = capacity;
+		q->seg_head = 0;
+	}
+	struct VcamSeg *seg = queue_seg(q, q->seg_count);
+	memset(seg, 0, sizeof(struct VcamSeg));
+	q->seg_count++;
+	return seg;
+}
+
+static void queue_pop(struct VcamBulkQueue *q) {
+	struct VcamSeg *seg = queue_seg(q, 0);
+	if (seg->kind == VCAM_SEG_FILE)
+		file_release(q, seg);
+	else if (seg->release != NULL)
+		seg->release(seg->arg, seg->base, seg->base_length);
+	q->seg_head = (q->seg_head + 1) & (q->seg_capacity - 1);
+	q->seg_count--;
+}
+
+void vcam_queue_free(struct VcamBulkQueue *q) {
+	while (q->seg_count)
+		queue_pop(q);
+	free(q->segs);
+	free(q->spare);
+	vcam_ring_free(&q->ring);
+	memset(q, 0, sizeof(struct VcamBulkQueue));
+}
+
+void vcam_queue_append(struct VcamBulkQueue *q, const void *data, size_t n) {
+	if (n == 0) return;
+	struct VcamSeg *last = q->seg_count ? queue_seg(q, q->seg_count - 1) : NULL;
+	if (last == NULL || last->kind != VCAM_SEG_RING)
+		last = queue_push(q);
+	last->length += n;
+	vcam_ring_append(&q->ring, data, n);
+	q->length += n;
+}
+
+void vcam_queue_append_ref(struct VcamBulkQueue *q, void *data, size_t n, vcam_seg_release *release, void *arg) {
+	if (n == 0) {
+		if (release != NULL) release(arg, data, n);
+		return;
+	}
+	struct VcamSeg *seg = queue_push(q);
+	seg->kind = VCAM_SEG_MEM;
+	seg->data = data;
+	seg->length = n;
+	seg->release = release;
+	seg->arg = arg;
+	seg->base = data;
+	seg->base_length = n;
+	q->length += n;
+}
+
+void vcam_queue_append_file(struct VcamBulkQueue *q, int fd, off_t offset, size_t n, size_t window) {
+	if (n == 0) {
+		close(fd);
+		return;
+	}
+	posix_fadvise(fd, offset, n, POSIX_FADV_SEQUENTIAL);
+	struct VcamSeg *seg = queue_push(q);
+	seg->kind = VCAM_SEG_FILE;
+	seg->length = n;
+	seg->fd = fd;
+	seg->offset = offset;
+	seg->window = window ? window : VCAM_IO_WINDOW;
+	q->length += n;
+}
+
+int vcam_queue_iov(struct VcamBulkQueue *q, struct iovec *iov, int max_iov, size_t n) {
+	int cnt = 0;
+	size_t ring_offset = 0;
+	for (size_t i = 0; i < q->seg_count && cnt < max_iov && n; i++) {
+		struct VcamSeg *seg = queue_seg(q, i);
+		size_t take = seg->length < n ? seg->length : n;
+		if (seg->kind == VCAM_SEG_RING) {
+			size_t described;
+			cnt += ring_spans(&q->ring, ring_offset, take, &iov[cnt], max_iov - cnt, &described);
+			if (described != take) break;
+			ring_offset += seg->length;
+		} else if (seg->kind == VCAM_SEG_MEM) {
+			iov[cnt].iov_base = seg->data;
+			iov[cnt].iov_len = take;
+			cnt++;
+		} else {
+			size_t avail;
+			iov[cnt].iov_base = file_window(q, seg, &avail);
+			iov[cnt].iov_len = take < avail ? take : avail;
+			cnt++;
+			if (avail < take) break;
+		}
+		n -= take;
+	}
+	return cnt;
+}
+
+size_t vcam_queue_peek(const struct VcamBulkQueue *q, void *dest, size_t n) {
+	size_t ring_offset = 0;
+	size_t copied = 0;
+	if (n > q->length) n = q->length;
+	for (size_t i = 0; i < q->seg_count && copied < n; i++) {
+		struct VcamSeg *seg = queue_seg(q, i);
+		size_t take = seg->length < n - copied ? seg->length : n - copied;
+		if (seg->kind == VCAM_SEG_RING) {
+			struct iovec iov[2];
+			size_t described;
+			int c = ring_spans(&q->ring, ring_offset, take, iov, 2, &described);
+			for (int j = 0; j < c; j++) {
+				memcpy((uint8_t *)dest + copied, iov[j].iov_base, iov[j].iov_len);
+				copied += iov[j].iov_len;
+			}
+			ring_offset += seg->length;
+		} else if (seg->kind == VCAM_SEG_MEM) {
+			memcpy((uint8_t *)dest + copied, seg->data, take);
+			copied += take;
+		} else {
+			// Copy backends read files straight into their own buffer
+			ssize_t rc = pread(seg->fd, (uint8_t *)dest + copied, take, seg->offset);
+			if (rc < 0) rc = 0;
+			memset((uint8_t *)dest + copied + rc, 0, take - rc);
+			copied += take;
+		}
+	}
+	return n;
+}
+
+void vcam_queue_consume(struct VcamBulkQueue *q, size_t n) {
+	if (n > q->length) n = q->length;
+	q->length -= n;
+	while (n) {
+		struct VcamSeg *seg = queue_seg(q, 0);
+		size_t take = seg->length < n ? seg->length : n;
+		if (seg->kind == VCAM_SEG_RING) {
+			vcam_ring_consume(&q->ring, take);
+		} else if (seg->kind == VCAM_SEG_MEM) {
+			seg->data += take;
+		} else {
+			seg->offset += take;
+		}
+		seg->length -= take;
+		n -= take;
+		if (seg->length == 0)
+			queue_pop(q);
+	}
+}
+
+size_t vcam_queue_read(struct VcamBulkQueue *q, void *dest, size_t n) {
+	n = vcam_queue_peek(q, dest, n);
+	vcam_queue_consume(q, n);
+	return n;
+}
+
+const uint8_t *vcam_queue_contig(struct VcamBulkQueue *q, size_t *n) {
+	if (q->seg_count == 0) {
+		(*n) = 0;
+		return NULL;
+	}
+	struct VcamSeg *seg = queue_seg(q, 0);
+	const uint8_t *data;
+	if (seg->kind == VCAM_SEG_RING) {
+		data = vcam_ring_contig(&q->ring, n);
+	} else if (seg->kind == VCAM_SEG_MEM) {
+		data = seg->data;
+		(*n) = seg->length;
+	} else {
+		data = file_window(q, seg, n);
+	}
+	if ((*n) > seg->length) (*n) = seg->length;
+	if ((*n) > VCAM_RING_STEP) (*n) = VCAM_RING_STEP;
+	return data;
+}
@@ -0,0 +1,150 @@
+#ifndef VCAM_BULK_H
+#define VCAM_BULK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/// @brief Largest span handed out by vcam_ring_contig, backends drain the queue in steps of this size
+#define VCAM_RING_STEP (64 * 1024)
+
+/// @brief Default number of bytes of a file segment that are buffered at once
+#define VCAM_IO_WINDOW (1024 * 1024)
+
+/// @brief Growable FIFO byte ring used for the bulk IN/OUT queues
+/// @note A zeroed struct is a valid empty ring
+struct VcamRing {
+	uint8_t *data;
+	/// @brief Always zero or a power of two
+	size_t capacity;
+	/// @brief Offset of the first queued byte
+	size_t head;
+	/// @brief Number of queued bytes
+	size_t length;
+};
+
+void vcam_ring_free(struct VcamRing *r);
+
+/// @brief Append bytes to the end of the ring, growing it if needed
+void vcam_ring_append(struct VcamRing *r, const void *data, size_t n);
+
+/// @brief Copy up to n bytes from the front of the ring without consuming them
+/// @returns number of bytes copied
+size_t vcam_ring_peek(const struct VcamRing *r, void *dest, size_t n);
+
+/// @brief Copy up to n bytes from the front of the ring and consume them
+/// @returns number of bytes copied
+size_t vcam_ring_read(struct VcamRing *r, void *dest, size_t n);
+
+/// @brief Drop n bytes from the front of the ring
+void vcam_ring_consume(struct VcamRing *r, size_t n);
+
+/// @brief Get the first contiguous span of queued bytes, at most VCAM_RING_STEP long
+/// @returns pointer to the span, NULL if the ring is empty
+const uint8_t *vcam_ring_contig(const struct VcamRing *r, size_t *n);
+
+/// @brief Make the first n queued bytes contiguous in memory
+/// @note Only moves data when those bytes wrap around the end of the buffer
+uint8_t *vcam_ring_linearize(struct VcamRing *r, size_t n);
+
+/// @brief Make room for n more bytes and describe it as up to two iovecs, to be filled in place (by recvmsg)
+/// @returns number of iovecs
+int vcam_ring_reserve(struct VcamRing *r, size_t n, struct iovec iov[2]);
+
+/// @brief Append the first n bytes of the space handed out by vcam_ring_reserve
+void vcam_ring_commit(struct VcamRing *r, size_t n);
+
+/// @brief Called once a referenced segment has been fully sent, or dropped
+/// @param data,length The whole region that was passed to vcam_queue_append_ref
+typedef void vcam_seg_release(void *arg, void *data, size_t length);
+
+/// @brief Release callback for segments allocated with malloc
+void vcam_seg_free(void *arg, void *data, size_t length);
+/// @brief Release callback for segments that were mmap'd
+void vcam_seg_munmap(void *arg, void *data, size_t length);
+
+enum VcamSegKind {
+	/// @brief Bytes copied into the queue ring
+	VCAM_SEG_RING,
+	/// @brief Memory referenced in place
+	VCAM_SEG_MEM,
+	/// @brief Part of a file, read a window at a time
+	VCAM_SEG_FILE,
+};
+
+/// @brief A run of queued bytes
+struct VcamSeg {
+	enum VcamSegKind kind;
+	/// @brief Bytes left in this segment
+	size_t length;
+
+	/// @brief VCAM_SEG_MEM: next unsent byte
+	uint8_t *data;
+	/// @note May be NULL for static data
+	vcam_seg_release *release;
+	void *arg;
+	uint8_t *base;
+	size_t base_length;
+
+	/// @brief VCAM_SEG_FILE: the segment owns fd, offset is the next unsent byte
+	int fd;
+	off_t offset;
+	size_t window;
+	/// @brief Window holding the part of the file around offset
+	uint8_t *buffer;
+	off_t buffer_offset;
+	size_t buffer_length;
+};
+
+/// @brief FIFO of segments for the bulk IN queue
+/// Small packets (headers, responses) are copied into a ring, large payloads are referenced,
+/// so a data phase can leave vcam without being staged in one linear buffer.
+/// @note A zeroed struct is a valid empty queue
+struct VcamBulkQueue {
+	struct VcamRing ring;
+	/// @brief Circular array of segments, seg_capacity is zero or a power of two
+	struct VcamSeg *segs;
+	size_t seg_capacity;
+	size_t seg_head;
+	size_t seg_count;
+	/// @brief Total number of queued bytes
+	size_t length;
+	/// @brief File window buffer kept for reuse
+	uint8_t *spare;
+	size_t spare_size;
+};
+
+/// @brief Release all segments and free the queue
+void vcam_queue_free(struct VcamBulkQueue *q);
+
+/// @brief Copy bytes to the end of the queue
+void vcam_queue_append(struct VcamBulkQueue *q, const void *data, size_t n);
+
+/// @brief Queue a region by reference, release is called once it has been consumed
+void vcam_queue_append_ref(struct VcamBulkQueue *q, void *data, size_t n, vcam_seg_release *release, void *arg);
+
+/// @brief Queue n bytes of a file starting at offset, without reading them yet
+/// The queue takes ownership of fd. At most `window` bytes (0 for VCAM_IO_WINDOW) are buffered at once,
+/// copy backends (vcam_queue_read) read straight into their own buffer instead.
+/// If the file turns out to be shorter, the missing bytes are sent as zeros.
+void vcam_queue_append_file(struct VcamBulkQueue *q, int fd, off_t offset, size_t n, size_t window);
+
+/// @brief Copy up to n bytes from the front of the queue without consuming them
+size_t vcam_queue_peek(const struct VcamBulkQueue *q, void *dest, size_t n);
+
+/// @brief Copy up to n bytes from the front of the queue and consume them
+size_t vcam_queue_read(struct VcamBulkQueue *q, void *dest, size_t n);
+
+/// @brief Drop n bytes from the front of the queue, releasing segments that are done
+void vcam_queue_consume(struct VcamBulkQueue *q, size_t n);
+
+/// @brief Get the first contiguous span of queued bytes, at most VCAM_RING_STEP long
+const uint8_t *vcam_queue_contig(struct VcamBulkQueue *q, size_t *n);
+
+/// @brief Describe up to n queued bytes as an iovec list, without consuming them
+/// File segments are only described up to the end of their current window
+/// @returns number of iovecs filled
+int vcam_queue_iov(struct VcamBulkQueue *q, struct iovec *iov, int max_iov, size_t n);
+
+#endif
@@ -1,18 +1,46 @@
 // Emulator for non-standard Canon PTP
 // Copyright Daniel C - GNU Lesser General Public License v2.1
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <vcam.h>
+#include <synth.h>
 
 void canon_register_d4_hidden(vcam *cam);
 void canon_register_base_eos(vcam *cam);
 
+/// @brief Viewfinder payloads ready to send, loaded once per source and shared by every camera using it
+struct EosLiveviewFrames {
+	char *path;
+	uint8_t **frames;
+	uint32_t *lengths;
+	int length;
+	/// @brief Records after the image in the capture, appended to generated frames
+	uint8_t *tail;
+	uint32_t tail_length;
+	struct EosLiveviewFrames *next;
+};
+
 struct CanonBase {
 	int first_events;
 	int lv_ready;
-	int calls_to_liveview;
+	/// @brief Directory of JPEGs or concatenated MJPEG to take liveview frames from, NULL for EOS_LV_JPEG (--lv <path>)
+	const char *lv_path;
+	const struct EosLiveviewFrames *lv;
+	/// @brief CLOCK_MONOTONIC time in microseconds the first frame is ready, 0 until liveview was first polled
+	uint64_t lv_start;
+	/// @brief Frame period the last frame was sent in
+	uint64_t lv_tick;
+	int lv_next;
+	/// @brief Frame generator, when --lv-synth is given
+	struct VcamSynth *synth;
+	/// @brief Set while the last generated frame is still queued
+	int synth_busy;
 };
 static inline struct CanonBase *priv(vcam *cam) {
 	return (struct CanonBase *)cam->priv;
@@ -20,6 +48,11 @@ static inline struct CanonBase *priv(vcam *cam) {
 
 #define EOS_LV_JPEG "bin/eos_liveview.jpg"
 #define EOS_EVENTS_BIN "bin/eos_events.bin"
+#define EOS_LV_DEFAULT_FPS 30
+/// @brief Time from the first GetViewFinderData to the first frame, replies before it are NotReady
+#define EOS_LV_STARTUP_US 150000
+/// @brief Viewfinder data is a list of records, [u32 length][u32 type][data], the image is type 1
+#define EOS_LV_RECORD_IMAGE 1
 
 int canon_init_cam(vcam *cam, const char *name, int argc, const char **argv) {
 	cam->priv = malloc(sizeof(struct CanonBase));
@@ -27,7 +60,13 @@ int canon_init_cam(vcam *cam, const char *name, int argc, const char **argv) {
 
 	p->first_events = 0;
 	p->lv_ready = 0;
-	p->calls_to_liveview = 0;
+	p->lv_path = NULL;
+	p->lv = NULL;
+	p->lv_start = 0;
+	p->lv_tick = 0;
+	p->lv_next = 0;
+	p->synth = NULL;
+	p->synth_busy = 0;
 
 	strcpy(cam->manufac, "Canon Inc.");
 	cam->vendor_id = 0x4a9;
@@ -45,6 +84,23 @@ int canon_init_cam(vcam *cam, const char *name, int argc, const char **argv) {
 		return -1;
 	}
 
+	for (int i = 0; i < argc; i++) {
+		int rc = vcam_parse_args(cam, argc, argv, &i);
+		if (rc < 0) return -1;
+		if (rc) continue;
+		if (!strcmp(argv[i], "--lv")) {
+			if (i + 1 >= argc) {
+				vcam_log("--lv takes a value");
+				return -1;
+			}
+			i++;
+			p->lv_path = argv[i];
+		} else {
+			vcam_log("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+
 	ptp_register_mtp_props(cam);
 	ptp_register_mtp_opcodes(cam);
 	canon_register_base_eos(cam);
@@ -59,17 +115,211 @@ struct EosEventUint {
 	uint32_t value;
 };
 
+static uint8_t *load_file(const char *path, uint32_t *length) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t *buffer = malloc(size > 0 ? (size_t)size : 1);
+	if (buffer == NULL || fread(buffer, 1, (size_t)size, file) != (size_t)size) {
+		free(buffer);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*length = (uint32_t)size;
+	return buffer;
+}
+
+// Wrap a JPEG into an image record, followed by the other records of the captured viewfinder data
+static void lv_add_jpeg(struct EosLiveviewFrames *lv, const uint8_t *jpeg, uint32_t jpeg_length, const uint8_t *tail, uint32_t tail_length) {
+	uint32_t length = 8 + jpeg_length + tail_length;
+	uint8_t *frame = malloc(length);
+	if (frame == NULL) abort();
+	ptp_write_u32(frame, 8 + jpeg_length);
+	ptp_write_u32(frame + 4, EOS_LV_RECORD_IMAGE);
+	memcpy(frame + 8, jpeg, jpeg_length);
+	memcpy(frame + 8 + jpeg_length, tail, tail_length);
+
+	lv->frames = realloc(lv->frames, sizeof(uint8_t *) * (size_t)(lv->length + 1));
+	lv->lengths = realloc(lv->lengths, sizeof(uint32_t) * (size_t)(lv->length + 1));
+	if (lv->frames == NULL || lv->lengths == NULL) abort();
+	lv->frames[lv->length] = frame;
+	lv->lengths[lv->length] = length;
+	lv->length++;
+}
+
+// Split a concatenated MJPEG where one image ends (FF D9) right as the next starts (FF D8)
+static void lv_add_mjpeg(struct EosLiveviewFrames *lv, const uint8_t *data, uint32_t length, const uint8_t *tail, uint32_t tail_length) {
+	uint32_t start = 0;
+	for (uint32_t i = 2; i + 4 <= length; i++) {
+		if (data[i] == 0xff && data[i + 1] == 0xd9 && data[i + 2] == 0xff && data[i + 3] == 0xd8) {
+			lv_add_jpeg(lv, data + start, i + 2 - start, tail, tail_length);
+			start = i + 2;
+		}
+	}
+	if (length - start >= 2 && data[start] == 0xff && data[start + 1] == 0xd8)
+		lv_add_jpeg(lv, data + start, length - start, tail, tail_length);
+}
+
+static int is_jpeg_name(const struct dirent *d) {
+	const char *dot = strrchr(d->d_name, '.');
+	return dot != NULL && (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg"));
+}
+
+static const struct EosLiveviewFrames *lv_load_locked(const char *path) {
+	static struct EosLiveviewFrames *loaded = NULL;
+	for (struct EosLiveviewFrames *lv = loaded; lv != NULL; lv = lv->next) {
+		if ((path == NULL && lv->path == NULL) || (path != NULL && lv->path != NULL && !strcmp(path, lv->path)))
+			return lv;
+	}
+
+	// Every frame carries the records that follow the image in the capture
+	uint32_t capture_length;
+	uint8_t *capture = load_file(PWD "/" EOS_LV_JPEG, &capture_length);
+	if (capture == NULL) {
+		vcam_log("Can't read %s", EOS_LV_JPEG);
+		return NULL;
+	}
+	uint32_t image_length = 0, image_type = 0;
+	if (capture_length >= 8) {
+		ptp_read_u32(capture, &image_length);
+		ptp_read_u32(capture + 4, &image_type);
+	}
+	if (image_type != EOS_LV_RECORD_IMAGE || image_length < 8 || image_length > capture_length) {
+		vcam_log("%s doesn't start with an image record", EOS_LV_JPEG);
+		free(capture);
+		return NULL;
+	}
+	const uint8_t *tail = capture + image_length;
+	uint32_t tail_length = capture_length - image_length;
+
+	struct EosLiveviewFrames *lv = calloc(1, sizeof(struct EosLiveviewFrames));
+	if (lv == NULL) abort();
+	lv->path = path ? strdup(path) : NULL;
+	lv->tail = malloc(tail_length > 0 ? tail_length : 1);
+	if (lv->tail == NULL) abort();
+	memcpy(lv->tail, tail, tail_length);
+	lv->tail_length = tail_length;
+
+	struct stat st;
+	if (path == NULL) {
+		lv_add_jpeg(lv, capture + 8, image_length - 8, tail, tail_length);
+	} else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		struct dirent **names;
+		int n = scandir(path, &names, is_jpeg_name, alphasort);
+		for (int i = 0; i < n; i++) {
+			char file[1024];
+			snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name);
+			uint32_t length;
+			uint8_t *jpeg = load_file(file, &length);
+			if (jpeg != NULL) lv_add_jpeg(lv, jpeg, length, tail, tail_length);
+			free(jpeg);
+			free(names[i]);
+		}
+		if (n >= 0) free(names);
+	} else {
+		uint32_t length;
+		uint8_t *mjpeg = load_file(path, &length);
+		if (mjpeg != NULL) lv_add_mjpeg(lv, mjpeg, length, tail, tail_length);
+		free(mjpeg);
+	}
+	free(capture);
+
+	if (lv->length == 0) {
+		vcam_log("No liveview frames in %s", path ? path : EOS_LV_JPEG);
+		free(lv->path);
+		free(lv->tail);
+		free(lv);
+		return NULL;
+	}
+	vcam_log("Loaded %d liveview frames from %s", lv->length, path ? path : EOS_LV_JPEG);
+	lv->next = loaded;
+	loaded = lv;
+	return lv;
+}
+
+// A config runs vhci and PTP/IP cameras on two threads, loaded frames are shared by both
+static pthread_mutex_t lv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct EosLiveviewFrames *lv_load(const char *path) {
+	pthread_mutex_lock(&lv_lock);
+	const struct EosLiveviewFrames *lv = lv_load_locked(path);
+	pthread_mutex_unlock(&lv_lock);
+	return lv;
+}
+
+static void synth_released(void *arg, void *data, size_t length) {
+	(void)data; (void)length;
+	((struct CanonBase *)arg)->synth_busy = 0;
+}
+
+// Generate the frame for this tick straight into the synth buffer, which stays referenced until sent
+static int eos_send_synth_frame(vcam *cam, ptpcontainer *ptp, uint64_t tick, uint64_t now) {
+	struct CanonBase *p = priv(cam);
+	if (p->synth == NULL) {
+		p->synth = calloc(1, sizeof(struct VcamSynth));
+		if (p->synth == NULL) abort();
+		if (vcam_synth_init(p->synth, cam->lv_width, cam->lv_height, cam->lv_quality)) {
+			vcam_log("Invalid --lv-synth %dx%d quality %d", cam->lv_width, cam->lv_height, cam->lv_quality);
+			free(p->synth);
+			p->synth = NULL;
+			return -1;
+		}
+	}
+
+	int jpeg_length = vcam_synth_frame(p->synth, 8, (uint32_t)tick, now);
+	uint8_t *frame = p->synth->out;
+	ptp_write_u32(frame, 8 + (uint32_t)jpeg_length);
+	ptp_write_u32(frame + 4, EOS_LV_RECORD_IMAGE);
+
+	p->synth_busy = 1;
+	ptp_data_start(cam, ptp->code, 8 + jpeg_length + (int)p->lv->tail_length);
+	ptp_data_add_ref(cam, frame, 8 + jpeg_length, synth_released, p);
+	ptp_data_add_ref(cam, p->lv->tail, (int)p->lv->tail_length, NULL, NULL);
+	return 0;
+}
+
+// Frames become ready at --lv-fps from EOS_LV_STARTUP_US after the first poll. A poll gets the next frame if one has
+// become ready since the last it got, otherwise NotReady right away, like the camera when the host polls faster
+// than the sensor. Frames are sent from memory, nothing is read or copied per frame.
 static int ptp_eos_viewfinder_data(vcam *cam, ptpcontainer *ptp) {
 	struct CanonBase *p = priv(cam);
-	usleep(1000 * 10);
-	p->calls_to_liveview++;
+	uint64_t now = now_us();
+
+	if (p->lv == NULL) {
+		p->lv = lv_load(cam->lv_width ? NULL : p->lv_path);
+		if (p->lv == NULL) {
+			ptp_response(cam, PTP_RC_GeneralError, 0);
+			return 1;
+		}
+	}
+	if (p->lv_start == 0) {
+		p->lv_start = now + EOS_LV_STARTUP_US;
+		p->lv_tick = 0;
+	}
 
-	if (p->calls_to_liveview < 15) {
+	uint64_t fps = cam->lv_fps ? (uint64_t)cam->lv_fps : EOS_LV_DEFAULT_FPS;
+	uint64_t tick = now < p->lv_start ? 0 : (now - p->lv_start) * fps / 1000000 + 1;
+	if (tick <= p->lv_tick || p->synth_busy) {
 		ptp_response(cam, PTP_RC_CANON_NotReady, 0);
 		return 1;
 	}
+	p->lv_tick = tick;
+
+	if (cam->lv_width) {
+		if (eos_send_synth_frame(cam, ptp, tick, now)) {
+			ptp_response(cam, PTP_RC_GeneralError, 0);
+			return 1;
+		}
+		ptp_response(cam, PTP_RC_OK, 0);
+		return 1;
+	}
 
-	vcam_generic_send_file(EOS_LV_JPEG, cam, 0, ptp);
+	const struct EosLiveviewFrames *lv = p->lv;
+	ptp_senddata_ref(cam, ptp->code, lv->frames[p->lv_next], (int)lv->lengths[p->lv_next], NULL, NULL);
+	p->lv_next = (p->lv_next + 1) % lv->length;
 
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
@@ -188,7 +438,7 @@ static int eos_pack_all_props(vcam *cam, uint8_t *buf, int *size) {
 
 	// Pack in all properties and their current values
 	for (int i = 0; i < cam->props->length; i++) {
-		struct PtpProp *p = &cam->props->handlers[i];
+		struct PtpProp *p = cam->props->handlers[i];
 		cnt += ptp_write_u32(buf + cnt, 16);
 		cnt += ptp_write_u32(buf + cnt, PTP_EC_EOS_PropValueChanged);
 		cnt += ptp_write_u32(buf + cnt, p->code);
@@ -203,7 +453,7 @@ static int eos_pack_all_props(vcam *cam, uint8_t *buf, int *size) {
 
 	// Pack in all property available value lists
 	for (int i = 0; i < cam->props->length; i++) {
-		struct PtpProp *p = &cam->props->handlers[i];
+		struct PtpProp *p = cam->props->handlers[i];
 		if (p->desc.FormFlag != PTP_EnumerationForm) continue;
 		if (p->desc.avail == NULL) abort();
 		printf("%04x\n", p->code);
@@ -0,0 +1,453 @@
+// Object list of the virtual card
+// The card is scanned lazily: a folder is only read once something below it is listed or requested,
+// and an inotify watch on every scanned folder keeps the list up to date while a client is connected.
+// Folders are always read in the same (breadth first, sorted) order, so handles are handed out in the order
+// a full scan would, no matter which folder a client lists first.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "vcam.h"
+
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+static inline uint32_t object_hash(uint32_t id, int bits) {
+	return (id * 2654435761u) >> (32 - bits);
+}
+
+static void object_index_insert(struct PtpObjectIndex *idx, struct ptp_dirent *ent) {
+	uint32_t mask = (1u << idx->bits) - 1;
+	uint32_t i = object_hash(ent->id, idx->bits);
+	while (idx->slots[i] != NULL) {
+		// A later object with the same handle shadows the earlier one
+		if (idx->slots[i]->id == ent->id) {
+			idx->slots[i] = ent;
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	idx->slots[i] = ent;
+	idx->used++;
+}
+
+static void object_index_add(struct PtpObjectIndex *idx, struct ptp_dirent *ent) {
+	if ((idx->used + 1) * 2 > (1 << idx->bits)) {
+		struct ptp_dirent **old = idx->slots;
+		int old_size = idx->bits ? 1 << idx->bits : 0;
+		idx->bits = idx->bits ? idx->bits + 1 : 8;
+		idx->slots = calloc(1 << idx->bits, sizeof(struct ptp_dirent *));
+		if (idx->slots == NULL) abort();
+		idx->used = 0;
+		for (int i = 0; i < old_size; i++)
+			if (old[i] != NULL) object_index_insert(idx, old[i]);
+		free(old);
+	}
+	object_index_insert(idx, ent);
+}
+
+// Remove the slot for ent (if it isn't shadowed) and shift the rest of the probe run back
+static void object_index_remove(struct PtpObjectIndex *idx, struct ptp_dirent *ent) {
+	if (idx->bits == 0) return;
+	uint32_t mask = (1u << idx->bits) - 1;
+	uint32_t i = object_hash(ent->id, idx->bits);
+	while (idx->slots[i] != ent) {
+		if (idx->slots[i] == NULL) return;
+		i = (i + 1) & mask;
+	}
+	idx->slots[i] = NULL;
+	idx->used--;
+	for (uint32_t j = (i + 1) & mask; idx->slots[j] != NULL; j = (j + 1) & mask) {
+		uint32_t home = object_hash(idx->slots[j]->id, idx->bits);
+		// Move the entry back if its home slot isn't in the (i, j] range
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx->slots[i] = idx->slots[j];
+			idx->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static struct ptp_dirent *object_lookup(struct PtpObjectIndex *idx, uint32_t id) {
+	if (idx->bits == 0) return NULL;
+	uint32_t mask = (1u << idx->bits) - 1;
+	for (uint32_t i = object_hash(id, idx->bits);; i = (i + 1) & mask) {
+		struct ptp_dirent *ent = idx->slots[i];
+		if (ent == NULL) return NULL;
+		if (ent->id == id) return ent;
+	}
+}
+
+static void watch_dir(vcam *cam, struct ptp_dirent *dir) {
+	if (cam->fs_watch_fd < 0) return;
+	int wd = inotify_add_watch(cam->fs_watch_fd, dir->fsname, WATCH_MASK);
+	if (wd < 0) {
+		vcam_log_func(__func__, "can't watch %s: %s", dir->fsname, strerror(errno));
+		return;
+	}
+	if (wd >= cam->fs_watches_length) {
+		int length = wd * 2 + 16;
+		cam->fs_watches = realloc(cam->fs_watches, sizeof(struct ptp_dirent *) * length);
+		if (cam->fs_watches == NULL) abort();
+		memset(cam->fs_watches + cam->fs_watches_length, 0, sizeof(struct ptp_dirent *) * (length - cam->fs_watches_length));
+		cam->fs_watches_length = length;
+	}
+	cam->fs_watches[wd] = dir;
+	dir->wd = wd;
+}
+
+static void close_object(vcam *cam) {
+	if (cam->open_object == NULL) return;
+	close(cam->open_object_fd);
+	cam->open_object = NULL;
+}
+
+int vcam_open_object(vcam *cam, struct ptp_dirent *ent) {
+	if (cam->open_object != ent) {
+		close_object(cam);
+		int fd = open(ent->fsname, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			vcam_log_func(__func__, "could not open %s", ent->fsname);
+			return -1;
+		}
+		cam->open_object = ent;
+		cam->open_object_fd = fd;
+	}
+	return fcntl(cam->open_object_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static void unwatch_dir(vcam *cam, struct ptp_dirent *dir) {
+	if (dir->wd < cam->fs_watches_length && cam->fs_watches[dir->wd] == dir) {
+		inotify_rm_watch(cam->fs_watch_fd, dir->wd);
+		cam->fs_watches[dir->wd] = NULL;
+	}
+	dir->wd = 0;
+}
+
+void vcam_add_object(vcam *cam, struct ptp_dirent *ent, struct ptp_dirent *parent) {
+	ent->parent = parent;
+	ent->prev = NULL;
+	ent->next = cam->first_dirent;
+	if (cam->first_dirent)
+		cam->first_dirent->prev = ent;
+	cam->first_dirent = ent;
+	cam->objects.length++;
+	object_index_add(&cam->objects, ent);
+	if (S_ISDIR(ent->stbuf.st_mode) && !ent->scanned) {
+		ent->scan_next = NULL;
+		if (cam->objects.scan_tail)
+			cam->objects.scan_tail->scan_next = ent;
+		else
+			cam->objects.scan_head = ent;
+		cam->objects.scan_tail = ent;
+	}
+
+	if (parent == NULL) return;
+	if (parent->nchildren == parent->children_capacity) {
+		parent->children_capacity = parent->children_capacity ? parent->children_capacity * 2 : 8;
+		parent->children = realloc(parent->children, sizeof(struct ptp_dirent *) * parent->children_capacity);
+		if (parent->children == NULL) abort();
+	}
+	parent->children[parent->nchildren++] = ent;
+}
+
+void vcam_set_object_id(vcam *cam, struct ptp_dirent *ent, uint32_t id) {
+	object_index_remove(&cam->objects, ent);
+	ent->id = id;
+	object_index_add(&cam->objects, ent);
+}
+
+static void unqueue_dir(vcam *cam, struct ptp_dirent *dir) {
+	struct ptp_dirent *prev = NULL;
+	for (struct ptp_dirent *cur = cam->objects.scan_head; cur; prev = cur, cur = cur->scan_next) {
+		if (cur != dir) continue;
+		if (prev)
+			prev->scan_next = cur->scan_next;
+		else
+			cam->objects.scan_head = cur->scan_next;
+		if (cam->objects.scan_tail == cur)
+			cam->objects.scan_tail = prev;
+		return;
+	}
+}
+
+void vcam_unlink_object(vcam *cam, struct ptp_dirent *ent) {
+	object_index_remove(&cam->objects, ent);
+	if (ent->prev)
+		ent->prev->next = ent->next;
+	else
+		cam->first_dirent = ent->next;
+	if (ent->next)
+		ent->next->prev = ent->prev;
+	ent->next = NULL;
+	ent->prev = NULL;
+	cam->objects.length--;
+	if (S_ISDIR(ent->stbuf.st_mode) && !ent->scanned)
+		unqueue_dir(cam, ent);
+	if (ent->wd > 0)
+		unwatch_dir(cam, ent);
+	if (cam->open_object == ent)
+		close_object(cam);
+
+	struct ptp_dirent *parent = ent->parent;
+	if (parent == NULL) return;
+	for (int i = parent->nchildren - 1; i >= 0; i--) {
+		if (parent->children[i] == ent) {
+			memmove(&parent->children[i], &parent->children[i + 1], sizeof(struct ptp_dirent *) * (parent->nchildren - i - 1));
+			parent->nchildren--;
+			break;
+		}
+	}
+}
+
+void vcam_free_objects(vcam *cam) {
+	close_object(cam);
+	struct ptp_dirent *cur = cam->first_dirent;
+	while (cur) {
+		struct ptp_dirent *next = cur->next;
+		free_dirent(cur);
+		cur = next;
+	}
+	cam->first_dirent = NULL;
+	free(cam->objects.slots);
+	// Don't scan the card again after everything has been deleted
+	int loaded = cam->objects.loaded;
+	memset(&cam->objects, 0, sizeof(struct PtpObjectIndex));
+	cam->objects.loaded = loaded;
+
+	for (int i = 0; i < cam->fs_watches_length; i++) {
+		if (cam->fs_watches[i] != NULL)
+			inotify_rm_watch(cam->fs_watch_fd, i);
+	}
+	free(cam->fs_watches);
+	cam->fs_watches = NULL;
+	cam->fs_watches_length = 0;
+}
+
+struct ptp_dirent *vcam_find_child(struct ptp_dirent *parent, const char *name) {
+	for (int i = 0; i < parent->nchildren; i++)
+		if (!strcmp(parent->children[i]->name, name))
+			return parent->children[i];
+	return NULL;
+}
+
+static int scan_filter(const struct dirent *de) {
+	return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+uint32_t vcam_next_object_id(vcam *cam) {
+	return cam->ptp_objectid++;
+}
+
+static struct ptp_dirent *new_dirent(vcam *cam, struct ptp_dirent *parent, const char *name) {
+	struct ptp_dirent *cur = calloc(1, sizeof(struct ptp_dirent));
+	if (!cur) abort();
+	cur->name = strdup(name);
+	cur->fsname = malloc(strlen(parent->fsname) + 1 + strlen(name) + 1);
+	strcpy(cur->fsname, parent->fsname);
+	strcat(cur->fsname, "/");
+	strcat(cur->fsname, name);
+	if (-1 == stat(cur->fsname, &cur->stbuf))
+		vcam_log_func(__func__, "can't stat %s", cur->fsname);
+	cur->id = vcam_next_object_id(cam);
+	vcam_add_object(cam, cur, parent);
+	return cur;
+}
+
+// Read the folder at the front of the scan queue
+static void read_next_dir(vcam *cam) {
+	struct ptp_dirent *dir = cam->objects.scan_head;
+	struct dirent **names;
+
+	cam->objects.scan_head = dir->scan_next;
+	if (cam->objects.scan_head == NULL)
+		cam->objects.scan_tail = NULL;
+	dir->scan_next = NULL;
+	dir->scanned = 1;
+
+	// Watch before reading, so nothing created in between is missed
+	watch_dir(cam, dir);
+
+	// Sorted, so handles don't depend on the order the filesystem returns entries in
+	int n = scandir(dir->fsname, &names, scan_filter, alphasort);
+	if (n < 0)
+		return;
+	int existing = dir->nchildren;
+	for (int i = 0; i < n; i++) {
+		if (existing == 0 || vcam_find_child(dir, names[i]->d_name) == NULL)
+			new_dirent(cam, dir, names[i]->d_name);
+		free(names[i]);
+	}
+	free(names);
+}
+
+void vcam_scan_dir(vcam *cam, struct ptp_dirent *dir) {
+	if (!S_ISDIR(dir->stbuf.st_mode))
+		return;
+	// Every unread folder is queued, the ones before it have to get their handles first
+	while (!dir->scanned && cam->objects.scan_head != NULL)
+		read_next_dir(cam);
+}
+
+// Every object that hasn't been read yet is a file on the card's filesystem, so the handles still to be handed
+// out can't go past one per inode in use there
+static int handle_in_range(vcam *cam, uint32_t id) {
+	struct statvfs st;
+	if (statvfs(cam->vcamera_filesystem, &st) || st.f_files == 0)
+		return 1;
+	return (uint64_t)id < (uint64_t)cam->ptp_objectid + (st.f_files - st.f_ffree);
+}
+
+struct ptp_dirent *vcam_get_root(vcam *cam) {
+	if (!cam->objects.loaded)
+		read_tree(cam, cam->vcamera_filesystem);
+	return object_lookup(&cam->objects, 0);
+}
+
+void vcam_scan_all(vcam *cam) {
+	vcam_get_root(cam);
+	while (cam->objects.scan_head != NULL)
+		read_next_dir(cam);
+}
+
+struct ptp_dirent *vcam_get_object(vcam *cam, uint32_t id) {
+	vcam_get_root(cam);
+	struct ptp_dirent *ent = object_lookup(&cam->objects, id);
+	if (ent != NULL || id < cam->ptp_objectid || cam->objects.scan_head == NULL || !handle_in_range(cam, id))
+		return ent;
+	// Handles are handed out in scan order, stop once it has been passed
+	while (ent == NULL && id >= cam->ptp_objectid && cam->objects.scan_head != NULL) {
+		read_next_dir(cam);
+		ent = object_lookup(&cam->objects, id);
+	}
+	return ent;
+}
+
+int ptp_get_object_count(vcam *cam) {
+	return vcam_get_object_count(cam);
+}
+
+int vcam_get_object_count(vcam *cam) {
+	vcam_scan_all(cam);
+	/* do not include 0 entry */
+	return cam->objects.length - (object_lookup(&cam->objects, 0) != NULL);
+}
+
+int vcam_filekey_matches(const struct ptp_filekey *key, const struct stat *st) {
+	return key->ino == st->st_ino && key->size == st->st_size &&
+		key->mtime.tv_sec == st->st_mtim.tv_sec && key->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void vcam_filekey_set(struct ptp_filekey *key, const struct stat *st) {
+	key->ino = st->st_ino;
+	key->mtime = st->st_mtim;
+	key->size = st->st_size;
+}
+
+void free_dirent(struct ptp_dirent *ent) {
+	free(ent->info);
+	free(ent->children);
+	free(ent->name);
+	free(ent->fsname);
+	free(ent);
+}
+
+// Remove an object and everything below it, reporting each one to the initiator
+static void remove_tree(vcam *cam, struct ptp_dirent *ent) {
+	while (ent->nchildren)
+		remove_tree(cam, ent->children[ent->nchildren - 1]);
+	ptp_inject_interrupt(cam, 0, PTP_EC_ObjectRemoved, 1, ent->id, 0);
+	vcam_unlink_object(cam, ent);
+	free_dirent(ent);
+}
+
+static void handle_fs_event(vcam *cam, const struct inotify_event *ev) {
+	if (ev->wd >= cam->fs_watches_length) return;
+	struct ptp_dirent *dir = cam->fs_watches[ev->wd];
+	if (dir == NULL) return;
+
+	if (ev->mask & IN_IGNORED) {
+		cam->fs_watches[ev->wd] = NULL;
+		dir->wd = 0;
+		return;
+	}
+	if (ev->len == 0) return;
+
+	struct ptp_dirent *cur = vcam_find_child(dir, ev->name);
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (cur != NULL) {
+			vcam_log("Card: %s removed", ev->name);
+			remove_tree(cam, cur);
+		}
+	} else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)) {
+		// New files are only announced once they have been written
+		if ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR)) return;
+		if (cur != NULL) {
+			stat(cur->fsname, &cur->stbuf);
+			if (cam->open_object == cur)
+				close_object(cam);
+			return;
+		}
+		cur = new_dirent(cam, dir, ev->name);
+		vcam_log("Card: %s added as %u", ev->name, cur->id);
+		ptp_inject_interrupt(cam, 0, PTP_EC_ObjectAdded, 1, cur->id, 0);
+	}
+}
+
+int vcam_fs_watch_fd(vcam *cam) {
+	if (cam->fs_watch_fd < 0) {
+		cam->fs_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (cam->fs_watch_fd < 0)
+			vcam_log_func(__func__, "inotify not available, card won't be watched");
+	}
+	return cam->fs_watch_fd;
+}
+
+void vcam_poll_fs(vcam *cam) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	if (cam->fs_watch_fd < 0) return;
+	while (1) {
+		ssize_t len = read(cam->fs_watch_fd, buffer, sizeof(buffer));
+		if (len <= 0) return;
+		for (char *p = buffer; p < buffer + len;) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			handle_fs_event(cam, ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+void read_tree(vcam *cam, const char *path) {
+	struct ptp_dirent *root = NULL, *dcim = NULL;
+
+	if (cam->objects.loaded)
+		return;
+	cam->objects.loaded = 1;
+
+	vcam_fs_watch_fd(cam);
+
+	root = calloc(1, sizeof(struct ptp_dirent));
+	root->name = strdup("");
+	root->fsname = strdup(path);
+	root->id = vcam_next_object_id(cam);
+	stat(root->fsname, &root->stbuf); /* assuming it works */
+	vcam_add_object(cam, root, NULL);
+	vcam_scan_dir(cam, root);
+
+	/* See if we have a DCIM directory, if not, create one. */
+	dcim = vcam_find_child(root, "DCIM");
+	if (!dcim) {
+		dcim = calloc(1, sizeof(struct ptp_dirent));
+		dcim->name = strdup("DCIM");
+		dcim->fsname = strdup(path);
+		dcim->id = vcam_next_object_id(cam);
+		stat(dcim->fsname, &dcim->stbuf); /* assuming it works */
+		dcim->scanned = 1; /* virtual, its fsname is the card itself */
+		vcam_add_object(cam, dcim, root);
+	}
+}
@@ -0,0 +1,213 @@
+// Interrupt/event scheduling
+// Events are kept in a min-heap keyed by CLOCK_MONOTONIC trigger time, so wall clock jumps don't reorder them
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vcam.h"
+
+#define EVENT_SIZE 0x10
+
+static int node_before(const struct PtpEventQueue *q, int a, int b) {
+	const struct PtpEventNode *na = &q->nodes[a];
+	const struct PtpEventNode *nb = &q->nodes[b];
+	if (na->due != nb->due) return na->due < nb->due;
+	return na->seq < nb->seq;
+}
+
+static int node_alloc(struct PtpEventQueue *q) {
+	if (q->free) {
+		int i = q->free - 1;
+		q->free = q->nodes[i].next_free;
+		return i;
+	}
+	if (q->allocated == q->capacity) {
+		q->capacity = q->capacity ? q->capacity * 2 : 16;
+		q->nodes = realloc(q->nodes, sizeof(struct PtpEventNode) * q->capacity);
+		q->heap = realloc(q->heap, sizeof(int) * q->capacity);
+		if (q->nodes == NULL || q->heap == NULL) abort();
+	}
+	return q->allocated++;
+}
+
+static void node_free(struct PtpEventQueue *q, int i) {
+	q->nodes[i].next_free = q->free;
+	q->free = i + 1;
+}
+
+static void heap_push(struct PtpEventQueue *q, int node) {
+	// Sift up
+	int i = q->length++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!node_before(q, node, q->heap[parent])) break;
+		q->heap[i] = q->heap[parent];
+		i = parent;
+	}
+	q->heap[i] = node;
+}
+
+static int heap_pop(struct PtpEventQueue *q) {
+	int node = q->heap[0];
+	int last = q->heap[--q->length];
+
+	// Sift the last node down from the root
+	int i = 0;
+	while (1) {
+		int child = i * 2 + 1;
+		if (child >= q->length) break;
+		if (child + 1 < q->length && node_before(q, q->heap[child + 1], q->heap[child]))
+			child++;
+		if (!node_before(q, q->heap[child], last)) break;
+		q->heap[i] = q->heap[child];
+		i = child;
+	}
+	if (q->length)
+		q->heap[i] = last;
+	return node;
+}
+
+static struct PtpEventPending *find_pending(struct PtpEventQueue *q, uint16_t code, uint32_t prop) {
+	for (int i = 0; i < q->pending_length; i++) {
+		if (q->pending[i].code == code && q->pending[i].prop == prop)
+			return &q->pending[i];
+	}
+	return NULL;
+}
+
+static void add_pending(struct PtpEventQueue *q, uint16_t code, uint32_t prop, int node) {
+	struct PtpEventPending *p = find_pending(q, code, prop);
+	if (p == NULL) {
+		if (q->pending_length == q->pending_capacity) {
+			q->pending_capacity = q->pending_capacity ? q->pending_capacity * 2 : 16;
+			q->pending = realloc(q->pending, sizeof(struct PtpEventPending) * q->pending_capacity);
+			if (q->pending == NULL) abort();
+		}
+		p = &q->pending[q->pending_length++];
+		p->code = code;
+		p->prop = prop;
+	}
+	p->node = node;
+}
+
+static void remove_pending(struct PtpEventQueue *q, int node) {
+	for (int i = 0; i < q->pending_length; i++) {
+		if (q->pending[i].node == node) {
+			q->pending[i] = q->pending[--q->pending_length];
+			return;
+		}
+	}
+}
+
+// Merge a property change into a pending event of the same property, returns 0 if merged
+static int coalesce(struct PtpEventQueue *q, uint64_t now, uint16_t code, uint32_t prop, uint32_t param1, uint32_t transid) {
+	struct PtpEventPending *p = find_pending(q, code, prop);
+	if (p == NULL) return -1;
+	struct PtpEventNode *node = &q->nodes[p->node];
+	if (now - node->queued > (uint64_t)q->coalesce_window * 1000) return -1;
+	node->param1 = param1;
+	node->transid = transid;
+	q->merged++;
+	return 0;
+}
+
+static void schedule(vcam *cam, int when, uint16_t code, uint32_t param1, uint32_t transid, int mergeable, uint32_t prop) {
+	struct PtpEventQueue *q = &cam->events;
+	uint64_t now = now_us();
+
+	mergeable = mergeable && q->coalesce_window > 0;
+	if (mergeable && coalesce(q, now, code, prop, param1, transid) == 0) {
+		vcam_log_func(__func__, "merged into pending event 0x%04x, %lu merged so far", code, q->merged);
+		return;
+	}
+
+	int i = node_alloc(q);
+	struct PtpEventNode *node = &q->nodes[i];
+	node->due = now + (int64_t)when * 1000;
+	node->seq = q->seq++;
+	node->queued = now;
+	node->code = code;
+	node->param1 = param1;
+	node->transid = transid;
+	heap_push(q, i);
+
+	if (mergeable)
+		add_pending(q, code, prop, i);
+}
+
+static void pop_event(struct PtpEventQueue *q, unsigned char *data) {
+	int i = heap_pop(q);
+	struct PtpEventNode *node = &q->nodes[i];
+	int x = 0;
+	x += put_32bit_le(data + x, EVENT_SIZE);
+	x += put_16bit_le(data + x, 4);
+	x += put_16bit_le(data + x, node->code);
+	x += put_32bit_le(data + x, node->transid);
+	x += put_32bit_le(data + x, node->param1);
+
+	if (q->pending_length)
+		remove_pending(q, i);
+	node_free(q, i);
+	q->delivered++;
+}
+
+void vcam_free_events(vcam *cam) {
+	struct PtpEventQueue *q = &cam->events;
+	if (q->coalesce_window)
+		vcam_log("Events: %lu delivered, %lu merged", q->delivered, q->merged);
+	free(q->nodes);
+	free(q->heap);
+	free(q->pending);
+}
+
+int ptp_notify_event(vcam *cam, uint16_t code, uint32_t value) {
+	vcam_log_func(__func__, "generate interrupt 0x%04x, 1 params, param1 0x%08x, timeout=1000", code, value);
+	// The event code is the property code here
+	schedule(cam, 1000, code, value, 0, 1, 0);
+	return 1;
+}
+
+int ptp_inject_interrupt(vcam *cam, int when, uint16_t code, int nparams, uint32_t param1, uint32_t transid) {
+	vcam_log_func(__func__, "generate interrupt 0x%04x, %d params, param1 0x%08x, timeout=%d", code, nparams, param1, when);
+	schedule(cam, when, code, param1, transid, code == PTP_EC_DevicePropChanged, param1);
+	return 1;
+}
+
+int ptp_pop_event(vcam *cam, struct GenericEvent *ev) {
+	vcam_poll_fs(cam);
+
+	// The list is allowed to be empty, will produce timeout (no events)
+	if (cam->events.length == 0) return 1;
+
+	unsigned char data[EVENT_SIZE];
+	pop_event(&cam->events, data);
+	memcpy(ev, data, sizeof(struct GenericEvent));
+
+	return 0;
+}
+
+int64_t vcam_next_event_due(vcam *cam) {
+	if (cam->events.length == 0) return -1;
+	return (int64_t)cam->events.nodes[cam->events.heap[0]].due;
+}
+
+// Reads ints into 'data' with max 'bytes'
+int vcam_readint(vcam *cam, unsigned char *data, int bytes, int timeout) {
+	vcam_poll_fs(cam);
+	if (cam->events.length == 0) {
+		return GP_ERROR_TIMEOUT;
+	}
+
+	// Only deliver the next event if it triggers within the timeout
+	const struct PtpEventNode *next = &cam->events.nodes[cam->events.heap[0]];
+	if ((int64_t)(next->due - now_us()) > (int64_t)timeout * 1000) {
+		return GP_ERROR_TIMEOUT;
+	}
+
+	unsigned char packet[EVENT_SIZE];
+	pop_event(&cam->events, packet);
+	int tocopy = EVENT_SIZE;
+	if (tocopy > bytes)
+		tocopy = bytes;
+	memcpy(data, packet, tocopy);
+	return tocopy;
+}
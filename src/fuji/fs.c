@@ -89,16 +89,41 @@ static int ptp_fuji_900d_write(vcam *cam, ptpcontainer *ptp) {
 	if (vcam_check_param_count(cam, ptp, 0)) return 1;
 	return 1;
 }
-static int ptp_fuji_900d_write_data(vcam *cam, ptpcontainer *ptp, unsigned char *data, unsigned int len) {
-	if (vcam_check_trans_id(cam, ptp)) return 1;
+// The RAF is spooled to a temporary file as it arrives, it can be as large as the initiator says
+static int ptp_fuji_900d_data_begin(vcam *cam, ptpcontainer *ptp, unsigned int len) {
+	struct Fuji *f = fuji(cam);
+	if (f->rawconv_raf_file != NULL) fclose(f->rawconv_raf_file);
+	f->rawconv_raf_file = NULL;
+	f->rawconv_raf_length = 0;
+	if (vcam_check_trans_id(cam, ptp)) return 0;
 
 	// 900d can accept 0 parameters, so we have to assume the object handle (TODO)
-	if (1) {
-		fuji(cam)->rawconv_raf_buffer = malloc(len);
-		memcpy(fuji(cam)->rawconv_raf_buffer, data, len);
-		fuji(cam)->rawconv_raf_length = len;
+	f->rawconv_raf_file = tmpfile();
+	if (f->rawconv_raf_file == NULL) {
+		vcam_log("Can't spool a %u byte RAF", len);
+		ptp_response(cam, PTP_RC_GeneralError, 0);
+		return 0;
+	}
+	return 1;
+}
+static int ptp_fuji_900d_data_chunk(vcam *cam, ptpcontainer *ptp, const unsigned char *data, unsigned int len) {
+	struct Fuji *f = fuji(cam);
+	// A failed write drops the file, the response says so once the rest has arrived
+	if (f->rawconv_raf_file == NULL) return 1;
+	if (fwrite(data, 1, len, f->rawconv_raf_file) != len) {
+		vcam_log("Failed to spool the RAF");
+		fclose(f->rawconv_raf_file);
+		f->rawconv_raf_file = NULL;
+		return 1;
+	}
+	f->rawconv_raf_length += len;
+	return 1;
+}
+static int ptp_fuji_900d_data_end(vcam *cam, ptpcontainer *ptp) {
+	if (fuji(cam)->rawconv_raf_file == NULL) {
+		ptp_response(cam, PTP_RC_GeneralError, 0);
+		return 1;
 	}
-
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
@@ -135,15 +160,23 @@ static int ptp_fuji_sendobject_write(vcam *cam, ptpcontainer *ptp) {
 	if (vcam_check_param_count(cam, ptp, 1)) return 1;
 	return 1;
 }
-static int ptp_fuji_sendobject_write_data(vcam *cam, ptpcontainer *ptp, unsigned char *data, unsigned int len) {
+// The settings backup is written to disk as it arrives
+static int ptp_fuji_sendobject_data_begin(vcam *cam, ptpcontainer *ptp, unsigned int len) {
 	if (ptp->params[0] == 0x0) {
-		FILE *f = fopen(fuji(cam)->settings_file_path, "wb");
-		assert(f != NULL);
-		fwrite(data, len, 1, f);
-		fclose(f);
+		fuji(cam)->upload_file = fopen(fuji(cam)->settings_file_path, "wb");
+		assert(fuji(cam)->upload_file != NULL);
 	} else {
 		vcam_panic("Unhandled %s", __func__);
 	}
+	return 1;
+}
+static int ptp_fuji_sendobject_data_chunk(vcam *cam, ptpcontainer *ptp, const unsigned char *data, unsigned int len) {
+	fwrite(data, len, 1, fuji(cam)->upload_file);
+	return 1;
+}
+static int ptp_fuji_sendobject_data_end(vcam *cam, ptpcontainer *ptp) {
+	fclose(fuji(cam)->upload_file);
+	fuji(cam)->upload_file = NULL;
 
 	ptp_response(cam, PTP_RC_OK, 0);
 
@@ -271,7 +304,8 @@ int vcam_fuji_register_rawconv_fs(vcam *cam) {
 	vcam_register_opcode(cam, PTP_OC_GetObjectInfo, ptp_fuji_getobjectinfo, NULL);
 	vcam_register_opcode(cam, PTP_OC_GetObject, ptp_fuji_getobject_write, NULL);
 	vcam_register_opcode(cam, PTP_OC_SendObjectInfo, ptp_fuji_sendobjectinfo_write, ptp_fuji_sendobjectinfo_write_data);
-	vcam_register_opcode(cam, PTP_OC_SendObject, ptp_fuji_sendobject_write, ptp_fuji_sendobject_write_data);
+	vcam_register_opcode_stream(cam, PTP_OC_SendObject, ptp_fuji_sendobject_write,
+		ptp_fuji_sendobject_data_begin, ptp_fuji_sendobject_data_chunk, ptp_fuji_sendobject_data_end);
 	vcam_register_opcode(cam, PTP_OC_DeleteObject, ptp_fuji_deleteobject_write, NULL);
 
 	{
@@ -300,7 +334,8 @@ int vcam_fuji_register_rawconv_fs(vcam *cam) {
 
 	// These have been around since 2011
 	vcam_register_opcode(cam, 0x900c, ptp_fuji_900c_write, ptp_fuji_900c_write_data);
-	vcam_register_opcode(cam, 0x900d, ptp_fuji_900d_write, ptp_fuji_900d_write_data);
+	vcam_register_opcode_stream(cam, 0x900d, ptp_fuji_900d_write,
+		ptp_fuji_900d_data_begin, ptp_fuji_900d_data_chunk, ptp_fuji_900d_data_end);
 
 	return 0;
 }
@@ -93,7 +93,9 @@ int fuji_init_cam(vcam *cam, const char *name, int argc, const char **argv) {
 
 	f->transport = FUJI_FEATURE_WIRELESS_COMM;
 	for (int i = 0; i < argc; i++) {
-		if (vcam_parse_args(cam, argc, argv, &i)) continue;
+		int rc = vcam_parse_args(cam, argc, argv, &i);
+		if (rc < 0) return -1;
+		if (rc) continue;
 		if (!strcmp(argv[i], "--usb")) {
 			f->transport = FUJI_FEATURE_USB_CARD_READER;
 		} else if (!strcmp(argv[i], "--rawconv")) {
@@ -169,6 +171,7 @@ int vcam_fuji_setup(vcam *cam) {
 	f->sent_images = 0;
 
 	// TODO: Better way to ignore folders (Fuji doesn't show them)
+	// Counting reads the whole card, so first_dirent is complete from here on
 	f->obj_count = ptp_get_object_count(cam) - 1;
 
 	vcam_log("Fuji: Found %d objects", f->obj_count);
@@ -188,7 +191,7 @@ int vcam_fuji_setup(vcam *cam) {
 		vcam_log("Configuring fuji to select multiple images");
 		f->camera_state = FUJI_MULTIPLE_TRANSFER;
 		// ID 0 is DCIM, set to 1, which is first jpeg
-		cam->first_dirent->next->id = 1;
+		vcam_set_object_id(cam, cam->first_dirent->next, 1);
 	}
 
 	// Common startup events for all cameras
@@ -305,7 +308,8 @@ int ptp_fuji_setdevicepropvalue_write_data(vcam *cam, ptpcontainer *ptp, unsigne
 }
 
 int fuji_send_events(vcam *cam, ptpcontainer *ptp) {
-	struct PtpFujiEvents *ev = calloc(1, 4096);
+	struct PtpFujiEvents *ev = (struct PtpFujiEvents *)vcam_scratch(cam, 4096);
+	ev->length = 0;
 
 	// Pop all events and pack into fuji event structure
 	struct GenericEvent ev_info;
@@ -321,7 +325,6 @@ int fuji_send_events(vcam *cam, ptpcontainer *ptp) {
 	}
 
 	ptp_senddata(cam, ptp->code, (unsigned char *)ev, 2 + (6 * ev->length));
-	free(ev);
 
 	ptp_response(cam, PTP_RC_OK, 0);
 
@@ -425,14 +428,12 @@ int ptp_fuji_getdevicepropvalue_write(vcam *cam, ptpcontainer *ptp) {
 	return 0;
 }
 
-void fuji_accept_remote_ports(void); // fuji-server.c
-
 int ptp_fuji_capture(vcam *cam, ptpcontainer *ptp) {
 	struct Fuji *f = fuji(cam);
 	if (ptp->code == PTP_OC_InitiateOpenCapture) {
 		f->internal_state = CAM_STATE_IDLE_REMOTE;
 		vcam_log("Opening remote ports"); // BUG: It does this twice
-		fuji_accept_remote_ports();
+		fuji_accept_remote_ports(cam);
 	} else if (ptp->code == PTP_OC_TerminateOpenCapture) {
 		f->internal_state = CAM_STATE_IDLE_REMOTE;
 		vcam_log("One time sending all remote props");
@@ -479,7 +480,7 @@ static int devinfo_add_prop(char *data, int length, int code, uint8_t *payload)
 }
 
 int ptp_fuji_get_device_info(vcam *cam, ptpcontainer *ptp) {
-	char *data = malloc(2048);
+	char *data = (char *)vcam_scratch(cam, 2048);
 	int of = 0;
 	of += ptp_write_u32(data + of, 8);
 
@@ -503,32 +504,6 @@ int ptp_fuji_get_device_info(vcam *cam, ptpcontainer *ptp) {
 
 	ptp_senddata(cam, ptp->code, (void *)data, of);
 	ptp_response(cam, PTP_RC_OK, 0);
-	free(data);
-	return 0;
-}
-
-int ptp_fuji_liveview(int socket) {
-	vcam_log("Broadcasting liveview");
-	FILE *file = fopen(FUJI_DUMMY_LV_JPEG, "rb");
-	if (file == NULL) {
-		vcam_log("File %s not found", FUJI_DUMMY_LV_JPEG);
-		exit(-1);
-	}
-
-	fseek(file, 0, SEEK_END);
-	long file_size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-
-	char *buffer = malloc(file_size);
-	fread(buffer, 1, file_size, file);
-
-	fclose(file);
-
-	int rc = send(socket, buffer, file_size, 0);
-	if (rc) return -1;
-
-	free(buffer);
-
 	return 0;
 }
 
@@ -552,8 +527,8 @@ void fuji_downloaded_object(vcam *cam) {
 	if (f->camera_state == FUJI_MULTIPLE_TRANSFER) {
 		vcam_log("Dirent %s", cam->first_dirent->next->fsname);
 		struct ptp_dirent *next = cam->first_dirent->next;
-		next->id = 1;
-		cam->first_dirent = next;
+		vcam_unlink_object(cam, cam->first_dirent);
+		vcam_set_object_id(cam, next, 1);
 
 		if (f->sent_images == 3) {
 			vcam_log("Enough images send %d, killing connection", f->sent_images);
@@ -33,10 +33,13 @@ struct Fuji {
 //	size_t rawconv_jpeg_length;
 	char *rawconv_jpeg_path;
 
-	void *rawconv_raf_buffer;
+	/// @brief RAF received with 0x900d, an unlinked temporary file, NULL if none
+	FILE *rawconv_raf_file;
 	size_t rawconv_raf_length;
 
 	char *settings_file_path;
+	/// @brief Settings backup being received by SendObject
+	FILE *upload_file;
 };
 static inline struct Fuji *fuji(vcam *cam) { return cam->priv; }
 
@@ -48,6 +51,8 @@ static inline struct Fuji *fuji(vcam *cam) { return cam->priv; }
 #define FUJI_DUMMY_JPEG_FULL "bin/fuji/jpeg-full.jpg"
 #define FUJI_DUMMY_JPEG_COMPRESSED "bin/fuji/jpeg-compressed.jpg"
 #define FUJI_DUMMY_LV_JPEG "bin/fuji/lv_stream"
+#define FUJI_DUMMY_LV_JPEG2 "bin/fuji/lv2.jpg"
+#define FUJI_LV_DEFAULT_FPS 30
 
 // Ran when getpartialobject or getobject is completed
 void fuji_downloaded_object(vcam *cam);
@@ -69,7 +74,7 @@ int fuji_ssdp_import(const char *ip, char *name);
 int fuji_tether_connect(const char *ip, int port);
 
 // Launch thread to listen to liveview/event ports
-void fuji_accept_remote_ports(void);
+void fuji_accept_remote_ports(vcam *cam);
 
 int vcam_fuji_setup(vcam *cam);
 
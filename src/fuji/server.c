@@ -1,6 +1,7 @@
 // Fujifilm PTP/IP/USB TCP I/O interface
 // For X cameras 2014-2017
 // Copyright Daniel C - GNU Lesser General Public License v2.1
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
@@ -8,200 +9,66 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/sockios.h>
 #include <unistd.h>
 #include <signal.h>
 #include <vcam.h>
 #include <fujiptp.h>
 #include "fuji.h"
+#include "reactor.h"
+#include "synth.h"
 
 static const char *server_ip_address = "192.168.0.1";
 
-static int ptpip_cmd_client_write(vcam *cam, void *to, int length) {
-	static int first_write = 1;
+// Every packet from the initiator is a USB style container, except the init packet
+static int fuji_packet(struct PtpIpReactor *r, struct PtpIpConn *c, uint8_t *data, uint32_t length) {
+	// Nothing is expected from the event socket
+	if (c->kind == PTPIP_CONN_EVENT) return 0;
 
-	if (first_write) {
+	// First packet from the app, info about device
+	if (c->cam == NULL) {
 		char client_name[100];
-		ptp_read_unicode_string(client_name, ((char *)to) + 28, sizeof(client_name));
+		if (length > 28)
+			ptp_read_unicode_string(client_name, (char *)data + 28, sizeof(client_name));
+		else
+			strcpy(client_name, "?");
 		vcam_log("Connecting to client '%s'", client_name);
-		first_write = 0;
-		return length;
-	}
-
-	int rc = vcam_write(cam, 0x02, (unsigned char *)to, length);
-	return rc;
-}
-
-static int ptpip_cmd_client_read(vcam *cam, void *to, int length) {
-	static int left_of_init_packet = FUJI_ACK_PACKET_SIZE;
-
-	uint8_t *packet = fuji_get_ack_packet(cam);
-
-	if (left_of_init_packet) {
-		memcpy(to, packet + FUJI_ACK_PACKET_SIZE - left_of_init_packet, length);
-		left_of_init_packet -= length;
-		return length;
-	}
-
-	int rc = vcam_read(cam, 0x81, (unsigned char *)to, length);
-	return rc;
-}
-
-// Recieve all packets from the app (initiator)
-static int tcp_receive_all(vcam *cam, int client_socket) {
-	uint32_t packet_length;
-	ssize_t size;
-	for (int i = 0; i < 10; i++) {
-		vcam_log("Receiving data from the client...");
-		size = recv(client_socket, &packet_length, sizeof(uint32_t), 0);
-
-		if (size == 0) {
-			vcam_log("Initiator isn't sending anything, trying again");
-			usleep(1000 * 500);
-			continue;
-		}
-
-		if (size < 0) {
-			perror("Error reading data from socket");
-			return -1;
-		}
-
-		if (size != 4) {
-			vcam_log("Couldn't read 4 bytes, only got %d: %X", size, packet_length);
-
-			size += recv(client_socket, (uint8_t *)(&packet_length) + size, sizeof(uint32_t) - size, 0);
-			if (size == sizeof(uint32_t)) {
-				vcam_log("Acting up, didn't send all of size at first: %X", packet_length);
-				break;
-			}
-			
-			return -1;
-		}
-
-		break;
+		if (ptpip_open_session(r, c)) return -1;
+		ptpip_conn_send(c, fuji_get_ack_packet(c->cam), FUJI_ACK_PACKET_SIZE);
+		return 0;
 	}
 
-	// Allocate the rest of the packet to read
-	uint8_t *buffer = malloc(size + packet_length);
-	((uint32_t *)buffer)[0] = packet_length;
-
-	// Continue reading the rest of the data
-	size += recv(client_socket, buffer + size, packet_length - 4, 0);
-
-	if (size < 0) {
-		perror("Error reading data from socket");
-		return -1;
-	} else if (size != packet_length) {
-		vcam_log("Couldn't read the rest of the packet, only got %d out of %d", size, packet_length);
-		return -1;
-	}
+	const struct PtpBulkContainer *bc = (const struct PtpBulkContainer *)data;
+	if (bc->type == PTP_PACKET_TYPE_COMMAND)
+		ptpip_conn_command(c);
 
 	// Route the read data into the vcam. The camera is the responder,
 	// and will be the first to write data to the app.
-	int rc = ptpip_cmd_client_write(cam, buffer, size);
-	if (rc != size) {
-		return -1;
-	}
-
-	// Detect data phase from vcam
-	struct PtpBulkContainer *c = (struct PtpBulkContainer *)buffer;
-	if (cam->nrinbulk == 0 && c->code != 0x0) {
-		free(buffer);
-
-		size = recv(client_socket, &packet_length, sizeof(uint32_t), 0);
-		if (size != sizeof(uint32_t)) {
-			vcam_log("Failed to receive 4 bytes of data phase response");
-			return -1;
-		}
-
-		// Same trick from the recv part
-		buffer = malloc(size + packet_length);
-		((uint32_t *)buffer)[0] = packet_length;
-		rc = recv(client_socket, buffer + size, packet_length - size, 0);
-		if (rc != packet_length - size) {
-			vcam_log("Failed to receive data phase response");
-			return -1;
-		}
-
-		if (rc != packet_length - size) {
-			vcam_log("Wrote %d, wanted %d", rc, packet_length - size);
-			return -1;
-		}
-
-		rc = ptpip_cmd_client_write(cam, buffer, packet_length);
-		if (rc != packet_length) {
-			vcam_log("Failed to send response to vcam");
-			return -1;
-		}
-	}
-
-	free(buffer);
-
+	vcam_write(c->cam, 0x02, data, (int)length);
 	return 0;
 }
 
-static int tcp_send_all(vcam *cam, int client_socket) {
-	uint32_t packet_length = 0;
-	int size = ptpip_cmd_client_read(cam, &packet_length, 4);
-	if (size != 4) {
-		vcam_log("send_all: vcam failed to provide 4 bytes", size);
-		return -1;
-	}
-
-	// Same trick from the recv part
-	char *buffer = malloc(size + packet_length);
-	((uint32_t *)buffer)[0] = packet_length;
-	int rc = ptpip_cmd_client_read(cam, buffer + size, packet_length - size);
-
-	if (rc != packet_length - size) {
-		vcam_log("Read %d, wanted %d", rc, packet_length - size);
-		return -1;
-	}
-
-	// Send response (or data packet)
-	size = send(client_socket, buffer, packet_length, 0);
-	if (size <= 0) {
-		perror("Error sending data to client");
-		return -1;
-	}
-
-	// As per spec, data phase must have a 12 byte packet following
-	struct PtpBulkContainer *c = (struct PtpBulkContainer *)buffer;
-	if (c->type == PTP_PACKET_TYPE_DATA && c->code != 0x0) {
-
-		// Read packet length
-		size = ptpip_cmd_client_read(cam, &packet_length, 4);
-		if (size != 4) {
-			vcam_log("response packet: vcam failed to provide 4 bytes: %d", size);
-			vcam_log("Code: %X", c->code);
-			return -1;
-		}
-
-		// Same trick from the recv part
-		buffer = malloc(size + packet_length);
-		((uint32_t *)buffer)[0] = packet_length;
-		rc = ptpip_cmd_client_read(cam, buffer + size, packet_length - size);
-
-		if (rc != packet_length - size) {
-			vcam_log("Read %d, wanted %d", rc, packet_length - size);
-			return -1;
-		}
-
-		// Send our response
-		size = send(client_socket, buffer, packet_length, 0);
-		if (size <= 0) {
-			perror("Error sending data to client");
-			return -1;
-		}
-	}
-
-	free(buffer);
-
-	return 0;
+// Containers go out as they are
+static int fuji_header(struct PtpIpConn *c, const struct PtpBulkContainer *usb, uint8_t hdr[64]) {
+	memcpy(hdr, usb, 12);
+	return 12;
 }
 
+static const struct PtpIpProtocol fuji_protocol = {
+	.min_packet = 12,
+	.packet = fuji_packet,
+	.header = fuji_header,
+	// Fuji initiators poll events with an opcode
+	.event = NULL,
+};
+
 static int new_ptp_tcp_socket(int port) {
 	int server_socket = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -211,7 +78,6 @@ static int new_ptp_tcp_socket(int port) {
 	}
 
 	int yes = 1;
-	int no = 0;
 	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0) {
 		perror("Failed to set sockopt");
 	}
@@ -239,7 +105,7 @@ static int new_ptp_tcp_socket(int port) {
 		return -1;
 	}
 
-	if (listen(server_socket, 5) == -1) {
+	if (listen(server_socket, SOMAXCONN) == -1) {
 		perror("Listening failed");
 		close(server_socket);
 		return -1;
@@ -250,51 +116,186 @@ static int new_ptp_tcp_socket(int port) {
 	return server_socket;
 }
 
-int ptp_fuji_liveview(int socket);
+// Liveview frames go out like the capture in FUJI_DUMMY_LV_JPEG: a 32 bit length of the whole frame,
+// 14 more header bytes, then the JPEG. Frames are preloaded and framed once.
+#define FUJI_LV_HEADER_SIZE 18
+#define FUJI_LV_MAX_FRAMES 4
+
+struct FujiLiveview {
+	uint8_t *frames[FUJI_LV_MAX_FRAMES];
+	uint32_t lengths[FUJI_LV_MAX_FRAMES];
+	int length;
+	int fps;
+	/// @brief Frame generator replacing the stock frames, when --lv-synth is given
+	struct VcamSynth *synth;
+};
+
+static uint8_t *load_file(const char *path, uint32_t of, uint32_t *length) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		vcam_log("File %s not found", path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
 
-static void *fuji_accept_remote_ports_thread(void *arg) {
-	int event_socket = new_ptp_tcp_socket(FUJI_EVENT_IP_PORT);
-	int video_socket = new_ptp_tcp_socket(FUJI_LIVEVIEW_IP_PORT);
+	uint8_t *buffer = malloc(of + (size_t)size);
+	if (buffer == NULL || fread(buffer + of, 1, (size_t)size, file) != (size_t)size) {
+		vcam_log("Failed to read %s", path);
+		free(buffer);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*length = of + (uint32_t)size;
+	return buffer;
+}
 
-	struct sockaddr_in client_address_event;
-	socklen_t client_address_length_event = sizeof(client_address_event);
-	int client_socket_event = accept(event_socket, (struct sockaddr *)&client_address_event, &client_address_length_event);
-	if (client_socket_event == -1) {
-		vcam_log("Failed to accept event socket");
-		abort();
+// The captured stream is used as is, the other JPEGs get a copy of its header
+static int liveview_load(struct FujiLiveview *lv) {
+	uint32_t length;
+	uint8_t *stream = load_file(PWD "/" FUJI_DUMMY_LV_JPEG, 0, &length);
+	if (stream == NULL) return -1;
+	if (length < FUJI_LV_HEADER_SIZE) {
+		free(stream);
+		return -1;
+	}
+	lv->frames[0] = stream;
+	lv->lengths[0] = length;
+	lv->length = 1;
+
+	const char *jpegs[] = {PWD "/" FUJI_DUMMY_LV_JPEG2};
+	for (size_t i = 0; i < sizeof(jpegs) / sizeof(jpegs[0]); i++) {
+		uint8_t *frame = load_file(jpegs[i], FUJI_LV_HEADER_SIZE, &length);
+		if (frame == NULL) continue;
+		memcpy(frame, stream, FUJI_LV_HEADER_SIZE);
+		memcpy(frame, &length, 4);
+		lv->frames[lv->length] = frame;
+		lv->lengths[lv->length] = length;
+		lv->length++;
 	}
+	return 0;
+}
 
-	vcam_log("Event port connection accepted from %s:%d", inet_ntoa(client_address_event.sin_addr), ntohs(client_address_event.sin_port));
+// Send a frame every 1/fps seconds until the client goes away. A frame is never cut short, but if the last one is
+// still going out, or the socket holds more than a frame nobody has read, the frame for that tick is dropped so
+// the client always gets a recent picture instead of a growing backlog.
+static void liveview_pump(struct FujiLiveview *lv, int fd) {
+	uint64_t period = 1000000 / (uint64_t)lv->fps;
+	uint64_t start = now_us();
+	uint64_t next = start;
+	unsigned long sent = 0, dropped = 0;
+	uint32_t tick = 0;
+	int frame = 0;
+	const uint8_t *cur = NULL;
+	size_t cur_left = 0;
 
-	struct sockaddr_in client_address_video;
-	socklen_t client_address_length_video = sizeof(client_address_video);
-	int client_socket_video = accept(video_socket, (struct sockaddr *)&client_address_video, &client_address_length_video);
-	if (client_socket_video == -1) {
-		vcam_log("Failed to accept video socket");
-		abort();
+	while (1) {
+		uint64_t now = now_us();
+		if (now >= next) {
+			int queued = 0;
+			tick++;
+			if (cur_left == 0 && ioctl(fd, SIOCOUTQ, &queued) == 0 && (uint32_t)queued < lv->lengths[frame]) {
+				if (lv->synth) {
+					// Numbered by tick, so dropped frames show up as gaps on the client
+					uint32_t length = FUJI_LV_HEADER_SIZE + (uint32_t)vcam_synth_frame(lv->synth, FUJI_LV_HEADER_SIZE, tick, now);
+					memcpy(lv->synth->out, lv->frames[0], FUJI_LV_HEADER_SIZE);
+					memcpy(lv->synth->out, &length, 4);
+					cur = lv->synth->out;
+					cur_left = length;
+					// Next tick's backlog check goes by the size of this frame
+					lv->lengths[0] = length;
+				} else {
+					cur = lv->frames[frame];
+					cur_left = lv->lengths[frame];
+					frame = (frame + 1) % lv->length;
+				}
+			} else {
+				dropped++;
+			}
+			next += period;
+			// Don't burst to catch up after a stall
+			if (next <= now) next = now + period;
+		}
+
+		if (cur_left) {
+			ssize_t n = send(fd, cur, cur_left, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+			if (n > 0) {
+				cur += n;
+				cur_left -= (size_t)n;
+				if (cur_left == 0) sent++;
+			}
+		}
+
+		now = now_us();
+		uint64_t wait = next > now ? next - now : 0;
+		struct timespec ts = {(time_t)(wait / 1000000), (long)(wait % 1000000) * 1000};
+		struct pollfd pfd = {fd, (short)(POLLIN | (cur_left ? POLLOUT : 0)), 0};
+		if (ppoll(&pfd, 1, &ts, NULL) < 0 && errno != EINTR) break;
+		if (pfd.revents & (POLLERR | POLLHUP)) break;
+		if (pfd.revents & POLLIN) {
+			// Nothing is expected from the client, only its disconnect
+			uint8_t discard[64];
+			if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) == 0) break;
+		}
 	}
 
-	vcam_log("Video port connection accepted from %s:%d", inet_ntoa(client_address_video.sin_addr), ntohs(client_address_video.sin_port));
+	double seconds = (double)(now_us() - start) / 1e6;
+	vcam_log("Liveview closed: %lu frames sent, %lu dropped in %.1f s (%.1f fps)",
+		sent, dropped, seconds, seconds > 0 ? (double)sent / seconds : 0.0);
+}
 
-	// TODO: Do this continuously with two frames? 
-	ptp_fuji_liveview(client_socket_video);
+// The event port is served by the reactor, the liveview stream gets its own thread
+static void *fuji_accept_remote_ports_thread(void *arg) {
+	struct FujiLiveview *lv = (struct FujiLiveview *)arg;
+	int video_socket = new_ptp_tcp_socket(FUJI_LIVEVIEW_IP_PORT);
+	if (video_socket == -1) return (void *)0;
 
-	// TODO: Break loop on sigint?
+	// Clients reconnect the stream whenever they reopen the remote screen
 	while (1) {
-		uint32_t temp;
-		vcam_log("Liveview/event thread sleeping... (read attempts %d %d)", recv(client_socket_video, &temp, 4, 0), recv(client_socket_event, &temp, 4, 0));
-		usleep(1000000);
+		struct sockaddr_in client_address_video;
+		socklen_t client_address_length_video = sizeof(client_address_video);
+		int client_socket_video = accept(video_socket, (struct sockaddr *)&client_address_video, &client_address_length_video);
+		if (client_socket_video == -1) {
+			if (errno == EINTR) continue;
+			perror("Failed to accept video socket");
+			break;
+		}
+
+		vcam_log("Video port connection accepted from %s:%d, streaming %d frames at %d fps",
+			inet_ntoa(client_address_video.sin_addr), ntohs(client_address_video.sin_port), lv->length, lv->fps);
+		liveview_pump(lv, client_socket_video);
+		close(client_socket_video);
 	}
 
+	close(video_socket);
 	return (void *)0;
 }
 
-void fuji_accept_remote_ports(void) {
-	pthread_t thread;
+void fuji_accept_remote_ports(vcam *cam) {
+	// InitiateOpenCapture can come more than once, the port only has to be opened once
+	static struct FujiLiveview lv;
+	if (lv.length) return;
+
+	if (liveview_load(&lv)) return;
+	lv.fps = cam->lv_fps ? cam->lv_fps : FUJI_LV_DEFAULT_FPS;
+	if (cam->lv_width) {
+		lv.synth = calloc(1, sizeof(struct VcamSynth));
+		if (lv.synth == NULL) abort();
+		if (vcam_synth_init(lv.synth, cam->lv_width, cam->lv_height, cam->lv_quality)) {
+			vcam_log("Invalid --lv-synth %dx%d quality %d", cam->lv_width, cam->lv_height, cam->lv_quality);
+			free(lv.synth);
+			lv.synth = NULL;
+		}
+	}
 
-	if (pthread_create(&thread, NULL, fuji_accept_remote_ports_thread, NULL)) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, fuji_accept_remote_ports_thread, &lv)) {
 		return;
 	}
+	pthread_detach(thread);
 
 	vcam_log("Started new thread to accept remote ports");
 }
@@ -338,46 +339,27 @@ int fuji_wifi_main(vcam *cam) {
 		vcam_log("Error, make sure to add virtual network device");
 		return 1;
 	}
+	int event_socket = new_ptp_tcp_socket(FUJI_EVENT_IP_PORT);
+	if (event_socket == -1) {
+		close(server_socket);
+		return 1;
+	}
 
 	if (cam->sig) {
 		vcam_log("Sending signal to parent %d", cam->sig);
 		kill(cam->sig, SIGUSR1);
 	}
 
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
-	int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_length);
-
-	if (client_socket == -1) {
-		perror("Accept failed");
-		close(server_socket);
-		return -1;
-	}
-
-	vcam_log("Connection accepted from %s:%d", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-
-	while (1) {
-		if (tcp_receive_all(cam, client_socket)) {
-			goto err;
-		}
-
-		// Now the app has sent the data, and is waiting for a response.
+	struct PtpIpReactor r;
+	ptpip_reactor_init(&r, &fuji_protocol, cam, cam->max_sessions);
+	r.use_io_uring = cam->io_uring;
+	int rc = ptpip_reactor_listen(&r, server_socket, PTPIP_CONN_COMMAND);
+	if (rc == 0)
+		rc = ptpip_reactor_listen(&r, event_socket, PTPIP_CONN_EVENT);
+	if (rc == 0)
+		rc = ptpip_reactor_run(&r);
 
-		// Read packet length
-		if (tcp_send_all(cam, client_socket)) {
-			goto err;
-		}
-	}
-
-	close(client_socket);
+	ptpip_reactor_free(&r);
 	vcam_log("Connection closed");
-	close(server_socket);
-
-	return 0;
-
-err:;
-	puts("Connection forced down");
-	close(client_socket);
-	close(server_socket);
-	return -1;
+	return rc;
 }
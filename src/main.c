@@ -30,15 +30,35 @@ void sigint_handler(int x) {
 
 int main(int argc, const char *argv[]) {
 	signal(SIGINT, sigint_handler);
+	// A client going away is handled where the send fails, io_uring's WRITE_FIXED has no MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+
+	if (argc == 3 && !strcmp(argv[1], "--config")) {
+		int rc = vcam_run_config(argv[2]);
+		close_all_fds();
+		return rc;
+	}
 
 	if (argc < 3) {
 		printf(
 			"Usage: vcam <model> <backend> ... flags ...\n"
+			"       vcam --config <file>\n"
 			"Example:\n"
 			"vcam canon_1300d tcp\n"
+			"--config <file>\tRun every camera in file, one '<model> <backend> [flags...]' per line\n"
 			"--local-ip\tUse IP address of this machine\n"
+			"--ip <ip>\tIP address a PTP/IP camera listens on and Fuji advertises\n"
 			"--fs <path>\tSpecify path to scan for PTP filesystem\n"
 			"--sig <pid>\tSpecify process to signal when TCP server is listening\n"
+			"--io-window <KiB>\tHow much of a file is buffered at once when sending an object (default 1024)\n"
+			"--coalesce <ms>\tMerge a property change into a pending change of the same property queued within this window\n"
+			"--sessions <n>\tServe up to n TCP initiators at once instead of exiting after the first\n"
+			"--io-uring\tServe TCP with io_uring, falls back to epoll if the kernel lacks it\n"
+			"--data-chunk <KiB>\tSplit PTP/IP data phases into data packets of this size (default 64)\n"
+			"--lv-fps <n>\tLiveview frame rate for Fuji and Canon EOS (default 30)\n"
+			"--lv <path>\tCanon EOS liveview frames: a directory of JPEGs or a concatenated MJPEG file\n"
+			"--lv-synth <w>x<h>\tGenerate liveview frames showing their frame number and timestamp, instead of stock frames\n"
+			"--lv-quality <q>\tJPEG quality of generated liveview frames (default 75)\n"
 			"--dump\tDump all communication data to COMM_DUMP\n"
 		);
 		return -1;
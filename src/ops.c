@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "vcam.h"
 
 #ifdef HAVE_LIBEXIF
@@ -70,8 +71,7 @@ int ptp_closesession_write(vcam *cam, ptpcontainer *ptp) {
 
 int ptp_deviceinfo_write(vcam *cam, ptpcontainer *ptp) {
 	unsigned char *data;
-	int x = 0, i, cnt;
-	uint16_t *opcodes, *devprops;
+	int x = 0, i;
 	uint16_t imageformats[1];
 	uint16_t events[5];
 
@@ -88,7 +88,8 @@ int ptp_deviceinfo_write(vcam *cam, ptpcontainer *ptp) {
 		return 1;
 #endif
 	}
-	data = malloc(2000);
+	// Room for the five strings at 1 + 2 * 255 bytes each, and the code arrays
+	data = vcam_scratch(cam, 5 * 512 + 64 + 2 * (cam->opcodes->length + cam->props->length + 16));
 
 	// TODO: Allow cameras to customize these
 	x += put_16bit_le(data + x, 0x64); /* StandardVersion */
@@ -97,16 +98,9 @@ int ptp_deviceinfo_write(vcam *cam, ptpcontainer *ptp) {
 	x += put_string(data + x, cam->extension); /* VendorExtensionDesc */
 	x += put_16bit_le(data + x, 0);		/* FunctionalMode */
 
-	opcodes = malloc(cam->opcodes->length * sizeof(uint16_t));
-
-	cnt = 0;
-	for (i = 0; i < cam->opcodes->length; i++) {
-		opcodes[cnt] = cam->opcodes->handlers[i].code;
-		cnt++;
-	}
-
-	x += put_16bit_le_array(data + x, opcodes, cnt); /* OperationsSupported */
-	free(opcodes);
+	x += put_32bit_le(data + x, cam->opcodes->length); /* OperationsSupported */
+	for (i = 0; i < cam->opcodes->length; i++)
+		x += put_16bit_le(data + x, cam->opcodes->handlers[i].code);
 
 	events[0] = 0x4002;
 	events[1] = 0x4003;
@@ -115,11 +109,9 @@ int ptp_deviceinfo_write(vcam *cam, ptpcontainer *ptp) {
 	events[4] = 0x400d;
 	x += put_16bit_le_array(data + x, events, sizeof(events) / sizeof(events[0])); /* EventsSupported */
 
-	devprops = malloc(cam->props->length * sizeof(uint16_t));
+	x += put_32bit_le(data + x, cam->props->length); /* DevicePropertiesSupported */
 	for (i = 0; i < cam->props->length; i++)
-		devprops[i] = cam->props->handlers[i].code;
-	x += put_16bit_le_array(data + x, devprops, cam->props->length); /* DevicePropertiesSupported */
-	free(devprops);
+		x += put_16bit_le(data + x, cam->props->handlers[i]->code);
 
 	imageformats[0] = 0x3801;
 	x += put_16bit_le_array(data + x, imageformats, 1); /* CaptureFormats */
@@ -134,7 +126,6 @@ int ptp_deviceinfo_write(vcam *cam, ptpcontainer *ptp) {
 	x += put_string(data + x, cam->serial);
 
 	ptp_senddata(cam, 0x1001, data, x);
-	free(data);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
@@ -167,12 +158,7 @@ int ptp_getnumobjects_write(vcam *cam, ptpcontainer *ptp) {
 	if (ptp->nparams >= 3) {
 		mode = ptp->params[2];
 		if ((mode != 0) && (mode != 0xffffffff)) {
-			cur = cam->first_dirent;
-			while (cur) {
-				if (cur->id == mode)
-					break;
-				cur = cur->next;
-			}
+			cur = vcam_get_object(cam, mode);
 			if (!cur) {
 				vcam_log_func(__func__, "requested subtree of (0x%08x), but no such handle", mode);
 				ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
@@ -186,25 +172,18 @@ int ptp_getnumobjects_write(vcam *cam, ptpcontainer *ptp) {
 		}
 	}
 
-	cnt = 0;
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id) { /* do not include 0 entry */
-			switch (mode) {
-			case 0: /* all objects recursive on device */
-				cnt++;
-				break;
-			case 0xffffffff: /* only root dir */
-				if (cur->parent->id == 0)
-					cnt++;
-				break;
-			default: /* single level directory below this handle */
-				if (cur->parent->id == mode)
-					cnt++;
-				break;
-			}
-		}
-		cur = cur->next;
+	switch (mode) {
+	case 0: /* all objects recursive on device */
+		cnt = vcam_get_object_count(cam);
+		break;
+	case 0xffffffff: /* only root dir */
+		cur = vcam_get_root(cam);
+		cnt = cur ? cur->nchildren : 0;
+		break;
+	default: /* single level directory below this handle */
+		vcam_scan_dir(cam, cur);
+		cnt = cur->nchildren;
+		break;
 	}
 
 	ptp_response(cam, PTP_RC_OK, 1, cnt);
@@ -240,12 +219,7 @@ int ptp_getobjecthandles_write(vcam *cam, ptpcontainer *ptp) {
 	if (ptp->nparams >= 3) {
 		mode = ptp->params[2];
 		if ((mode != 0) && (mode != 0xffffffff)) {
-			cur = cam->first_dirent;
-			while (cur) {
-				if (cur->id == mode)
-					break;
-				cur = cur->next;
-			}
+			cur = vcam_get_object(cam, mode);
 			if (!cur) {
 				vcam_log_func(__func__, "requested subtree of (0x%08x), but no such handle", mode);
 				ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
@@ -259,56 +233,35 @@ int ptp_getobjecthandles_write(vcam *cam, ptpcontainer *ptp) {
 		}
 	}
 
-	cnt = 0;
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id) { /* do not include 0 entry */
-			switch (mode) {
-			case 0: /* all objects recursive on device */
-				cnt++;
-				break;
-			case 0xffffffff: /* only root dir */
-				if (cur->parent->id == 0)
-					cnt++;
-				break;
-			default: /* single level directory below this handle */
-				if (cur->parent->id == mode)
-					cnt++;
-				break;
-			}
-		}
-		cur = cur->next;
-	}
-
-	data = malloc(4 + 4 * cnt);
-	x = put_32bit_le(data + x, cnt);
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id) { /* do not include 0 entry */
-			switch (mode) {
-			case 0: /* all objects recursive on device */
+	/* Both lists are newest object first */
+	if (mode == 0) { /* all objects recursive on device */
+		vcam_scan_all(cam);
+		data = vcam_scratch(cam, 4 + 4 * cam->objects.length);
+		x = 4;
+		for (cur = cam->first_dirent; cur; cur = cur->next) {
+			if (cur->id) /* do not include 0 entry */
 				x += put_32bit_le(data + x, cur->id);
-				break;
-			case 0xffffffff: /* only root dir */
-				if (cur->parent->id == 0)
-					x += put_32bit_le(data + x, cur->id);
-				break;
-			default: /* single level directory below this handle */
-				if (cur->parent->id == mode)
-					x += put_32bit_le(data + x, cur->id);
-				break;
-			}
 		}
-		cur = cur->next;
-	}
+	} else {
+		if (mode == 0xffffffff) /* only root dir */
+			cur = vcam_get_root(cam);
+		else /* single level directory below this handle */
+			vcam_scan_dir(cam, cur);
+		cnt = cur ? cur->nchildren : 0;
+		data = vcam_scratch(cam, 4 + 4 * cnt);
+		x = 4;
+		for (int i = cnt - 1; i >= 0; i--)
+			x += put_32bit_le(data + x, cur->children[i]->id);
+	}
+	cnt = (x - 4) / 4;
+	put_32bit_le(data, cnt);
 	ptp_senddata(cam, ptp->code, data, x);
-	free(data);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
 
 int ptp_getstorageids_write(vcam *cam, ptpcontainer *ptp) {
-	unsigned char *data;
+	unsigned char data[200];
 	int x = 0;
 	uint32_t sids[1];
 
@@ -316,19 +269,16 @@ int ptp_getstorageids_write(vcam *cam, ptpcontainer *ptp) {
 	if (vcam_check_session(cam))return 1;
 	if (vcam_check_param_count(cam, ptp, 0))return 1;
 
-	data = malloc(200);
-
 	sids[0] = 0x00010001;
 	x = put_32bit_le_array(data, sids, 1);
 
 	ptp_senddata(cam, ptp->code, data, x);
-	free(data);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
 
 int ptp_getstorageinfo_write(vcam *cam, ptpcontainer *ptp) {
-	unsigned char *data;
+	unsigned char data[200];
 	int x = 0;
 
 	if (vcam_check_trans_id(cam, ptp))return 1;
@@ -341,7 +291,6 @@ int ptp_getstorageinfo_write(vcam *cam, ptpcontainer *ptp) {
 		return 1;
 	}
 
-	data = malloc(200);
 	x += put_16bit_le(data + x, 3);		   /* StorageType: Fixed RAM */
 	x += put_16bit_le(data + x, 3);		   /* FileSystemType: Generic Hierarchical */
 	x += put_16bit_le(data + x, 2);		   /* AccessCapability: R/O with object deletion */
@@ -352,7 +301,6 @@ int ptp_getstorageinfo_write(vcam *cam, ptpcontainer *ptp) {
 	x += put_string(data + x, "Fake Label");  /* VolumeLabel */
 
 	ptp_senddata(cam, 0x1005, data, x);
-	free(data);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
@@ -364,12 +312,7 @@ int ptp_getpartialobject_write(vcam *cam, ptpcontainer *ptp) {
 
 	vcam_log("GetPartialObject %d (%X %X)", ptp->params[0], ptp->params[1], ptp->params[2]);
 
-	struct ptp_dirent *cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id == ptp->params[0])
-			break;
-		cur = cur->next;
-	}
+	struct ptp_dirent *cur = vcam_get_object(cam, ptp->params[0]);
 
 	if (!cur) {
 		vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
@@ -377,36 +320,34 @@ int ptp_getpartialobject_write(vcam *cam, ptpcontainer *ptp) {
 		return 1;
 	}
 
-	FILE *file = fopen(cur->fsname, "rb");
-	if (file == NULL) {
-		vcam_log("File %s not found", cur->fsname);
-		exit(-1);
-	}
-
-	size_t start = (size_t)ptp->params[1];
-	size_t size = (size_t)ptp->params[2];
-
-	if (fseek(file, start, SEEK_SET) == -1) {
-		ptp_response(cam, PTP_RC_OK, 0);
+	int fd = vcam_open_object(cam, cur);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		if (fd >= 0) close(fd);
+		ptp_response(cam, PTP_RC_GeneralError, 0);
 		return 1;
 	}
 
-	char *buffer = malloc(size);
-	int read = fread(buffer, 1, size, file); // TODO: check for folder
+	off_t start = (off_t)ptp->params[1];
+	size_t size = (size_t)ptp->params[2];
 
-	ptp_senddata(cam, ptp->code, (unsigned char *)buffer, read);
-	vcam_log("Generic sending %d", read);
+	/* Reads past the end are cut short, like fread */
+	if (!S_ISREG(st.st_mode) || start >= st.st_size)
+		size = 0;
+	else if (size > (size_t)(st.st_size - start))
+		size = (size_t)(st.st_size - start);
 
-	free(buffer);
-	fclose(file);
+	ptp_data_start(cam, ptp->code, (int)size);
+	ptp_data_add_file(cam, fd, start, (int)size);
+	vcam_log("Generic sending %d", (int)size);
 
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
 
-int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
-	struct ptp_dirent *cur;
-	unsigned char *data;
+// Serialize the ObjectInfo dataset of an object into data (at least 2000 bytes)
+// Returns the length, -1 if the file couldn't be read
+static int pack_objectinfo(struct ptp_dirent *cur, unsigned char *data) {
 	int x = 0;
 	uint16_t ofc, thumbofc = 0;
 	int thumbwidth = 0, thumbheight = 0, thumbsize = 0;
@@ -415,45 +356,6 @@ int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
 	time_t xtime;
 	char xdate[40];
 
-	if (vcam_check_trans_id(cam, ptp)) return 1;
-	if (vcam_check_session(cam)) return 1;
-	if (vcam_check_param_count(cam, ptp, 1)) return 1;
-
-	time_t time1;
-	time(&time1);
-
-	struct ptp_dirent fake = {
-		.id = 0xdeadbeef,
-		.name = "test.png",
-		.fsname = "bin/test.png",
-		.stbuf = {
-			.st_mode = 0,
-			.st_size = 1234,
-			.st_atime = time1,
-			.st_mtime = time1,
-			.st_ctime = time1,
-		},
-		.parent = NULL
-	};
-
-	// Fake opcode tests
-	if (ptp->params[0] == 0xdeadbeef) {
-		cur = &fake;
-	} else {
-		cur = cam->first_dirent;
-		while (cur) {
-			if (cur->id == ptp->params[0])
-				break;
-			cur = cur->next;
-		}
-		if (!cur) {
-			vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
-			ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
-			return 1;
-		}
-	}
-
-	data = malloc(2000);
 	x += put_32bit_le(data + x, 0x10000001); /* StorageID */
 	/* ObjectFormatCode */
 	ofc = 0x3000;
@@ -481,6 +383,15 @@ int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
 			ofc = 0x300B;
 	}
 
+	if (ofc == 0x3801) { /* We are jpeg ... see if it has a thumbnail */
+		off_t thumboffset;
+		uint32_t thumblength;
+		if (vcam_find_thumb(cur, &thumboffset, &thumblength) == 0) {
+			thumbofc = 0x3808;
+			thumbsize = thumblength;
+		}
+	}
+
 #ifdef HAVE_LIBEXIF
 	if (ofc == 0x3801) { /* We are jpeg ... look into the exif data */
 		ExifData *ed;
@@ -488,18 +399,11 @@ int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
 		unsigned char *filedata;
 
 		filedata = read_file(cur);
-		if (!filedata) {
-			free(data);
-			ptp_response(cam, PTP_RC_GeneralError, 0);
-			return 1;
-		}
+		if (!filedata)
+			return -1;
 
 		ed = exif_data_new_from_data((unsigned char *)filedata, cur->stbuf.st_size);
 		if (ed) {
-			if (ed->data) {
-				thumbofc = 0x3808;
-				thumbsize = ed->size;
-			}
 			e = exif_data_get_entry(ed, EXIF_TAG_PIXEL_X_DIMENSION);
 			if (e) {
 				vcam_log_func(__func__, "pixel x dim format is %d", e->format);
@@ -575,39 +479,106 @@ int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
 		x += put_string(data + x, "Orientation: 1");
 	}
 
-	ptp_senddata(cam, 0x1008, data, x);
-	free(data);
+	return x;
+}
+
+// The cached dataset is only valid for the same file contents and the same parent handle
+static int objectinfo_is_cached(struct ptp_dirent *cur) {
+	return cur->info != NULL &&
+		vcam_filekey_matches(&cur->info_key, &cur->stbuf) &&
+		cur->info_parent == (cur->parent ? cur->parent->id : 0xffffffff);
+}
+
+int ptp_getobjectinfo_write(vcam *cam, ptpcontainer *ptp) {
+	struct ptp_dirent *cur;
+	unsigned char data[2000];
+	struct stat st;
+	int x;
+
+	if (vcam_check_trans_id(cam, ptp)) return 1;
+	if (vcam_check_session(cam)) return 1;
+	if (vcam_check_param_count(cam, ptp, 1)) return 1;
+
+	time_t time1;
+	time(&time1);
+
+	struct ptp_dirent fake = {
+		.id = 0xdeadbeef,
+		.name = "test.png",
+		.fsname = "bin/test.png",
+		.stbuf = {
+			.st_mode = 0,
+			.st_size = 1234,
+			.st_atime = time1,
+			.st_mtime = time1,
+			.st_ctime = time1,
+		},
+		.parent = NULL
+	};
+
+	// Fake opcode tests
+	if (ptp->params[0] == 0xdeadbeef) {
+		x = pack_objectinfo(&fake, data);
+		ptp_senddata(cam, 0x1008, data, x);
+		ptp_response(cam, PTP_RC_OK, 0);
+		return 1;
+	}
+
+	cur = vcam_get_object(cam, ptp->params[0]);
+	if (!cur) {
+		vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
+		ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
+		return 1;
+	}
+
+	// A stat is much cheaper than reading the file again (virtual objects can't be stat'd)
+	if (stat(cur->fsname, &st) == 0)
+		cur->stbuf = st;
+
+	if (!objectinfo_is_cached(cur)) {
+		x = pack_objectinfo(cur, data);
+		if (x < 0) {
+			ptp_response(cam, PTP_RC_GeneralError, 0);
+			return 1;
+		}
+		free(cur->info);
+		cur->info = malloc(x);
+		if (cur->info == NULL) abort();
+		memcpy(cur->info, data, x);
+		cur->info_length = x;
+		vcam_filekey_set(&cur->info_key, &cur->stbuf);
+		cur->info_parent = cur->parent ? cur->parent->id : 0xffffffff;
+	}
+
+	ptp_senddata(cam, 0x1008, cur->info, cur->info_length);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
 
 int ptp_getobject_write(vcam *cam, ptpcontainer *ptp) {
-	unsigned char *data;
 	struct ptp_dirent *cur;
 
 	if (vcam_check_trans_id(cam, ptp))return 1;
 	if (vcam_check_session(cam))return 1;
 	if (vcam_check_param_count(cam, ptp, 1))return 1;
 
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id == ptp->params[0])
-			break;
-		cur = cur->next;
-	}
+	cur = vcam_get_object(cam, ptp->params[0]);
 	if (!cur) {
 		vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
 		ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
 		return 1;
 	}
-	data = read_file(cur);
-	if (!data) {
+	int fd = vcam_open_object(cam, cur);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		if (fd >= 0) close(fd);
 		ptp_response(cam, PTP_RC_GeneralError, 0);
 		return 1;
 	}
 
-	ptp_senddata(cam, ptp->code, data, cur->stbuf.st_size);
-	free(data);
+	/* Sent straight from the file, a window at a time */
+	ptp_data_start(cam, ptp->code, (int)st.st_size);
+	ptp_data_add_file(cam, fd, 0, (int)st.st_size);
 	ptp_response(cam, PTP_RC_OK, 0);
 
 #ifdef VCAM_FUJI
@@ -618,11 +589,10 @@ int ptp_getobject_write(vcam *cam, ptpcontainer *ptp) {
 }
 
 int ptp_getthumb_write(vcam *cam, ptpcontainer *ptp) {
-	unsigned char *data;
 	struct ptp_dirent *cur;
-#ifdef HAVE_LIBEXIF
-	ExifData *ed;
-#endif
+	struct stat st;
+	off_t offset;
+	uint32_t length;
 
 	if (vcam_check_trans_id(cam, ptp))return 1;
 	if (vcam_check_session(cam))return 1;
@@ -630,54 +600,37 @@ int ptp_getthumb_write(vcam *cam, ptpcontainer *ptp) {
 
 	vcam_log("Processing thumbnail call for %d\n", ptp->params[0]);
 
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id == ptp->params[0])
-			break;
-		cur = cur->next;
-	}
+	cur = vcam_get_object(cam, ptp->params[0]);
 	if (!cur) {
 		vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
 		ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
 		return 1;
 	}
-	data = read_file(cur);
-	if (!data) {
-		ptp_response(cam, PTP_RC_GeneralError, 0);
-		return 1;
-	}
 
-#ifdef HAVE_LIBEXIF
-	ed = exif_data_new_from_data((unsigned char *)data, cur->stbuf.st_size);
-	if (!ed) {
-		vcam_log_func(__func__, "Could not parse EXIF data");
-		free(data);
+	if (stat(cur->fsname, &st) == 0)
+		cur->stbuf = st;
+
+	if (vcam_find_thumb(cur, &offset, &length)) {
+		vcam_log_func(__func__, "EXIF data does not contain a thumbnail");
 		ptp_response(cam, PTP_RC_NoThumbnailPresent, 0);
 		return 1;
 	}
-	if (!ed->data) {
-		vcam_log_func(__func__, "EXIF data does not contain a thumbnail");
-		free(data);
-		ptp_response(cam, PTP_RC_NoThumbnailPresent, 0);
-		exif_data_unref(ed);
+
+	int fd = vcam_open_object(cam, cur);
+	if (fd < 0) {
+		ptp_response(cam, PTP_RC_GeneralError, 0);
 		return 1;
 	}
+
 	/*
 	 * We found a thumbnail in EXIF data! Those
-	 * thumbnails are always JPEG. Set up the file.
+	 * thumbnails are always JPEG. Send it straight from the file.
 	 */
-	ptp_senddata(cam, 0x100A, ed->data, ed->size);
-	exif_data_unref(ed);
-
+	ptp_data_start(cam, 0x100A, length);
+	ptp_data_add_file(cam, fd, offset, length);
 	ptp_response(cam, PTP_RC_OK, 0);
-#else
-	vcam_log_func(__func__, "Cannot get thumbnail without libexif, lying about missing thumbnail");
-	ptp_response(cam, PTP_RC_NoThumbnailPresent, 0);
-#endif
 
 	vcam_log("Done processing thumbnail call\n");
-
-	free(data);
 	return 1;
 }
 
@@ -707,6 +660,7 @@ int ptp_initiatecapture_write(vcam *cam, ptpcontainer *ptp) {
 	}
 
 	/* just search for first jpeg we find in the tree, we will use this to send back as the captured image */
+	vcam_scan_all(cam);
 	cur = cam->first_dirent;
 	while (cur) {
 		if (strstr(cur->name, ".jpg") || strstr(cur->name, ".JPG"))
@@ -719,58 +673,47 @@ int ptp_initiatecapture_write(vcam *cam, ptpcontainer *ptp) {
 		return 1;
 	}
 	/* identify the DCIM dir, so we can attach a virtual xxxGPHOT directory to virtually store the new picture in */
-	dir = cam->first_dirent;
-	while (dir) {
-		if (!strcmp(dir->name, "DCIM") && dir->parent && !dir->parent->id)
-			dcim = dir;
-		dir = dir->next;
-	}
+	dir = vcam_get_root(cam);
+	if (dir)
+		dcim = vcam_find_child(dir, "DCIM");
 	/* find the nnnGPHOT directories, where nnn is 100-999. (See DCIM standard.) */
 	sprintf(buf, "%03dGPHOT", 100 + ((capcnt / 100) % 900));
-	dir = cam->first_dirent;
-	while (dir) {
-		if (!strcmp(dir->name, buf) && (dir->parent == dcim))
-			break;
-		dir = dir->next;
-	}
+	dir = dcim ? vcam_find_child(dcim, buf) : NULL;
 	/* if not yet found, create the virtual /DCIM/xxxGPHOT/ directory. */
 	if (!dir) {
-		dir = malloc(sizeof(struct ptp_dirent));
-		dir->id = ++cam->ptp_objectid;
-		dir->fsname = "virtual";
+		dir = calloc(1, sizeof(struct ptp_dirent));
+		dir->id = vcam_next_object_id(cam);
+		dir->fsname = strdup("virtual");
 		dir->stbuf = dcim->stbuf; /* only the S_ISDIR flag is used */
-		dir->parent = dcim;
-		dir->next = cam->first_dirent;
+		dir->scanned = 1;
 		dir->name = strdup(buf);
-		cam->first_dirent = dir;
+		vcam_add_object(cam, dir, dcim);
 		/* Emit ObjectAdded event for the created folder */
-		ptp_inject_interrupt(cam, 80, 0x4002, 1, cam->ptp_objectid, cam->seqnr); /* objectadded */
+		ptp_inject_interrupt(cam, 80, 0x4002, 1, dir->id, cam->seqnr); /* objectadded */
 	}
 	if (capcnt++ == 150) {
 		/* The start of the operation succeeds, but the memory runs full during it. */
-		ptp_inject_interrupt(cam, 100, 0x400A, 1, cam->ptp_objectid, cam->seqnr); /* storefull */
+		ptp_inject_interrupt(cam, 100, 0x400A, 1, dir->id, cam->seqnr); /* storefull */
 		ptp_response(cam, PTP_RC_OK, 0);
 		return 1;
 	}
 
-	newcur = malloc(sizeof(struct ptp_dirent));
-	newcur->id = ++cam->ptp_objectid;
+	newcur = calloc(1, sizeof(struct ptp_dirent));
+	newcur->id = vcam_next_object_id(cam);
 	newcur->fsname = strdup(cur->fsname);
 	newcur->stbuf = cur->stbuf;
-	newcur->parent = dir;
-	newcur->next = cam->first_dirent;
 	newcur->name = malloc(8 + 3 + 1 + 1);
 	sprintf(newcur->name, "GPH_%04d.JPG", capcnt++);
-	cam->first_dirent = newcur;
+	vcam_add_object(cam, newcur, dir);
 
-	ptp_inject_interrupt(cam, 100, 0x4002, 1, cam->ptp_objectid, cam->seqnr); /* objectadded */
+	ptp_inject_interrupt(cam, 100, 0x4002, 1, newcur->id, cam->seqnr); /* objectadded */
 	ptp_inject_interrupt(cam, 120, 0x400d, 0, 0, cam->seqnr);	     /* capturecomplete */
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
 
 int ptp_deleteobject_write(vcam *cam, ptpcontainer *ptp) {
-	struct ptp_dirent *cur, *xcur;
+	struct ptp_dirent *cur;
 
 	if (vcam_check_trans_id(cam, ptp))return 1;
 	if (vcam_check_session(cam))return 1;
@@ -782,14 +725,7 @@ int ptp_deleteobject_write(vcam *cam, ptpcontainer *ptp) {
 	}
 	if (ptp->params[0] == 0xffffffff) { /* delete all mode */
 		vcam_log_func(__func__, "delete all");
-		cur = cam->first_dirent;
-
-		while (cur) {
-			xcur = cur->next;
-			free_dirent(cur);
-			cur = xcur;
-		}
-		cam->first_dirent = NULL;
+		vcam_free_objects(cam);
 		ptp_response(cam, PTP_RC_OK, 0);
 		return 1;
 	}
@@ -801,12 +737,7 @@ int ptp_deleteobject_write(vcam *cam, ptpcontainer *ptp) {
 	}
 	/* for associations this even means recursive deletion */
 
-	cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id == ptp->params[0])
-			break;
-		cur = cur->next;
-	}
+	cur = vcam_get_object(cam, ptp->params[0]);
 	if (!cur) {
 		vcam_log_func(__func__, "invalid object id 0x%08x", ptp->params[0]);
 		ptp_response(cam, PTP_RC_InvalidObjectHandle, 0);
@@ -817,20 +748,8 @@ int ptp_deleteobject_write(vcam *cam, ptpcontainer *ptp) {
 		ptp_response(cam, PTP_RC_ObjectWriteProtected, 0);
 		return 1;
 	}
-	if (cur == cam->first_dirent) {
-		cam->first_dirent = cur->next;
-		free_dirent(cur);
-	} else {
-		xcur = cam->first_dirent;
-		while (xcur) {
-			if (xcur->next == cur) {
-				xcur->next = xcur->next->next;
-				free_dirent(cur);
-				break;
-			}
-			xcur = xcur->next;
-		}
-	}
+	vcam_unlink_object(cam, cur);
+	free_dirent(cur);
 	ptp_response(cam, PTP_RC_OK, 0);
 	return 1;
 }
@@ -922,8 +841,6 @@ int ptp_getdevicepropvalue_write(vcam *cam, ptpcontainer *ptp) {
 }
 
 int ptp_setdevicepropvalue_write(vcam *cam, ptpcontainer *ptp) {
-	int i;
-
 	if (vcam_check_trans_id(cam, ptp)) return 1;
 	if (vcam_check_session(cam)) return 1;
 	if (vcam_check_param_count(cam, ptp, 1)) return 1;
@@ -937,11 +854,7 @@ int ptp_setdevicepropvalue_write(vcam *cam, ptpcontainer *ptp) {
 		}
 	}
 
-	for (i = 0; i < cam->props->length; i++) {
-		if (cam->props->handlers[i].code == ptp->params[0])
-			break;
-	}
-	if (i == cam->props->length) {
+	if (vcam_get_prop(cam, (int)ptp->params[0]) == NULL) {
 		vcam_log_func(__func__, "deviceprop 0x%04x not found", ptp->params[0]);
 		ptp_response(cam, PTP_RC_DevicePropNotSupported, 0);
 		return 1;
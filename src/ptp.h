@@ -703,6 +703,7 @@ struct PtpIpInitPacket {
 #define PTPIP_PONG				0xE
 
 #define USB_VENDOR_CANON 0x4A9
+#define USB_VENDOR_FUJI 0x4cb
 
 // ISO number for PTP/IP
 #define PTP_IP_PORT 15740
@@ -1,278 +1,207 @@
 // PTP/IP packet wrapper over vusb USB packets - emulates standard PTP/IP as per spec
 // Mostly similar to Fuji TCP code, except this uses PTP/IP style packets
-// This code will listen on *any* IP address, so it will open up the ISO standard PTP port
-// to the entire computer
+// This code will listen on *any* IP address unless the camera is given one with --ip, so it will open up the
+// ISO standard PTP port to the entire computer
 #include <arpa/inet.h>
 #include <errno.h>
-#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include <vcam.h>
-
-struct Priv {
-	uint8_t *socket_init_resp;
-	int left_of_init_packet;
-	int first_write;
-};
-static inline struct Priv *priv(vcam *cam) {
-	return (struct Priv *)cam->hw_priv;
-}
-
-void *conv_ip_cmd_packet_to_usb(char *buffer, int length, int *outlength);
-void *conv_usb_packet_to_ip(char *buffer, int length, int *outlength);
-void *conv_ip_data_packets_to_usb(void *ds_buffer, void *de_buffer, int *outlength, int opcode);
-
-static int ptpip_cmd_write(vcam *cam, void *to, int length) {
-	// First packet from the app, info about device
-	if (priv(cam)->first_write) {
-		struct FujiInitPacket *p = (struct FujiInitPacket *)to;
-		vcam_log("vusb: init socket (%d bytes)", length);
-
-		priv(cam)->first_write = 0;
-
-		// Pretend like we read the packet
-		return length;
-	}
-
-	int rc = vcam_write(cam, 0x02, (unsigned char *)to, length);
-
-	#ifdef TCP_NOISY
-	vcam_log("<- read %d (%X)\n", rc, ((uint16_t *)to)[3]);
-	#endif
-
-	return rc;
-}
-
-static int ptpip_cmd_read(vcam *cam, void *to, int length) {
-	int rc = vcam_read(cam, 0x81, (unsigned char *)to, length);
-
+#include "reactor.h"
+
+// TODO: Don't hardcode
+static const uint8_t socket_init_resp[] = {
+	0x2e, 0x0, 0x0, 0x0,
+	0x2, 0x0, 0x0, 0x0,
+	0x1, 0x0, 0x0, 0x0,
+	0x0, 0x0, 0x0, 0x0,
+	0x0, 0x0, 0x0, 0x0,
+	0x0, 0x1, 0x0, 0xbb,
+	0xc1, 0x85, 0x9f, 0xab,
+	0x45, 0x0, 0x4f, 0x0, 0x53, 0x0, 0x54, 0x0, 0x36, 0x0, 0x7b, 0x0, 0x0, 0x0,
+	0x0, 0x0,
+	0x1, 0x0,};
+
+// Connection number in the init ack
+#define INIT_RESP_CONN_NUMBER 8
+
+// Default payload of each data packet
+#define PTPIP_DATA_CHUNK (64 * 1024)
+
+// Write a USB style container into the camera
+static void cam_write(struct PtpIpConn *c, const void *data, int length) {
 	#ifdef TCP_NOISY
-	vcam_log("-> write %d (%X)\n", rc, ((uint16_t *)to)[3]);
+	vcam_log("<- read %d (%X)\n", length, ((const uint16_t *)data)[3]);
 	#endif
-
-	return rc;
+	vcam_write(c->cam, 0x02, (const unsigned char *)data, length);
 }
 
-static void *tcp_receive_single_packet(int client_socket, int *length) {
-	// Read packet length (from the app, which is the initiator)
-	uint32_t packet_length;
-	ssize_t size;
-	for (int i = 0; i < 10; i++) {
-		size = recv(client_socket, &packet_length, sizeof(uint32_t), 0);
-
-		#ifdef TCP_NOISY
-		vcam_log("Read %d\n", size);
-		#endif
-
-		if (size == 0) {
-			vcam_log("Initiator isn't sending anything, trying again");
-			usleep(1000 * 500); // 1s
-			continue;
-		}
-
-		if (size < 0) {
-			perror("Error reading data from socket");
-			return NULL;
-		}
-
-		if (size != 4) {
-			vcam_log("Couldn't read 4 bytes, only got %d", size);
-			return NULL;
+static int command_packet(struct PtpIpConn *c, uint8_t *data, uint32_t length) {
+	const struct PtpIpHeader *h = (const struct PtpIpHeader *)data;
+	switch (h->type) {
+	case PTPIP_COMMAND_REQUEST: {
+		const struct PtpIpBulkContainer *bc = (const struct PtpIpBulkContainer *)data;
+		int nparams = ((int)length - 18) / 4;
+		if (nparams < 0 || nparams > 5) {
+			vcam_log("Command request with %d params", nparams);
+			return -1;
 		}
 
+		struct PtpBulkContainer usb;
+		usb.length = 12 + (uint32_t)nparams * 4;
+		usb.type = PTP_PACKET_TYPE_COMMAND;
+		usb.code = bc->code;
+		usb.transaction = bc->transaction;
+		memcpy(usb.params, bc->params, (size_t)nparams * 4);
+
+		if (bc->data_phase == 2)
+			c->data_code = bc->code;
+
+		ptpip_conn_command(c);
+		cam_write(c, &usb, (int)usb.length);
+		} break;
+	case PTPIP_DATA_PACKET_START: {
+		// The payload goes into the camera as it arrives, in a USB data container
+		const struct PtpIpStartDataPacket *ds = (const struct PtpIpStartDataPacket *)data;
+		struct PtpBulkContainer usb;
+		usb.length = 12 + (uint32_t)ds->payload_length;
+		usb.type = PTP_PACKET_TYPE_DATA;
+		usb.code = c->data_code;
+		usb.transaction = ds->transaction;
+		cam_write(c, &usb, 12);
+		} break;
+	case PTPIP_DATA_PACKET:
+	case PTPIP_DATA_PACKET_END:
+		if (length > 12)
+			cam_write(c, data + 12, (int)length - 12);
 		break;
+	case PTPIP_CANCEL_TRANSACTION:
+		vcam_log("Transaction 0x%X cancelled", h->params[0]);
+		break;
+	default:
+		vcam_log("Unknown PTP/IP packet type 0x%X", h->type);
 	}
-
-	if (size < 4) {
-		vcam_log("Didn't read enough of packet");
-		return NULL;
-	}
-
-	// Allocate the rest of the packet to read
-	uint8_t *buffer = malloc(size + packet_length);
-	if (buffer == NULL) abort();
-	((uint32_t *)buffer)[0] = packet_length;
-
-	// Continue reading the rest of the data
-	size += recv(client_socket, buffer + size, packet_length - size, 0);
-#ifdef TCP_NOISY
-	vcam_log("Read %d\n", size);
-#endif
-
-	(*length) = size;
-
-	if (size < 0) {
-		perror("Error reading data from socket");
-		return NULL;
-	} else if (size != packet_length) {
-		vcam_log("Couldn't read the rest of the packet, only got %d", size);
-		return NULL;
-	}
-
-	return buffer;
+	return 0;
 }
 
-// Receive data from app TCP, and route into vcam
-static int tcp_receive_all(vcam *cam, int client_socket) {
-	int packet_length = 0;
-	void *buffer = tcp_receive_single_packet(client_socket, &packet_length);
-	if (buffer == NULL) {
-		return -1;
-	}
+static int ptpip_packet(struct PtpIpReactor *r, struct PtpIpConn *c, uint8_t *data, uint32_t length) {
+	const struct PtpIpHeader *h = (const struct PtpIpHeader *)data;
 
-	struct PtpIpBulkContainer *bc = (struct PtpIpBulkContainer *)buffer;
-	if (bc->type == PTPIP_COMMAND_REQUEST) {
-		void *new_buffer = conv_ip_cmd_packet_to_usb(buffer, packet_length, &packet_length);
+	if (c->kind == PTPIP_CONN_COMMAND)
+		return command_packet(c, data, length);
 
-		// Route the read data into the vcam. The camera is the responder,
-		// and will next be writing data to the app.
-		int rc = ptpip_cmd_write(cam, new_buffer, packet_length);
-		if (rc != packet_length) {
-			return -1;
+	if (c->kind == PTPIP_CONN_EVENT) {
+		if (h->type == PTPIP_PING) {
+			uint32_t pong[2] = {8, PTPIP_PONG};
+			ptpip_conn_send(c, pong, sizeof(pong));
 		}
-
-		free(new_buffer);
-	} else if (bc->type == PTPIP_INIT_COMMAND_REQ) {
-		// Received init packet, send it into vcam to init vcam structs
-		vcam_log("Received init packet");
-		ptpip_cmd_write(cam, buffer, packet_length);
 		return 0;
 	}
 
-	if (bc->data_phase == 2) {
-		vcam_log("Received data phase");
-
-		// Read in data start packet
-		void *buffer_ds = tcp_receive_single_packet(client_socket, &packet_length);
-		if (buffer_ds == NULL) {
-			return -1;
-		}
-
-		struct PtpIpStartDataPacket *ds = (struct PtpIpStartDataPacket *)buffer_ds;
-		if (ds->type != PTPIP_DATA_PACKET_START) {
-			vcam_log("Didn't get end data packet");
-			return -1;
-		}
-
-		// Receive data end packet (which has payload)
-		void *buffer_de = tcp_receive_single_packet(client_socket, &packet_length);
-		if (buffer_de == NULL) {
-			return -1;
-		}
-
-		struct PtpIpEndDataPacket *ed = (struct PtpIpEndDataPacket *)buffer_de;
-		if (ed->type != PTPIP_DATA_PACKET_END) {
-			vcam_log("Didn't get end data packet");
-			return -1;
-		}
-
-		void *new_buffer = conv_ip_data_packets_to_usb(buffer_ds, buffer_de, &packet_length, bc->code);
-		free(buffer_ds);
-		free(buffer_de);
+	// The first packet decides what the socket is for
+	if (h->type == PTPIP_INIT_COMMAND_REQ) {
+		vcam_log("Received init packet");
+		if (ptpip_open_session(r, c)) return -1;
 
-		// Finally, send the single packet into vcam
-		int rc = ptpip_cmd_write(cam, new_buffer, packet_length);
-		if (rc != packet_length) {
+		uint8_t ack[sizeof(socket_init_resp)];
+		memcpy(ack, socket_init_resp, sizeof(ack));
+		memcpy(ack + INIT_RESP_CONN_NUMBER, &c->id, 4);
+		ptpip_conn_send(c, ack, sizeof(ack));
+		printf("vcam - running %s, session %u\n", c->cam->model, c->id);
+		return 0;
+	} else if (h->type == PTPIP_INIT_EVENT_REQ) {
+		vcam_log("Received event socket req");
+		struct PtpIpConn *s = ptpip_get_session(r, length >= 12 ? h->params[0] : 0);
+		// Cameras sharing the reactor number their sessions together, an initiator only gets its own camera's
+		if (s == NULL || s->peer != NULL || s->listener != c->listener) {
+			vcam_log("No session for event socket");
 			return -1;
 		}
 
-		free(new_buffer);
-	}
-
-	free(buffer);
-
-	return 0;
-}
-
-static void *ptpip_cmd_read_single_packet(vcam *cam, int *length) {
-	uint32_t packet_length = 0;
-	int size = ptpip_cmd_read(cam, &packet_length, 4);
-	if (size != 4) {
-		vcam_log("send_all: vcam failed to provide 4 bytes: %d", size);
-		return NULL;
-	}
-
-	// Yes, this allocates 4 bytes too much, can't be bothered to fix it
-	char *buffer = malloc(size + packet_length);
-	((uint32_t *)buffer)[0] = packet_length;
-	int rc = ptpip_cmd_read(cam, buffer + size, packet_length - size);
-
-	if (rc != packet_length - size) {
-		vcam_log("Read %d, wanted %d", rc, packet_length - size);
-		return NULL;
-	}
-
-	if (length != NULL) {
-		(*length) = packet_length;
-	}
+		c->kind = PTPIP_CONN_EVENT;
+		c->peer = s;
+		s->peer = c;
 
-	return buffer;
-}
-
-static int tcp_send_all(vcam *cam, int client_socket) {
-	// Wait until 'hello' packet is sent
-	if (priv(cam)->left_of_init_packet) {
-		int size = send(client_socket, priv(cam)->socket_init_resp, priv(cam)->left_of_init_packet, 0);
-		if (size <= 0) {
-			perror("Error sending data to client");
-			return -1;
-		}
-
-		priv(cam)->left_of_init_packet -= size;
+		uint32_t ack[2] = {
+			8, // size
+			PTPIP_INIT_EVENT_ACK
+		};
+		ptpip_conn_send(c, ack, sizeof(ack));
 		return 0;
 	}
 
-	int packet_length = 0;
-	void *buffer = ptpip_cmd_read_single_packet(cam, &packet_length);
-	if (buffer == NULL) {
-		return -1;
-	}
-
-	void *new_buffer = conv_usb_packet_to_ip(buffer, packet_length, &packet_length);
-
-	// Send our response to the initiator
-	int size = send(client_socket, new_buffer, packet_length, 0);
-	if (size <= 0) {
-		perror("Error sending data to client");
-		return -1;
-	}
-
-	free(new_buffer);
-
-	// As per spec, data phase must have a 12 byte packet following
-	struct PtpBulkContainer *c = (struct PtpBulkContainer *)buffer;
-	if (c->type == PTP_PACKET_TYPE_DATA && c->code != 0x0) {
-
-		// TODO: If vcam returns data phase, then command -> data start -> data end packet must follow
-		// TODO: Create these artifically
+	vcam_log("Expected an init packet, got type 0x%X", h->type);
+	return -1;
+}
 
-		free(buffer);
-		buffer = ptpip_cmd_read_single_packet(cam, &packet_length);
-		if (buffer == NULL) {
-			return -1;
+static int ptpip_header(struct PtpIpConn *c, const struct PtpBulkContainer *usb, uint8_t hdr[64]) {
+	uint32_t payload = usb->length - 12;
+	switch (usb->type) {
+	case PTP_PACKET_TYPE_DATA: {
+		// As per spec, a data phase is a start packet with the size, then the payload in data packets, see ptpip_chunk
+		struct PtpIpStartDataPacket sd;
+		sd.length = sizeof(struct PtpIpStartDataPacket);
+		sd.type = PTPIP_DATA_PACKET_START;
+		sd.transaction = usb->transaction;
+		sd.payload_length = payload;
+		memcpy(hdr, &sd, sizeof(sd));
+		return (int)sizeof(sd);
 		}
-
-		new_buffer = conv_usb_packet_to_ip(buffer, packet_length, &packet_length);
-
-		// And finally send our response to the initiator
-		size = send(client_socket, new_buffer, packet_length, 0);
-		if (size <= 0) {
-			perror("Error sending data to client");
-			return -1;
+	case PTP_PACKET_TYPE_RESPONSE: {
+		// Response params are the payload of the USB container, they follow the header as is
+		struct PtpIpResponseContainer resp;
+		resp.length = 14 + payload;
+		resp.type = PTPIP_COMMAND_RESPONSE;
+		resp.code = usb->code;
+		resp.transaction = usb->transaction;
+		memcpy(hdr, &resp, 14);
+		return 14;
 		}
-
-		free(new_buffer);
 	}
+	return -1;
+}
 
-	free(buffer);
+// Data packets carry the payload like cameras send it: in pieces, so the initiator can write it out as it arrives
+static int ptpip_chunk(struct PtpIpConn *c, const struct PtpBulkContainer *usb, uint32_t length, int last, uint8_t hdr[64]) {
+	// Data and end data packets share the layout
+	struct PtpIpEndDataPacket ed;
+	ed.length = sizeof(struct PtpIpEndDataPacket) + length;
+	ed.type = last ? PTPIP_DATA_PACKET_END : PTPIP_DATA_PACKET;
+	ed.transaction = usb->transaction;
+	memcpy(hdr, &ed, sizeof(ed));
+	return (int)sizeof(ed);
+}
 
-	return 0;
+static int ptpip_event(struct PtpIpConn *c, const struct PtpEventContainer *ev, uint8_t packet[64]) {
+	int nparams = ((int)ev->length - 12) / 4;
+	if (nparams < 0) nparams = 0;
+	if (nparams > 3) nparams = 3;
+
+	struct PtpIpResponseContainer p;
+	p.length = 14 + (uint32_t)nparams * 4;
+	p.type = PTPIP_EVENT;
+	p.code = ev->code;
+	p.transaction = ev->transaction;
+	memcpy(p.params, ev->params, (size_t)nparams * 4);
+	memcpy(packet, &p, p.length);
+	return (int)p.length;
 }
 
-static int new_ptp_tcp_socket(int port) {
+static const struct PtpIpProtocol ptpip_protocol = {
+	.min_packet = 8,
+	.packet = ptpip_packet,
+	.header = ptpip_header,
+	.chunk = ptpip_chunk,
+	.event = ptpip_event,
+};
+
+// Listen on ip, or on any address if it's NULL
+static int new_ptp_tcp_socket(const char *ip, int port) {
 	int server_socket = socket(AF_INET, SOCK_STREAM, 0);
 
 	if (server_socket == -1) {
@@ -290,6 +219,11 @@ static int new_ptp_tcp_socket(int port) {
 	serverAddress.sin_family = AF_INET;
 	serverAddress.sin_addr.s_addr = INADDR_ANY;
 	serverAddress.sin_port = htons(port);
+	if (ip != NULL && inet_pton(AF_INET, ip, &serverAddress.sin_addr) != 1) {
+		vcam_log("Invalid IP address '%s'", ip);
+		close(server_socket);
+		return -1;
+	}
 
 	if (bind(server_socket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == -1) {
 		perror("Binding failed");
@@ -297,135 +231,52 @@ static int new_ptp_tcp_socket(int port) {
 		return -1;
 	}
 
-	if (listen(server_socket, 5) == -1) {
+	if (listen(server_socket, SOMAXCONN) == -1) {
 		perror("Listening failed");
 		close(server_socket);
 		return -1;
 	}
 
-	vcam_log("Socket listening on port %d...", port);
+	vcam_log("Socket listening on %s port %d...", ip ? ip : "any address", port);
 
 	return server_socket;
 }
 
-static int ack_event_socket(int client_event_socket) {
-	struct PtpIpHeader init;
-	ssize_t size = recv(client_event_socket, &init, 12, 0);
-	if (size != 12) {
-		vcam_log("Failed to read socket init: %d", size);
-		return -1;
-	}
-
-	vcam_log("Received event socket req");
-
-	uint32_t ack[2] = {
-		8, // size
-		PTPIP_INIT_EVENT_ACK
-	};
-
-	size = send(client_event_socket, ack, sizeof(ack), 0);	
-	if (size != sizeof(ack)) {
-		vcam_log("Failed to send socket ack");
-		return -1;
+int ptpip_generic_multi(vcam **cams, int n) {
+	struct PtpIpReactor r;
+	int max_sessions = 0;
+	for (int i = 0; i < n; i++)
+		max_sessions += cams[i]->max_sessions > 1 ? cams[i]->max_sessions : 1;
+	// Engine flags are process wide, the first camera's are used
+	ptpip_reactor_init(&r, &ptpip_protocol, cams[0], max_sessions);
+	r.use_io_uring = cams[0]->io_uring;
+	r.data_chunk = cams[0]->data_chunk ? cams[0]->data_chunk : PTPIP_DATA_CHUNK;
+
+	// Command and event sockets share the port, the reactor tells them apart by their init packet
+	int rc = 0;
+	for (int i = 0; rc == 0 && i < n; i++) {
+		printf("vcam - running %s\n", cams[i]->model);
+		int server_socket = new_ptp_tcp_socket(cams[i]->custom_ip_addr, PTP_IP_PORT);
+		if (server_socket == -1) {
+			rc = -1;
+			break;
+		}
+		rc = ptpip_reactor_listen_cam(&r, server_socket, PTPIP_CONN_ANY, cams[i]);
 	}
 
-	vcam_log("Send event socket ack");
-
-	return 0;
-}
-
-static void *bind_event_socket_thread(void *arg) {
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
-	int server_socket = *((int *)arg);
-	vcam_log("Waiting for event socket on new thread...");
-	int client_event_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_length);
-	if (ack_event_socket(client_event_socket)) {
-		return NULL;
+	if (rc == 0 && cams[0]->sig) {
+		vcam_log("Sending signal to parent %d", cams[0]->sig);
+		kill(cams[0]->sig, SIGUSR1);
 	}
 
-	vcam_log("Event socket accepted from %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+	if (rc == 0)
+		rc = ptpip_reactor_run(&r);
 
-	// Canon devices don't seem to send any events
-	while (1) {
-		vcam_log("Event thread sleeping");
-		usleep(1000 * 1000);
-	}
-
-	return NULL;
+	ptpip_reactor_free(&r);
+	vcam_log("Connection closed");
+	return rc;
 }
 
 int ptpip_generic_main(vcam *cam) {
-	cam->hw_priv = malloc(sizeof(struct Priv));
-	priv(cam)->first_write = 1;
-
-	// TODO: Don't hardcode
-	uint8_t socket_init_resp[] = {
-		0x2e, 0x0, 0x0, 0x0,
-		0x2, 0x0, 0x0, 0x0,
-		0x1, 0x0, 0x0, 0x0,
-		0x0, 0x0, 0x0, 0x0,
-		0x0, 0x0, 0x0, 0x0,
-		0x0, 0x1, 0x0, 0xbb,
-		0xc1, 0x85, 0x9f, 0xab,
-		0x45, 0x0, 0x4f, 0x0, 0x53, 0x0, 0x54, 0x0, 0x36, 0x0, 0x7b, 0x0, 0x0, 0x0,
-		0x0, 0x0,
-		0x1, 0x0,};
-	priv(cam)->socket_init_resp = malloc(sizeof(socket_init_resp));
-	memcpy(priv(cam)->socket_init_resp, socket_init_resp, sizeof(socket_init_resp));
-	priv(cam)->left_of_init_packet = sizeof(socket_init_resp);
-
-	printf("vcam - running %s\n", cam->model);
-
-	int server_socket = new_ptp_tcp_socket(PTP_IP_PORT);
-
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
-	int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_length);
-
-	if (client_socket == -1) {
-		perror("Accept failed");
-		close(server_socket);
-		return -1;
-	}
-
-	vcam_log("Connection accepted from %s:%d", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-
-	int have_setup_events_socket = 0;
-	pthread_t thread;
-	while (1) {
-		if (tcp_receive_all(cam, client_socket)) {
-			vcam_log("tcp_receive_all failed");
-			goto err;
-		}
-
-		// Now the app has sent the data, and is waiting for a response.
-
-		// Read packet length
-		if (tcp_send_all(cam, client_socket)) {
-			vcam_log("tcp_send_all failed");
-			goto err;
-		}
-
-		// Once the first packets are sent, start by opening the event socket and listening on another thread
-		if (!have_setup_events_socket) {
-			if (pthread_create(&thread, NULL, bind_event_socket_thread, &server_socket)) {
-				return 1;
-			}
-
-			have_setup_events_socket = 1;
-		}
-	}
-
-	close(client_socket);
-	vcam_log("Connection closed");
-	close(server_socket);
-
-	return 0;
-
-err:;
-	vcam_log("Connection forced down");
-	close(client_socket);
-	close(server_socket);
-	return -1;
+	return ptpip_generic_multi(&cam, 1);
 }
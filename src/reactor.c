@@ -0,0 +1,732 @@
+// Edge triggered epoll loop for the PTP/IP style TCP backends
+// One thread owns every listen, command and event socket. Each connection keeps its own
+// framing state, so a slow or partial packet on one socket never blocks the others.
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include <vcam.h>
+#include "reactor.h"
+
+// Receive buffers grow in steps of this, and are dropped when idle above it
+#define READ_STEP (64 * 1024)
+#define IN_KEEP_CAPACITY (1024 * 1024)
+
+#define MAX_EVENTS 64
+// Spans gathered into one sendmsg
+#define FLUSH_IOV 32
+
+// 16 linear buckets per power of two, so percentiles are within ~6%
+static int latency_bucket(uint64_t us) {
+	if (us < 16) return (int)us;
+	int msb = 63 - __builtin_clzll(us);
+	int bucket = (msb - 3) * 16 + (int)((us >> (msb - 4)) & 15);
+	if (bucket >= PTPIP_LATENCY_BUCKETS) bucket = PTPIP_LATENCY_BUCKETS - 1;
+	return bucket;
+}
+
+// Largest latency that falls in a bucket
+static uint64_t latency_bucket_max(int bucket) {
+	if (bucket < 16) return (uint64_t)bucket;
+	int shift = bucket / 16 - 1;
+	return ((uint64_t)(16 + bucket % 16 + 1) << shift) - 1;
+}
+
+static uint64_t latency_percentile(const uint32_t *latency, unsigned long count, int percent) {
+	if (count == 0) return 0;
+	unsigned long want = (count * (unsigned long)percent + 99) / 100;
+	unsigned long seen = 0;
+	for (int i = 0; i < PTPIP_LATENCY_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen >= want) return latency_bucket_max(i);
+	}
+	return latency_bucket_max(PTPIP_LATENCY_BUCKETS - 1);
+}
+
+// Log sessions served, command latency and event lateness, done whenever a session closes
+static void report(struct PtpIpReactor *r) {
+	vcam_log("PTP/IP: %lu sessions served, %d open, %lu commands, p50 %lu us, p99 %lu us, %.2f syscalls per command",
+		r->served, r->open_sessions, r->commands,
+		(unsigned long)latency_percentile(r->latency, r->commands, 50),
+		(unsigned long)latency_percentile(r->latency, r->commands, 99),
+		r->commands ? (double)r->syscalls / (double)r->commands : 0.0);
+	if (r->events) {
+		vcam_log("PTP/IP: %lu events, sent p50 %lu us, p99 %lu us after their trigger time", r->events,
+			(unsigned long)latency_percentile(r->event_latency, r->events, 50),
+			(unsigned long)latency_percentile(r->event_latency, r->events, 99));
+	}
+}
+
+void ptpip_reactor_init(struct PtpIpReactor *r, const struct PtpIpProtocol *proto, vcam *cam, int max_sessions) {
+	memset(r, 0, sizeof(struct PtpIpReactor));
+	r->proto = proto;
+	r->cam = cam;
+	r->max_sessions = max_sessions;
+	r->timer_fd = -1;
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd == -1) {
+		perror("epoll_create1");
+		abort();
+	}
+}
+
+static int conn_watch(struct PtpIpReactor *r, struct PtpIpConn *c, uint32_t events) {
+	struct epoll_event ev = {0};
+	ev.events = events;
+	ev.data.ptr = c;
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+int ptpip_reactor_listen_cam(struct PtpIpReactor *r, int fd, enum PtpIpConnKind kind, vcam *cam) {
+	if (set_nonblocking_io(fd, 1) == -1) return -1;
+
+	struct PtpIpConn *l = calloc(1, sizeof(struct PtpIpConn));
+	if (l == NULL) abort();
+	l->fd = fd;
+	l->kind = PTPIP_CONN_LISTEN;
+	l->accept_kind = kind;
+	l->cam = cam;
+
+	r->listeners = realloc(r->listeners, sizeof(struct PtpIpConn *) * (r->listeners_length + 1));
+	if (r->listeners == NULL) abort();
+	r->listeners[r->listeners_length++] = l;
+
+	return conn_watch(r, l, EPOLLIN | EPOLLET);
+}
+
+int ptpip_reactor_listen(struct PtpIpReactor *r, int fd, enum PtpIpConnKind kind) {
+	return ptpip_reactor_listen_cam(r, fd, kind, r->cam);
+}
+
+struct PtpIpConn *ptpip_get_session(struct PtpIpReactor *r, uint32_t id) {
+	if (id == 0 || id > (uint32_t)r->sessions_capacity) return NULL;
+	return r->sessions[id - 1];
+}
+
+int ptpip_open_session(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	int max = r->max_sessions > 1 ? r->max_sessions : 1;
+	if (r->open_sessions >= max) {
+		vcam_log("Refusing initiator, %d sessions are open already", r->open_sessions);
+		return -1;
+	}
+	struct PtpIpConn *l = c->listener;
+	int cam_max = l->cam->max_sessions > 1 ? l->cam->max_sessions : 1;
+	if (l->open_sessions >= cam_max) {
+		vcam_log("Refusing initiator, %d sessions are open on %s already", l->open_sessions, l->cam->model);
+		return -1;
+	}
+
+	int slot = 0;
+	while (slot < r->sessions_capacity && r->sessions[slot] != NULL) slot++;
+	if (slot == r->sessions_capacity) {
+		int capacity = r->sessions_capacity ? r->sessions_capacity * 2 : 8;
+		r->sessions = realloc(r->sessions, sizeof(struct PtpIpConn *) * capacity);
+		if (r->sessions == NULL) abort();
+		memset(r->sessions + r->sessions_capacity, 0, sizeof(struct PtpIpConn *) * (capacity - r->sessions_capacity));
+		r->sessions_capacity = capacity;
+	}
+
+	if (!l->cam_taken) {
+		c->cam = l->cam;
+		c->owns_cam = 0;
+		l->cam_taken = 1;
+	} else {
+		c->cam = vcam_new_session(l->cam);
+		if (c->cam == NULL) return -1;
+		c->owns_cam = 1;
+	}
+
+	// Files dropped on the card are announced to an idle initiator too, not just once it sends a command
+	int fd = vcam_fs_watch_fd(c->cam);
+	if (fd >= 0 && r->watch != NULL) {
+		struct PtpIpConn *w = calloc(1, sizeof(struct PtpIpConn));
+		if (w == NULL) abort();
+		w->fd = fd;
+		w->kind = PTPIP_CONN_WATCH;
+		w->cam = c->cam;
+		if (r->watch(r, w)) {
+			free(w);
+		} else {
+			c->watch = w;
+		}
+	}
+
+	c->kind = PTPIP_CONN_COMMAND;
+	c->id = (uint32_t)slot + 1;
+	r->sessions[slot] = c;
+	r->open_sessions++;
+	l->open_sessions++;
+	r->served++;
+	return 0;
+}
+
+void ptpip_conn_send(struct PtpIpConn *c, const void *data, size_t length) {
+	if (c->out_length + length > c->out_capacity) {
+		size_t capacity = c->out_capacity ? c->out_capacity : 256;
+		while (capacity < c->out_length + length) capacity *= 2;
+		c->out = realloc(c->out, capacity);
+		if (c->out == NULL) abort();
+		c->out_capacity = capacity;
+	}
+	memcpy(c->out + c->out_length, data, length);
+	c->out_length += length;
+}
+
+void ptpip_conn_command(struct PtpIpConn *c) {
+	c->cmd_start = now_us();
+}
+
+void ptpip_conn_close(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	if (c->kind == PTPIP_CONN_CLOSED) return;
+
+	if (c->kind == PTPIP_CONN_WATCH) {
+		// The descriptor is the camera's
+		if (r->unwatch != NULL) r->unwatch(r, c);
+	} else {
+		// Wakes up anything io_uring still has pending on the socket
+		shutdown(c->fd, SHUT_RDWR);
+		close(c->fd);
+	}
+
+	// Stopped before the camera closes its descriptor
+	if (c->watch != NULL) {
+		ptpip_conn_close(r, c->watch);
+		c->watch = NULL;
+	}
+
+	struct PtpIpConn *peer = c->peer;
+	if (peer != NULL) {
+		c->peer = NULL;
+		peer->peer = NULL;
+		// The session ends with its command connection
+		if (c->kind == PTPIP_CONN_COMMAND)
+			ptpip_conn_close(r, peer);
+	}
+
+	if (c->id) {
+		vcam_log("Session %u closed", c->id);
+		r->sessions[c->id - 1] = NULL;
+		r->open_sessions--;
+		c->listener->open_sessions--;
+		if (r->max_sessions <= 1) r->done = 1;
+		report(r);
+	}
+
+	if (c->owns_cam) {
+		vcam_close(c->cam);
+		free(c->cam->priv);
+		free(c->cam);
+	}
+	c->cam = NULL;
+
+	c->kind = PTPIP_CONN_CLOSED;
+	c->next_closed = r->closed;
+	r->closed = c;
+}
+
+void ptpip_free_closed(struct PtpIpReactor *r) {
+	struct PtpIpConn **link = &r->closed;
+	while (*link != NULL) {
+		struct PtpIpConn *c = *link;
+		if (c->pending_ops) {
+			link = &c->next_closed;
+			continue;
+		}
+		*link = c->next_closed;
+		if (r->release != NULL) r->release(r, c);
+		free(c->in);
+		free(c->out);
+		free(c);
+	}
+}
+
+int ptpip_send_start(struct PtpIpReactor *r, struct PtpIpConn *c, struct PtpIpSend *s, const struct PtpBulkContainer *usb) {
+	int length = r->proto->header(c, usb, s->hdr);
+	if (length < 0) return -1;
+
+	memcpy(&s->usb, usb, 12);
+	s->hdr_length = length;
+	s->hdr_sent = 0;
+	s->payload_left = usb->length > 12 ? usb->length - 12 : 0;
+	s->end_pending = r->proto->chunk != NULL && usb->type == PTP_PACKET_TYPE_DATA;
+	s->chunk_left = s->end_pending ? 0 : s->payload_left;
+	return 0;
+}
+
+int ptpip_send_done(struct PtpIpReactor *r, struct PtpIpConn *c, struct PtpIpSend *s) {
+	if (s->hdr_sent < s->hdr_length || s->chunk_left) return 0;
+	if (!s->end_pending) return 1;
+
+	// An empty data phase still ends with an empty end packet
+	uint32_t length = s->payload_left;
+	if (r->data_chunk && length > r->data_chunk) length = r->data_chunk;
+	int last = length == s->payload_left;
+	s->hdr_length = r->proto->chunk(c, &s->usb, length, last, s->hdr);
+	s->hdr_sent = 0;
+	s->chunk_left = length;
+	if (last) s->end_pending = 0;
+	return 0;
+}
+
+// Set up the wire header of the next container queued in the camera
+// Returns nonzero if nothing is queued
+static int next_container(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	while (1) {
+		if (c->cam == NULL || vcam_read_pending(c->cam) < 12) return 1;
+
+		struct PtpBulkContainer usb;
+		vcam_peek(c->cam, (unsigned char *)&usb, 12);
+		vcam_read_consume(c->cam, 12);
+
+		if (ptpip_send_start(r, c, &c->send, &usb)) {
+			vcam_log("Dropping container type %d code 0x%X", usb.type, usb.code);
+			vcam_read_consume(c->cam, usb.length > 12 ? (int)usb.length - 12 : 0);
+			continue;
+		}
+		return 0;
+	}
+}
+
+static void record_latency(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	if (c->cmd_start == 0) return;
+	r->latency[latency_bucket(now_us() - c->cmd_start)]++;
+	r->commands++;
+	c->cmd_start = 0;
+}
+
+int ptpip_conn_next(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	if (c->out_sent < c->out_length) return 0;
+	c->out_sent = 0;
+	c->out_length = 0;
+
+	if (!ptpip_send_done(r, c, &c->send)) return 0;
+	if (c->send.usb.type == PTP_PACKET_TYPE_RESPONSE)
+		record_latency(r, c);
+	return next_container(r, c);
+}
+
+void ptpip_conn_advance(struct PtpIpReactor *r, struct PtpIpConn *c, size_t size) {
+	while (size) {
+		if (ptpip_conn_next(r, c)) {
+			vcam_log("%zu bytes sent past the end of the queue", size);
+			return;
+		}
+
+		if (c->out_sent < c->out_length) {
+			size_t n = c->out_length - c->out_sent;
+			if (n > size) n = size;
+			c->out_sent += n;
+			size -= n;
+			continue;
+		}
+
+		struct PtpIpSend *s = &c->send;
+		size_t h = (size_t)(s->hdr_length - s->hdr_sent);
+		if (h > size) h = size;
+		s->hdr_sent += (int)h;
+		size -= h;
+
+		size_t p = s->chunk_left;
+		if (p > size) p = size;
+		if (p) {
+			vcam_read_consume(c->cam, (int)p);
+			s->payload_left -= (uint32_t)p;
+			s->chunk_left -= (uint32_t)p;
+			size -= p;
+		}
+	}
+}
+
+void ptpip_window_init(struct PtpIpWindow *w, vcam *cam) {
+	w->length = cam == NULL ? 0 : vcam_read_iov(cam, w->iov, 16, vcam_read_pending(cam));
+	w->i = 0;
+	w->off = 0;
+}
+
+size_t ptpip_window_take(struct PtpIpWindow *w, size_t n, const uint8_t **data) {
+	while (w->i < w->length && w->off == w->iov[w->i].iov_len) {
+		w->i++;
+		w->off = 0;
+	}
+	if (w->i == w->length) return 0;
+	size_t left = w->iov[w->i].iov_len - w->off;
+	if (n > left) n = left;
+	*data = (const uint8_t *)w->iov[w->i].iov_base + w->off;
+	w->off += n;
+	return n;
+}
+
+int ptpip_window_header(struct PtpIpWindow *w, struct PtpBulkContainer *usb) {
+	size_t got = 0;
+	while (got < 12) {
+		const uint8_t *data;
+		size_t span = ptpip_window_take(w, 12 - got, &data);
+		if (span == 0) return -1;
+		memcpy((uint8_t *)usb + got, data, span);
+		got += span;
+	}
+	return 0;
+}
+
+// Describe as much of what is queued on c as fits in iov, in the order ptpip_conn_advance accounts for it
+// Headers of the packets after the current one are built in hdrs
+static int gather(struct PtpIpReactor *r, struct PtpIpConn *c, struct iovec *iov, int max, uint8_t (*hdrs)[64], int max_hdrs) {
+	int n = 0;
+	if (c->out_sent < c->out_length) {
+		iov[n].iov_base = c->out + c->out_sent;
+		iov[n].iov_len = c->out_length - c->out_sent;
+		n++;
+	}
+	if (c->cam == NULL) return n;
+
+	struct PtpIpWindow w;
+	ptpip_window_init(&w, c->cam);
+	struct PtpIpSend s = c->send;
+	int h = 0;
+	while (n < max) {
+		if (ptpip_send_done(r, c, &s)) {
+			struct PtpBulkContainer usb;
+			if (ptpip_window_header(&w, &usb) || ptpip_send_start(r, c, &s, &usb)) break;
+			continue;
+		}
+
+		if (s.hdr_sent < s.hdr_length) {
+			if (h == max_hdrs) break;
+			memcpy(hdrs[h], s.hdr + s.hdr_sent, (size_t)(s.hdr_length - s.hdr_sent));
+			iov[n].iov_base = hdrs[h];
+			iov[n].iov_len = (size_t)(s.hdr_length - s.hdr_sent);
+			n++;
+			h++;
+			s.hdr_sent = s.hdr_length;
+		}
+
+		while (s.chunk_left && n < max) {
+			const uint8_t *data;
+			size_t span = ptpip_window_take(&w, s.chunk_left, &data);
+			if (span == 0) break;
+			iov[n].iov_base = (void *)(uintptr_t)data;
+			iov[n].iov_len = span;
+			n++;
+			s.chunk_left -= (uint32_t)span;
+			s.payload_left -= (uint32_t)span;
+		}
+		if (s.chunk_left) break;
+	}
+	return n;
+}
+
+// Send as much as the socket takes, the rest goes out on the next EPOLLOUT edge
+// Several packets, and the response after a data phase, go out in one sendmsg
+static int conn_flush(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	while (1) {
+		if (ptpip_conn_next(r, c)) return 0;
+
+		struct iovec iov[FLUSH_IOV];
+		uint8_t hdrs[FLUSH_IOV / 2][64];
+		int n = gather(r, c, iov, FLUSH_IOV, hdrs, FLUSH_IOV / 2);
+		if (n == 0) {
+			vcam_log("Camera is %u bytes short of a container", c->send.payload_left);
+			return -1;
+		}
+
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (size_t)n;
+		r->syscalls++;
+		ssize_t size = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (size < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			perror("Error sending data to client");
+			return -1;
+		}
+
+		ptpip_conn_advance(r, c, (size_t)size);
+	}
+}
+
+// Hand the interrupts that are due to the event socket
+static void deliver_events(struct PtpIpReactor *r, struct PtpIpConn *c, uint64_t now) {
+	vcam *cam = c->cam;
+	int64_t due;
+	while ((due = vcam_next_event_due(cam)) >= 0 && (uint64_t)due <= now) {
+		struct PtpEventContainer ev = {0};
+		if (vcam_readint(cam, (unsigned char *)&ev, sizeof(ev), 0) <= 0) break;
+		uint8_t packet[64];
+		int length = r->proto->event(c, &ev, packet);
+		ptpip_conn_send(c->peer, packet, (size_t)length);
+		r->event_latency[latency_bucket(now - (uint64_t)due)]++;
+		r->events++;
+	}
+	if (c->peer->out_length && r->flush(r, c->peer))
+		ptpip_conn_close(r, c->peer);
+}
+
+void ptpip_conn_watch_ready(struct PtpIpReactor *r, struct PtpIpConn *w) {
+	(void)r;
+	if (w->kind != PTPIP_CONN_WATCH) return;
+	vcam_poll_fs(w->cam);
+}
+
+int64_t ptpip_deliver_events(struct PtpIpReactor *r) {
+	if (r->proto->event == NULL) return -1;
+
+	uint64_t now = now_us();
+	uint64_t next = UINT64_MAX;
+	for (int i = 0; i < r->sessions_capacity; i++) {
+		struct PtpIpConn *c = r->sessions[i];
+		if (c == NULL || c->peer == NULL) continue;
+		deliver_events(r, c, now);
+		if (c->peer == NULL) continue;
+		int64_t due = vcam_next_event_due(c->cam);
+		if (due >= 0 && (uint64_t)due < next) next = (uint64_t)due;
+	}
+
+	if (next == UINT64_MAX) return -1;
+	return (int64_t)(next - now);
+}
+
+int ptpip_conn_dispatch(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	size_t off = 0;
+	while (c->in_length - off >= 4) {
+		uint32_t length;
+		memcpy(&length, c->in + off, 4);
+		if (length < r->proto->min_packet) {
+			vcam_log("Invalid packet length %u", length);
+			return -1;
+		}
+		if (c->in_length - off < length) break;
+
+		if (r->proto->packet(r, c, c->in + off, length)) return -1;
+		off += length;
+	}
+
+	memmove(c->in, c->in + off, c->in_length - off);
+	c->in_length -= off;
+	if (c->in_length == 0 && c->in_capacity > IN_KEEP_CAPACITY) {
+		free(c->in);
+		c->in = NULL;
+		c->in_capacity = 0;
+	}
+
+	return 0;
+}
+
+// Read until the socket is drained and handle every whole packet
+static int conn_read(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	while (1) {
+		if (c->in_capacity - c->in_length < READ_STEP) {
+			size_t capacity = c->in_capacity ? c->in_capacity * 2 : READ_STEP;
+			c->in = realloc(c->in, capacity);
+			if (c->in == NULL) abort();
+			c->in_capacity = capacity;
+		}
+
+		r->syscalls++;
+		ssize_t size = recv(c->fd, c->in + c->in_length, c->in_capacity - c->in_length, 0);
+		if (size == 0) return -1;
+		if (size < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			perror("Error reading data from socket");
+			return -1;
+		}
+		c->in_length += (size_t)size;
+	}
+
+	return ptpip_conn_dispatch(r, c);
+}
+
+// An event socket is given to the newest session that doesn't have one yet
+static int pair_event_socket(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	for (int i = r->sessions_capacity - 1; i >= 0; i--) {
+		struct PtpIpConn *s = r->sessions[i];
+		if (s != NULL && s->peer == NULL) {
+			s->peer = c;
+			c->peer = s;
+			return 0;
+		}
+	}
+	vcam_log("Event socket without a session");
+	return -1;
+}
+
+struct PtpIpConn *ptpip_conn_accept(struct PtpIpReactor *r, struct PtpIpConn *l, int fd) {
+	// Commands and responses are small, don't let Nagle hold them back
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+	struct sockaddr_in client_address;
+	socklen_t client_address_length = sizeof(client_address);
+	if (getpeername(fd, (struct sockaddr *)&client_address, &client_address_length) == 0)
+		vcam_log("Connection accepted from %s:%d", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+
+	struct PtpIpConn *c = calloc(1, sizeof(struct PtpIpConn));
+	if (c == NULL) abort();
+	c->fd = fd;
+	c->kind = l->accept_kind;
+	c->listener = l;
+
+	if (c->kind == PTPIP_CONN_EVENT && pair_event_socket(r, c)) {
+		ptpip_conn_close(r, c);
+		return NULL;
+	}
+	return c;
+}
+
+static void accept_all(struct PtpIpReactor *r, struct PtpIpConn *l) {
+	while (1) {
+		r->syscalls++;
+		int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Accept failed");
+			return;
+		}
+
+		struct PtpIpConn *c = ptpip_conn_accept(r, l, fd);
+		if (c != NULL && conn_watch(r, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+			ptpip_conn_close(r, c);
+	}
+}
+
+static void conn_event(struct PtpIpReactor *r, struct PtpIpConn *c, uint32_t events) {
+	if (events & EPOLLOUT) {
+		if (conn_flush(r, c)) {
+			ptpip_conn_close(r, c);
+			return;
+		}
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		if (conn_read(r, c) || conn_flush(r, c)) {
+			ptpip_conn_close(r, c);
+			return;
+		}
+	}
+}
+
+static int epoll_watch(struct PtpIpReactor *r, struct PtpIpConn *w) {
+	return conn_watch(r, w, EPOLLIN | EPOLLET);
+}
+
+static void epoll_unwatch(struct PtpIpReactor *r, struct PtpIpConn *w) {
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+// Arm the timer for the next due event, timeout_us from now
+// epoll_wait timeouts are in milliseconds and the kernel lets them run late by 0.1%, a timerfd fires within the
+// task's timer slack. It's only rearmed when the next event comes earlier or the armed time has passed.
+static int arm_timer(struct PtpIpReactor *r, int64_t timeout_us) {
+	if (timeout_us < 0) return 0;
+	uint64_t now = now_us();
+	uint64_t due = now + (uint64_t)timeout_us;
+	if (r->timer_due > now && r->timer_due <= due + 10) return 0;
+
+	struct itimerspec its = {0};
+	its.it_value.tv_sec = (time_t)(due / 1000000);
+	its.it_value.tv_nsec = (long)(due % 1000000) * 1000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+	r->syscalls++;
+	if (timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	r->timer_due = due;
+	return 0;
+}
+
+int ptpip_reactor_run(struct PtpIpReactor *r) {
+	if (r->use_io_uring) {
+		int rc = ptpip_uring_run(r);
+		if (rc != PTPIP_URING_UNAVAILABLE) return rc;
+		vcam_log("io_uring isn't available, falling back to epoll");
+	}
+
+	r->flush = conn_flush;
+	r->release = NULL;
+	r->watch = epoll_watch;
+	r->unwatch = epoll_unwatch;
+
+	if (r->timer_fd == -1) {
+		r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (r->timer_fd == -1 || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->timer_fd, &ev) == -1) {
+			perror("timerfd");
+			return -1;
+		}
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	while (!r->done) {
+		r->syscalls++;
+		int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct PtpIpConn *c = (struct PtpIpConn *)events[i].data.ptr;
+			if (c == NULL) {
+				// Timer fired, due events are handed out below
+				uint64_t expirations;
+				r->syscalls++;
+				if (read(r->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("timerfd");
+				r->timer_due = 0;
+				continue;
+			}
+			if (c->kind == PTPIP_CONN_CLOSED) continue;
+			if (c->kind == PTPIP_CONN_LISTEN) {
+				accept_all(r, c);
+			} else if (c->kind == PTPIP_CONN_WATCH) {
+				ptpip_conn_watch_ready(r, c);
+			} else {
+				conn_event(r, c, events[i].events);
+			}
+		}
+
+		if (arm_timer(r, ptpip_deliver_events(r))) return -1;
+		ptpip_free_closed(r);
+	}
+
+	return 0;
+}
+
+void ptpip_reactor_free(struct PtpIpReactor *r) {
+	for (int i = 0; i < r->sessions_capacity; i++) {
+		if (r->sessions[i] != NULL)
+			ptpip_conn_close(r, r->sessions[i]);
+	}
+	for (int i = 0; i < r->listeners_length; i++) {
+		close(r->listeners[i]->fd);
+		free(r->listeners[i]);
+	}
+	// Whatever is still in flight is torn down with the ring
+	for (struct PtpIpConn *c = r->closed; c != NULL; c = c->next_closed)
+		c->pending_ops = 0;
+	ptpip_free_closed(r);
+	free(r->sessions);
+	free(r->listeners);
+	if (r->timer_fd != -1) close(r->timer_fd);
+	close(r->epoll_fd);
+}
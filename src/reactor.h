@@ -0,0 +1,229 @@
+#ifndef VCAM_REACTOR_H
+#define VCAM_REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vcam.h>
+
+/// @brief What sockets accepted from a listener are used for
+enum PtpIpConnKind {
+	/// @brief Not known until the first packet (standard PTP/IP takes both on one port)
+	PTPIP_CONN_ANY,
+	PTPIP_CONN_COMMAND,
+	PTPIP_CONN_EVENT,
+	PTPIP_CONN_LISTEN,
+	/// @brief Card watch descriptor of a session's camera (vcam_fs_watch_fd), owned by the camera and not closed here
+	PTPIP_CONN_WATCH,
+	/// @brief Closed, freed once the current batch of events is handled and no I/O on it is in flight
+	PTPIP_CONN_CLOSED,
+};
+
+/// @brief Where sending a container queued in the camera is at
+struct PtpIpSend {
+	/// @brief Header of the container as the camera queued it
+	struct PtpBulkContainer usb;
+	/// @brief Wire header being sent, payload follows straight out of the camera
+	uint8_t hdr[64];
+	int hdr_length;
+	int hdr_sent;
+	/// @brief Payload of the container not sent yet
+	uint32_t payload_left;
+	/// @brief Payload that goes after the current header, less than payload_left if the data phase is split into packets
+	uint32_t chunk_left;
+	/// @brief Split data phase whose last packet header hasn't been built yet
+	int end_pending;
+};
+
+/// @brief State of one socket owned by the reactor
+struct PtpIpConn {
+	int fd;
+	enum PtpIpConnKind kind;
+	/// @brief Kind of the sockets accepted from a listener
+	enum PtpIpConnKind accept_kind;
+	/// @brief Connection number given out in the init ack, index into the session table + 1, 0 if none
+	uint32_t id;
+	/// @brief Camera serving the session, NULL until the initiator sent its init packet
+	/// On a listener: the camera its sessions are served by, the first one gets it and later ones a vcam_new_session
+	vcam *cam;
+	int owns_cam;
+	/// @brief Listener c was accepted from
+	struct PtpIpConn *listener;
+	/// @brief Listeners: sessions open on cam, and whether one of them has been handed cam itself
+	int open_sessions;
+	int cam_taken;
+	/// @brief Event socket of a command connection and the other way round, NULL if not paired
+	struct PtpIpConn *peer;
+	/// @brief Card watch of a command connection's camera, NULL if there is none
+	struct PtpIpConn *watch;
+
+	/// @brief Received bytes that don't make up a whole packet yet
+	uint8_t *in;
+	size_t in_length;
+	size_t in_capacity;
+
+	/// @brief Packets built by the protocol (acks, events), sent before anything queued in cam
+	uint8_t *out;
+	size_t out_length;
+	size_t out_sent;
+	size_t out_capacity;
+
+	/// @brief Container from cam being sent
+	struct PtpIpSend send;
+
+	/// @brief Opcode of the last command that announced a data phase
+	uint16_t data_code;
+	/// @brief CLOCK_MONOTONIC time in microseconds the last command arrived, 0 once it was answered
+	uint64_t cmd_start;
+
+	/// @brief Per connection state of the io_uring engine, NULL with epoll
+	void *engine;
+	/// @brief Operations submitted to io_uring that haven't completed, c isn't freed until they did
+	int pending_ops;
+
+	struct PtpIpConn *next_closed;
+};
+
+struct PtpIpReactor;
+
+/// @brief Wire format of a PTP/IP flavour, framing is always a leading 32 bit length
+struct PtpIpProtocol {
+	/// @brief Packets with a shorter length field drop the connection
+	uint32_t min_packet;
+	/// @brief Handle a whole packet from the initiator, replies are queued with ptpip_conn_send or into c->cam
+	/// @returns nonzero to drop the connection
+	int (*packet)(struct PtpIpReactor *r, struct PtpIpConn *c, uint8_t *data, uint32_t length);
+	/// @brief Translate the header of a container queued in cam into the bytes sent before its payload
+	/// Must not change any state, the io_uring engine calls it ahead of time to batch sends
+	/// @returns header length, -1 to drop the container
+	int (*header)(struct PtpIpConn *c, const struct PtpBulkContainer *usb, uint8_t hdr[64]);
+	/// @brief Header of one packet of a data phase, NULL if the payload of data containers follows their header whole
+	/// The packets carry up to data_chunk bytes each, the last one is flagged. Must not change any state either.
+	/// @returns header length
+	int (*chunk)(struct PtpIpConn *c, const struct PtpBulkContainer *usb, uint32_t length, int last, uint8_t hdr[64]);
+	/// @brief Build a packet for the event socket from an interrupt, NULL if events aren't sent over it
+	/// @returns packet length
+	int (*event)(struct PtpIpConn *c, const struct PtpEventContainer *ev, uint8_t packet[64]);
+};
+
+/// @brief Buckets of the command latency histogram, 16 per power of two microseconds
+#define PTPIP_LATENCY_BUCKETS (36 * 16)
+
+/// @brief Event loop owning the listen, command and event sockets of every session
+/// Runs on edge triggered epoll, or on io_uring if use_io_uring is set and the kernel supports it
+struct PtpIpReactor {
+	int epoll_fd;
+	/// @brief timerfd the epoll engine wakes up on when the next event is due, -1 until it runs
+	int timer_fd;
+	/// @brief CLOCK_MONOTONIC time in microseconds timer_fd is armed for, 0 if it isn't
+	uint64_t timer_due;
+	/// @brief Try the io_uring engine first (--io-uring), a dead socket raises SIGPIPE unless the program ignores it
+	int use_io_uring;
+	/// @brief Max payload per data packet for protocols with a chunk callback, 0 for one packet per data phase
+	uint32_t data_chunk;
+	/// @brief Start sending whatever is queued on a connection, set by the engine that runs
+	int (*flush)(struct PtpIpReactor *r, struct PtpIpConn *c);
+	/// @brief Free the engine state of a connection once nothing is in flight on it, may be NULL
+	void (*release)(struct PtpIpReactor *r, struct PtpIpConn *c);
+	/// @brief Start and stop waiting for a card watch to become readable, ptpip_conn_watch_ready is called when it is
+	int (*watch)(struct PtpIpReactor *r, struct PtpIpConn *w);
+	void (*unwatch)(struct PtpIpReactor *r, struct PtpIpConn *w);
+	/// @brief State of the io_uring engine while it runs
+	void *engine;
+	const struct PtpIpProtocol *proto;
+	/// @brief Camera of listeners added with ptpip_reactor_listen
+	vcam *cam;
+	/// @brief Sessions served at once over all listeners, a single session ends the loop once it disconnects
+	/// Each listener also serves no more than the max_sessions of its own camera at once
+	int max_sessions;
+
+	/// @brief Command connections by id - 1, NULL for free slots
+	struct PtpIpConn **sessions;
+	int sessions_capacity;
+	int open_sessions;
+	/// @brief Listeners, kept to close them on exit
+	struct PtpIpConn **listeners;
+	int listeners_length;
+	struct PtpIpConn *closed;
+	int done;
+
+	unsigned long served;
+	unsigned long commands;
+	/// @brief System calls made by the engine, reported per command
+	unsigned long syscalls;
+	uint32_t latency[PTPIP_LATENCY_BUCKETS];
+	/// @brief Events handed to event sockets, and how long after their trigger time
+	unsigned long events;
+	uint32_t event_latency[PTPIP_LATENCY_BUCKETS];
+};
+
+void ptpip_reactor_init(struct PtpIpReactor *r, const struct PtpIpProtocol *proto, vcam *cam, int max_sessions);
+/// @brief Accept connections from a listening socket, sockets accepted from it start out as kind
+int ptpip_reactor_listen(struct PtpIpReactor *r, int fd, enum PtpIpConnKind kind);
+/// @brief Same, but sessions from this listener are served by cam instead of r->cam
+int ptpip_reactor_listen_cam(struct PtpIpReactor *r, int fd, enum PtpIpConnKind kind, vcam *cam);
+/// @brief Serve until a single session ends, or forever with max_sessions > 1
+int ptpip_reactor_run(struct PtpIpReactor *r);
+/// @brief Close every socket and free the sessions
+void ptpip_reactor_free(struct PtpIpReactor *r);
+
+/// @brief Turn c into a command connection with a camera and connection number
+/// @returns 0, -1 if too many sessions are open on the reactor or on the listener c came from
+int ptpip_open_session(struct PtpIpReactor *r, struct PtpIpConn *c);
+/// @brief Find a command connection by number
+struct PtpIpConn *ptpip_get_session(struct PtpIpReactor *r, uint32_t id);
+/// @brief Queue a packet built by the protocol, sent before anything queued in the camera
+void ptpip_conn_send(struct PtpIpConn *c, const void *data, size_t length);
+/// @brief Mark that a command has arrived on c, its latency is recorded once the response is sent
+void ptpip_conn_command(struct PtpIpConn *c);
+
+// Shared by the epoll and io_uring engines
+
+/// @brief Set up a connection accepted from listener l, fd is owned by it from now on
+/// @returns NULL if it was refused and closed
+struct PtpIpConn *ptpip_conn_accept(struct PtpIpReactor *r, struct PtpIpConn *l, int fd);
+/// @brief Close c, and its event socket if it is a command connection
+void ptpip_conn_close(struct PtpIpReactor *r, struct PtpIpConn *c);
+/// @brief Handle every whole packet in c->in
+/// @returns nonzero to drop the connection
+int ptpip_conn_dispatch(struct PtpIpReactor *r, struct PtpIpConn *c);
+/// @brief Start sending a container with the camera header usb, its header is already consumed from the camera
+/// @returns -1 if the protocol drops it
+int ptpip_send_start(struct PtpIpReactor *r, struct PtpIpConn *c, struct PtpIpSend *s, const struct PtpBulkContainer *usb);
+/// @brief Build the header of the next data packet once the current one is out
+/// @returns nonzero once the whole container is out
+int ptpip_send_done(struct PtpIpReactor *r, struct PtpIpConn *c, struct PtpIpSend *s);
+/// @brief Finish what has been fully sent and load the next container from the camera
+/// @returns nonzero if nothing is left to send
+int ptpip_conn_next(struct PtpIpReactor *r, struct PtpIpConn *c);
+/// @brief Account for size bytes that went out on the wire: out, then header and payload of each container in turn
+void ptpip_conn_advance(struct PtpIpReactor *r, struct PtpIpConn *c, size_t size);
+/// @brief Apply the card changes of a readable card watch, the events they queue go out with ptpip_deliver_events
+void ptpip_conn_watch_ready(struct PtpIpReactor *r, struct PtpIpConn *w);
+/// @brief Deliver due events of every session
+/// @returns microseconds until the next one is due, -1 if none
+int64_t ptpip_deliver_events(struct PtpIpReactor *r);
+/// @brief Free closed connections that have nothing in flight
+void ptpip_free_closed(struct PtpIpReactor *r);
+
+/// @brief Lookahead over the bytes queued in a camera, nothing is consumed
+struct PtpIpWindow {
+	struct iovec iov[16];
+	int length;
+	int i;
+	size_t off;
+};
+void ptpip_window_init(struct PtpIpWindow *w, vcam *cam);
+/// @brief Next span of the window, at most n bytes, and step past it
+/// @returns span length, 0 at the end of the window
+size_t ptpip_window_take(struct PtpIpWindow *w, size_t n, const uint8_t **data);
+/// @brief Copy the next container header out of the window
+/// @returns -1 if the window ends first
+int ptpip_window_header(struct PtpIpWindow *w, struct PtpBulkContainer *usb);
+
+/// @brief Returned by ptpip_uring_run when io_uring can't be used and nothing has been touched
+#define PTPIP_URING_UNAVAILABLE 1
+/// @brief Serve r with io_uring, see uring.c
+int ptpip_uring_run(struct PtpIpReactor *r);
+
+#endif
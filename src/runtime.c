@@ -0,0 +1,191 @@
+// Runs many virtual cameras in one process, listed in a config file
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcam.h>
+
+#define MAX_ARGS 64
+
+struct CamConfig {
+	vcam *cam;
+	enum CamBackendType backend;
+	int argc;
+	const char **argv;
+	/// @brief Line the words in argv point into, kept for the lifetime of the camera since flags like --fs point into it
+	char *line;
+};
+
+static int parse_backend(const char *str, enum CamBackendType *backend) {
+	if (!strcmp(str, "tcp")) {
+		(*backend) = VCAM_TCP;
+	} else if (!strcmp(str, "otg")) {
+		(*backend) = VCAM_GADGETFS;
+	} else if (!strcmp(str, "vhci")) {
+		(*backend) = VCAM_VHCI;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// Split a line into whitespace separated words, returns the number of words
+static int split_line(char *line, const char **argv) {
+	char *comment = strchr(line, '#');
+	if (comment != NULL) (*comment) = '\0';
+
+	int argc = 0;
+	char *save;
+	for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (argc == MAX_ARGS) {
+			vcam_log("Too many arguments on a line, max is %d", MAX_ARGS);
+			return -1;
+		}
+		argv[argc++] = tok;
+	}
+	return argc;
+}
+
+static int read_config(const char *path, struct CamConfig **configs, int *length) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		vcam_log("Can't open config '%s'", path);
+		return -1;
+	}
+
+	int capacity = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	int line_n = 0;
+	int rc = 0;
+	while (getline(&line, &line_size, f) != -1) {
+		line_n++;
+		char *copy = strdup(line);
+		if (copy == NULL) abort();
+		const char *argv[MAX_ARGS];
+		int argc = split_line(copy, argv);
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
+		if (argc < 2) {
+			free(copy);
+			vcam_log("%s:%d: expected '<model> <backend> [flags...]'", path, line_n);
+			rc = -1;
+			break;
+		}
+
+		if ((*length) == capacity) {
+			capacity = capacity ? capacity * 2 : 8;
+			(*configs) = realloc(*configs, sizeof(struct CamConfig) * capacity);
+			if ((*configs) == NULL) abort();
+		}
+		struct CamConfig *c = &(*configs)[(*length)++];
+		c->cam = NULL;
+		c->argc = argc;
+		c->line = copy;
+		// NULL terminated like the argv main gets
+		c->argv = malloc(sizeof(char *) * (argc + 1));
+		if (c->argv == NULL) abort();
+		memcpy(c->argv, argv, sizeof(char *) * argc);
+		c->argv[argc] = NULL;
+
+		if (parse_backend(c->argv[1], &c->backend)) {
+			vcam_log("%s:%d: unknown backend '%s'", path, line_n, c->argv[1]);
+			rc = -1;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return rc;
+}
+
+struct TcpCameras {
+	vcam **cams;
+	int n;
+	int rc;
+};
+
+static void *tcp_thread(void *arg) {
+	struct TcpCameras *t = (struct TcpCameras *)arg;
+	t->rc = ptpip_generic_multi(t->cams, t->n);
+	return NULL;
+}
+
+int vcam_run_config(const char *path) {
+	struct CamConfig *configs = NULL;
+	int length = 0;
+	int rc = read_config(path, &configs, &length);
+
+	vcam **usb_cams = malloc(sizeof(vcam *) * (length ? length : 1));
+	vcam **tcp_cams = malloc(sizeof(vcam *) * (length ? length : 1));
+	if (usb_cams == NULL || tcp_cams == NULL) abort();
+	int n_usb = 0;
+	int n_tcp = 0;
+
+	for (int i = 0; rc == 0 && i < length; i++) {
+		struct CamConfig *c = &configs[i];
+		if (c->backend != VCAM_VHCI && c->backend != VCAM_TCP) {
+			vcam_log("%s: camera %d: only vhci and tcp cameras can share a process", path, i + 1);
+			rc = -1;
+			break;
+		}
+
+		c->cam = vcam_init_standard();
+		if (vcam_init_model(c->cam, c->argv[0], c->argc - 2, c->argv + 2)) {
+			rc = -1;
+			break;
+		}
+		if (c->backend == VCAM_VHCI) {
+			usb_cams[n_usb++] = c->cam;
+			continue;
+		}
+
+		// Fuji WiFi has its own ports, discovery and liveview threads, all of them process wide
+		if (c->cam->vendor_id == USB_VENDOR_FUJI) {
+			vcam_log("%s: camera %d: Fuji WiFi cameras have to run in a process of their own", path, i + 1);
+			rc = -1;
+			break;
+		}
+		tcp_cams[n_tcp++] = c->cam;
+	}
+
+	if (rc == 0 && n_usb + n_tcp == 0) {
+		vcam_log("%s: no cameras", path);
+		rc = -1;
+	}
+
+	if (rc == 0) {
+		vcam_log("Starting %d vhci and %d tcp cameras", n_usb, n_tcp);
+		struct TcpCameras tcp = {tcp_cams, n_tcp, 0};
+		if (n_usb == 0) {
+			rc = ptpip_generic_multi(tcp_cams, n_tcp);
+		} else if (n_tcp == 0) {
+			rc = vcam_start_usbthing_multi(usb_cams, n_usb, VCAM_VHCI);
+		} else {
+			// The vhci loop and the reactor each block, give the reactor a thread. They share no camera.
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, tcp_thread, &tcp)) {
+				vcam_log("Failed to start the tcp thread");
+				rc = -1;
+			} else {
+				rc = vcam_start_usbthing_multi(usb_cams, n_usb, VCAM_VHCI);
+				pthread_join(thread, NULL);
+				if (rc == 0) rc = tcp.rc;
+			}
+		}
+	}
+
+	for (int i = 0; i < length; i++) {
+		if (configs[i].cam != NULL)
+			vcam_close(configs[i].cam);
+		free(configs[i].argv);
+		free(configs[i].line);
+	}
+	free(configs);
+	free(usb_cams);
+	free(tcp_cams);
+	return rc;
+}
@@ -0,0 +1,517 @@
+// Synthetic liveview frames: a baseline JPEG encoder and a generator drawing the frame number and time into each frame
+// Soak tests can't hide dropped or repeated frames behind a static JPEG this way.
+// Most of a frame is flat 16x16 tiles, those are encoded as DC only without a DCT. The DCT of the other blocks
+// (the text) uses GCC vector extensions, so it's SIMD on x86 and ARM alike.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcam.h>
+#include "synth.h"
+
+typedef float v8f __attribute__((vector_size(32)));
+typedef int32_t v8i __attribute__((vector_size(32)));
+
+// Largest an MCU can get: 6 blocks of 64 coefficients at 16 + 11 bits, every byte stuffed
+#define MCU_WORST (6 * 64 * 27 / 8 * 2)
+
+static const uint8_t zigzag[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const uint8_t std_quant[2][64] = {{
+	16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+}, {
+	17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+}};
+
+static const uint8_t dc_bits[2][16] = {
+	{0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+	{0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+};
+static const uint8_t dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t ac_bits[2][16] = {
+	{0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+	{0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+};
+static const uint8_t ac_vals[2][162] = {{
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+}, {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+}};
+
+// Scale factors of the AAN DCT outputs
+static const float aan_scale[8] = {
+	1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+// Where zigzag position i is in the transposed layout fdct outputs
+static const uint8_t zigzag_src[64] = {
+	0, 8, 1, 2, 9, 16, 24, 17, 10, 3, 4, 11, 18, 25, 32, 40,
+	33, 26, 19, 12, 5, 6, 13, 20, 27, 34, 41, 48, 56, 49, 42, 35,
+	28, 21, 14, 7, 15, 22, 29, 36, 43, 50, 57, 58, 51, 44, 37, 30,
+	23, 31, 38, 45, 52, 59, 60, 53, 46, 39, 47, 54, 61, 62, 55, 63,
+};
+
+static void build_codes(const uint8_t bits[16], const uint8_t *vals, uint16_t *code, uint8_t *length) {
+	int k = 0;
+	uint16_t c = 0;
+	for (int l = 1; l <= 16; l++) {
+		for (int i = 0; i < bits[l - 1]; i++) {
+			code[vals[k]] = c;
+			length[vals[k]] = (uint8_t)l;
+			c++;
+			k++;
+		}
+		c <<= 1;
+	}
+}
+
+static void jpeg_init(struct JpegEncoder *e, int quality) {
+	memset(e, 0, sizeof(struct JpegEncoder));
+	int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+	for (int t = 0; t < 2; t++) {
+		uint8_t natural[64];
+		for (int n = 0; n < 64; n++) {
+			int q = (std_quant[t][n] * scale + 50) / 100;
+			natural[n] = (uint8_t)(q < 1 ? 1 : q > 255 ? 255 : q);
+		}
+		for (int i = 0; i < 64; i++)
+			e->qt[t][i] = natural[zigzag[i]];
+		for (int u = 0; u < 8; u++) {
+			for (int k = 0; k < 8; k++)
+				e->recip[t][u * 8 + k] = 1.0f / ((float)natural[k * 8 + u] * aan_scale[k] * aan_scale[u] * 8.0f);
+		}
+		build_codes(dc_bits[t], dc_vals, e->dc_code[t], e->dc_length[t]);
+		build_codes(ac_bits[t], ac_vals[t], e->ac_code[t], e->ac_length[t]);
+	}
+}
+
+static inline void put_bits(struct JpegEncoder *e, uint32_t code, int length) {
+	e->acc = (e->acc << length) | code;
+	e->bits += length;
+	while (e->bits >= 8) {
+		uint8_t b = (uint8_t)(e->acc >> (e->bits - 8));
+		*e->out++ = b;
+		if (b == 0xff) *e->out++ = 0;
+		e->bits -= 8;
+	}
+}
+
+static inline int bit_length(int v) {
+	if (v < 0) v = -v;
+	return v ? 32 - __builtin_clz((unsigned)v) : 0;
+}
+
+static inline void put_value(struct JpegEncoder *e, int v, int length) {
+	if (v < 0) v--;
+	put_bits(e, (uint32_t)v & ((1u << length) - 1), length);
+}
+
+static void put_dc(struct JpegEncoder *e, int comp, int t, int dc) {
+	int diff = dc - e->dc[comp];
+	e->dc[comp] = dc;
+	int length = bit_length(diff);
+	put_bits(e, e->dc_code[t][length], e->dc_length[t][length]);
+	if (length) put_value(e, diff, length);
+}
+
+static void encode_block(struct JpegEncoder *e, int comp, int t, const int32_t *zz) {
+	put_dc(e, comp, t, zz[0]);
+	int run = 0;
+	for (int k = 1; k < 64; k++) {
+		if (zz[k] == 0) {
+			run++;
+			continue;
+		}
+		while (run > 15) {
+			put_bits(e, e->ac_code[t][0xf0], e->ac_length[t][0xf0]);
+			run -= 16;
+		}
+		int length = bit_length(zz[k]);
+		int sym = (run << 4) | length;
+		put_bits(e, e->ac_code[t][sym], e->ac_length[t][sym]);
+		put_value(e, zz[k], length);
+		run = 0;
+	}
+	if (run) put_bits(e, e->ac_code[t][0x00], e->ac_length[t][0x00]);
+}
+
+// A uniform block only has a DC coefficient
+static void encode_flat(struct JpegEncoder *e, int comp, int t, int value) {
+	float dc = (float)((value - 128) * 64) * e->recip[t][0];
+	put_dc(e, comp, t, (int)(dc < 0 ? dc - 0.5f : dc + 0.5f));
+	put_bits(e, e->ac_code[t][0x00], e->ac_length[t][0x00]);
+}
+
+// One pass of the AAN DCT (jfdctflt.c), over the 8 lanes of d at once
+static void dct_pass(v8f *d) {
+	v8f tmp0 = d[0] + d[7], tmp7 = d[0] - d[7];
+	v8f tmp1 = d[1] + d[6], tmp6 = d[1] - d[6];
+	v8f tmp2 = d[2] + d[5], tmp5 = d[2] - d[5];
+	v8f tmp3 = d[3] + d[4], tmp4 = d[3] - d[4];
+
+	v8f tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+	v8f tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+	d[0] = tmp10 + tmp11;
+	d[4] = tmp10 - tmp11;
+	v8f z1 = (tmp12 + tmp13) * 0.707106781f;
+	d[2] = tmp13 + z1;
+	d[6] = tmp13 - z1;
+
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+	v8f z5 = (tmp10 - tmp12) * 0.382683433f;
+	v8f z2 = tmp10 * 0.541196100f + z5;
+	v8f z4 = tmp12 * 1.306562965f + z5;
+	v8f z3 = tmp11 * 0.707106781f;
+	v8f z11 = tmp7 + z3, z13 = tmp7 - z3;
+	d[5] = z13 + z2;
+	d[3] = z13 - z2;
+	d[1] = z11 + z4;
+	d[7] = z11 - z4;
+}
+
+// DCT and quantize an 8x8 block, coefficients come out in zigzag order
+static void fdct_quant(const struct JpegEncoder *e, int t, const uint8_t *px, int stride, int32_t *zz) {
+	v8f r[8];
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++)
+			r[y][x] = (float)px[y * stride + x] - 128.0f;
+	}
+	dct_pass(r);
+
+	float tr[64];
+	memcpy(tr, r, sizeof(tr));
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++)
+			r[x][y] = tr[y * 8 + x];
+	}
+	dct_pass(r);
+
+	int32_t q[64];
+	const v8f zero = {0};
+	for (int i = 0; i < 8; i++) {
+		v8f recip;
+		memcpy(&recip, &e->recip[t][i * 8], sizeof(recip));
+		v8f v = r[i] * recip;
+		// Round half away from zero, the conversion truncates
+		v8f bias = __builtin_convertvector(v < zero, v8f) + 0.5f;
+		v8i iv = __builtin_convertvector(v + bias, v8i);
+		memcpy(&q[i * 8], &iv, sizeof(iv));
+	}
+	for (int i = 0; i < 64; i++)
+		zz[i] = q[zigzag_src[i]];
+}
+
+static int is_flat(const uint8_t *px, int stride) {
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			if (px[y * stride + x] != px[0]) return 0;
+		}
+	}
+	return 1;
+}
+
+static void encode_plane_block(struct JpegEncoder *e, int comp, int t, const uint8_t *px, int stride) {
+	if (is_flat(px, stride)) {
+		encode_flat(e, comp, t, px[0]);
+		return;
+	}
+	int32_t zz[64];
+	fdct_quant(e, t, px, stride, zz);
+	encode_block(e, comp, t, zz);
+}
+
+// MCU of 16x16 luma and 8x8 of each chroma plane
+static void encode_mcu(struct JpegEncoder *e, const uint8_t *y, const uint8_t *cb, const uint8_t *cr) {
+	if (e->end - e->out < MCU_WORST) {
+		e->overflow = 1;
+		return;
+	}
+	encode_plane_block(e, 0, 0, y, 16);
+	encode_plane_block(e, 0, 0, y + 8, 16);
+	encode_plane_block(e, 0, 0, y + 128, 16);
+	encode_plane_block(e, 0, 0, y + 136, 16);
+	encode_plane_block(e, 1, 1, cb, 8);
+	encode_plane_block(e, 2, 1, cr, 8);
+}
+
+static void encode_flat_mcu(struct JpegEncoder *e, int y, int cb, int cr) {
+	if (e->end - e->out < MCU_WORST) {
+		e->overflow = 1;
+		return;
+	}
+	for (int i = 0; i < 4; i++)
+		encode_flat(e, 0, 0, y);
+	encode_flat(e, 1, 1, cb);
+	encode_flat(e, 2, 1, cr);
+}
+
+static uint8_t *put_u16(uint8_t *p, int v) {
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+	return p + 2;
+}
+
+// Everything up to the entropy coded data, returns where that starts
+static uint8_t *write_headers(struct JpegEncoder *e, uint8_t *p, int width, int height, const char *comment) {
+	static const uint8_t jfif[] = {0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+	memcpy(p, jfif, sizeof(jfif));
+	p += sizeof(jfif);
+
+	size_t comment_length = strlen(comment);
+	p = put_u16(p, 0xfffe);
+	p = put_u16(p, (int)comment_length + 2);
+	memcpy(p, comment, comment_length);
+	p += comment_length;
+
+	p = put_u16(p, 0xffdb);
+	p = put_u16(p, 2 + 65 * 2);
+	for (int t = 0; t < 2; t++) {
+		*p++ = (uint8_t)t;
+		memcpy(p, e->qt[t], 64);
+		p += 64;
+	}
+
+	static const uint8_t sof[] = {8, 0, 0, 0, 0, 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+	p = put_u16(p, 0xffc0);
+	p = put_u16(p, 2 + (int)sizeof(sof));
+	memcpy(p, sof, sizeof(sof));
+	put_u16(p + 1, height);
+	put_u16(p + 3, width);
+	p += sizeof(sof);
+
+	p = put_u16(p, 0xffc4);
+	p = put_u16(p, 2 + (1 + 16 + 12) * 2 + (1 + 16 + 162) * 2);
+	for (int t = 0; t < 2; t++) {
+		*p++ = (uint8_t)t;
+		memcpy(p, dc_bits[t], 16);
+		memcpy(p + 16, dc_vals, 12);
+		p += 28;
+		*p++ = (uint8_t)(0x10 | t);
+		memcpy(p, ac_bits[t], 16);
+		memcpy(p + 16, ac_vals[t], 162);
+		p += 178;
+	}
+
+	static const uint8_t sos[] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+	p = put_u16(p, 0xffda);
+	p = put_u16(p, 2 + (int)sizeof(sos));
+	memcpy(p, sos, sizeof(sos));
+	return p + sizeof(sos);
+}
+
+// 5x7 glyphs, one byte per row, bit 4 is the leftmost dot
+static const uint8_t *glyph(char c) {
+	static const uint8_t digits[10][7] = {
+		{0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e},
+		{0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e},
+		{0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e},
+		{0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+		{0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c},
+	};
+	static const uint8_t hash[7] = {0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a};
+	static const uint8_t dot[7] = {0, 0, 0, 0, 0, 0x0c, 0x0c};
+	static const uint8_t s[7] = {0, 0, 0x0e, 0x10, 0x0e, 0x01, 0x1e};
+	static const uint8_t blank[7] = {0};
+	if (c >= '0' && c <= '9') return digits[c - '0'];
+	if (c == '#') return hash;
+	if (c == '.') return dot;
+	if (c == 's') return s;
+	return blank;
+}
+
+#define TEXT_CHARS 14
+#define TEXT_LINES 2
+
+static int tri(int v) {
+	int x = (v & 127) - 64;
+	return (x < 0 ? -x : x) - 32;
+}
+
+// Background is flat 16x16 tiles whose colours shift every frame, with the frame number in binary along the top
+static void tile_colour(int mx, int my, uint32_t number, int *y, int *cb, int *cr) {
+	if (my == 0 && mx < 32) {
+		*y = ((number >> (31 - mx)) & 1) ? 235 : 16;
+		*cb = 128;
+		*cr = 128;
+		return;
+	}
+	*y = 70 + (int)(((uint32_t)(mx * 5 + my * 3) + number * 4) % 110);
+	*cb = 128 + tri(mx * 6 + (int)(number * 3));
+	*cr = 128 + tri(my * 9 + (int)(number * 5));
+}
+
+int vcam_synth_init(struct VcamSynth *s, int width, int height, int quality) {
+	memset(s, 0, sizeof(struct VcamSynth));
+	if (width < 16 || height < 16 || width > 8192 || height > 8192 || quality < 1 || quality > 100) return -1;
+	s->width = width;
+	s->height = height;
+	s->quality = quality;
+	jpeg_init(&s->enc, quality);
+
+	// Text below the binary row, as large as fits
+	s->scale = height / 48;
+	int fit = (width - 32) / (TEXT_CHARS * 6 + 4);
+	if (s->scale > fit) s->scale = fit;
+	if (s->scale > 0) {
+		s->text_x = 16;
+		s->text_y = 32;
+		s->text_w = (TEXT_CHARS * 6 + 4) * s->scale;
+		s->text_h = (TEXT_LINES * 8 + 3) * s->scale;
+		if (s->text_y + s->text_h > height) s->scale = 0;
+	}
+
+	s->capacity = (size_t)width * (size_t)height / 4 + 4096;
+	s->out = malloc(s->capacity);
+	if (s->out == NULL) return -1;
+	return 0;
+}
+
+void vcam_synth_free(struct VcamSynth *s) {
+	free(s->out);
+	s->out = NULL;
+}
+
+// MCU that the text box covers part of, drawn pixel by pixel
+static void encode_text_mcu(struct VcamSynth *s, char text[TEXT_LINES][TEXT_CHARS + 1], int mx, int my, uint32_t number) {
+	int ty, tcb, tcr;
+	tile_colour(mx, my, number, &ty, &tcb, &tcr);
+
+	// Which glyph and which of its dots each column and row of the MCU falls on, -1 outside the text box
+	// or its margin (0), so the divisions are done 32 times rather than 256
+	int ch[16], col[16], line[16], row[16];
+	int origin_x = s->text_x + 2 * s->scale, origin_y = s->text_y + 2 * s->scale;
+	for (int i = 0; i < 16; i++) {
+		int x = mx * 16 + i;
+		ch[i] = col[i] = -1;
+		if (x >= s->text_x && x < s->text_x + s->text_w) {
+			ch[i] = col[i] = 0;
+			int lx = x - origin_x;
+			if (lx >= 0 && lx / (6 * s->scale) < TEXT_CHARS && (lx / s->scale) % 6 < 5) {
+				ch[i] = lx / (6 * s->scale);
+				col[i] = 1 << (4 - (lx / s->scale) % 6);
+			}
+		}
+		int y = my * 16 + i;
+		line[i] = row[i] = -1;
+		if (y >= s->text_y && y < s->text_y + s->text_h) {
+			line[i] = row[i] = 0;
+			int ly = y - origin_y;
+			if (ly >= 0 && ly / (8 * s->scale) < TEXT_LINES && (ly / s->scale) % 8 < 7) {
+				line[i] = ly / (8 * s->scale);
+				row[i] = (ly / s->scale) % 8 + 1;
+			}
+		}
+	}
+
+	uint8_t y[256], cb[64], cr[64];
+	for (int j = 0; j < 16; j++) {
+		for (int i = 0; i < 16; i++) {
+			int in_box = col[i] >= 0 && row[j] >= 0;
+			uint8_t value = (uint8_t)ty;
+			if (in_box) {
+				int dot = col[i] && row[j] && (glyph(text[line[j]][ch[i]])[row[j] - 1] & col[i]);
+				value = dot ? 235 : 16;
+			}
+			y[j * 16 + i] = value;
+			if ((i & 1) == 0 && (j & 1) == 0) {
+				cb[(j / 2) * 8 + i / 2] = (uint8_t)(in_box ? 128 : tcb);
+				cr[(j / 2) * 8 + i / 2] = (uint8_t)(in_box ? 128 : tcr);
+			}
+		}
+	}
+	encode_mcu(&s->enc, y, cb, cr);
+}
+
+int vcam_synth_frame(struct VcamSynth *s, size_t prefix, uint32_t number, uint64_t timestamp_us) {
+	char comment[64];
+	snprintf(comment, sizeof(comment), "vcam frame %u t %llu", number, (unsigned long long)timestamp_us);
+	char lines[TEXT_LINES][32];
+	snprintf(lines[0], sizeof(lines[0]), "#%u", number);
+	snprintf(lines[1], sizeof(lines[1]), "%llu.%03llu s",
+		(unsigned long long)(timestamp_us / 1000000), (unsigned long long)(timestamp_us / 1000 % 1000));
+	char text[TEXT_LINES][TEXT_CHARS + 1];
+	for (int l = 0; l < TEXT_LINES; l++) {
+		memset(text[l], ' ', TEXT_CHARS);
+		size_t n = strlen(lines[l]);
+		memcpy(text[l], lines[l], n < TEXT_CHARS ? n : TEXT_CHARS);
+		text[l][TEXT_CHARS] = '\0';
+	}
+
+	int mcu_w = (s->width + 15) / 16, mcu_h = (s->height + 15) / 16;
+	int box_mx0 = s->text_x / 16, box_mx1 = (s->text_x + s->text_w - 1) / 16;
+	int box_my0 = s->text_y / 16, box_my1 = (s->text_y + s->text_h - 1) / 16;
+
+	while (1) {
+		if (s->capacity < prefix + 4096) {
+			s->capacity = prefix + 4096 + s->capacity * 2;
+			s->out = realloc(s->out, s->capacity);
+			if (s->out == NULL) abort();
+		}
+
+		struct JpegEncoder *e = &s->enc;
+		e->out = write_headers(e, s->out + prefix, s->width, s->height, comment);
+		e->end = s->out + s->capacity - 2;
+		e->acc = 0;
+		e->bits = 0;
+		e->overflow = 0;
+		memset(e->dc, 0, sizeof(e->dc));
+
+		for (int my = 0; my < mcu_h && !e->overflow; my++) {
+			for (int mx = 0; mx < mcu_w && !e->overflow; mx++) {
+				if (s->scale && mx >= box_mx0 && mx <= box_mx1 && my >= box_my0 && my <= box_my1) {
+					encode_text_mcu(s, text, mx, my, number);
+				} else {
+					int y, cb, cr;
+					tile_colour(mx, my, number, &y, &cb, &cr);
+					encode_flat_mcu(e, y, cb, cr);
+				}
+			}
+		}
+
+		if (!e->overflow) {
+			// Pad the last byte with ones
+			if (e->bits) put_bits(e, (1u << (8 - e->bits)) - 1, 8 - e->bits);
+			*e->out++ = 0xff;
+			*e->out++ = 0xd9;
+			return (int)(e->out - (s->out + prefix));
+		}
+
+		s->capacity *= 2;
+		s->out = realloc(s->out, s->capacity);
+		if (s->out == NULL) abort();
+		vcam_log("Synthetic frame didn't fit, buffer grown to %zu", s->capacity);
+	}
+}
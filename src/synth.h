@@ -0,0 +1,50 @@
+#ifndef VCAM_SYNTH_H
+#define VCAM_SYNTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Baseline JPEG encoder with the standard (Annex K) Huffman tables, YCbCr 4:2:0
+struct JpegEncoder {
+	uint8_t *out;
+	uint8_t *end;
+	uint64_t acc;
+	int bits;
+	/// @brief Set once out ran short of room for an MCU
+	int overflow;
+	int dc[3];
+	/// @brief Quantization tables in zigzag order, as written to DQT
+	uint8_t qt[2][64];
+	/// @brief Reciprocals of the divisors, with the DCT scale folded in, in the layout fdct outputs
+	float recip[2][64];
+	uint16_t dc_code[2][12];
+	uint8_t dc_length[2][12];
+	uint16_t ac_code[2][256];
+	uint8_t ac_length[2][256];
+};
+
+/// @brief Synthetic liveview source, every frame shows its number and timestamp
+/// Frame number is drawn as digits and as a row of black/white 16x16 tiles along the top (bit 31 first),
+/// and written along with the timestamp to a COM marker: "vcam frame <n> t <CLOCK_MONOTONIC us>"
+struct VcamSynth {
+	int width;
+	int height;
+	int quality;
+	struct JpegEncoder enc;
+	/// @brief Last frame, JPEG starts after the prefix bytes asked for
+	uint8_t *out;
+	size_t capacity;
+	/// @brief Text box, in pixels
+	int text_x, text_y, text_w, text_h;
+	/// @brief Pixels per font dot
+	int scale;
+};
+
+/// @returns 0, -1 for an unusable size or quality
+int vcam_synth_init(struct VcamSynth *s, int width, int height, int quality);
+/// @brief Draw and encode a frame into s->out, after prefix bytes left for the caller's framing
+/// @returns JPEG length
+int vcam_synth_frame(struct VcamSynth *s, size_t prefix, uint32_t number, uint64_t timestamp_us);
+void vcam_synth_free(struct VcamSynth *s);
+
+#endif
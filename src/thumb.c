@@ -0,0 +1,131 @@
+// EXIF thumbnail locator
+// Only the JPEG marker segments in front of the image data are read, the thumbnail
+// is then sent straight from its byte range in the file.
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vcam.h"
+
+#define TAG_JPEG_INTERCHANGE_FORMAT 0x0201
+#define TAG_JPEG_INTERCHANGE_FORMAT_LENGTH 0x0202
+#define TIFF_SHORT 3
+
+static uint16_t tiff_16(const uint8_t *p, int big) {
+	return big ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static uint32_t tiff_32(const uint8_t *p, int big) {
+	if (big) return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Find the IFD1 thumbnail in a TIFF structure, the offset is relative to its header
+static int parse_tiff(const uint8_t *tiff, size_t size, uint32_t *offset, uint32_t *length) {
+	int big;
+	if (size < 8) return -1;
+	if (!memcmp(tiff, "II", 2))
+		big = 0;
+	else if (!memcmp(tiff, "MM", 2))
+		big = 1;
+	else
+		return -1;
+	if (tiff_16(tiff + 2, big) != 42) return -1;
+
+	// IFD0 is only skipped, IFD1 follows it
+	size_t ifd = tiff_32(tiff + 4, big);
+	if (ifd + 2 > size) return -1;
+	size_t next = ifd + 2 + (size_t)tiff_16(tiff + ifd, big) * 12;
+	if (next + 4 > size) return -1;
+	ifd = tiff_32(tiff + next, big);
+	if (ifd == 0 || ifd + 2 > size) return -1;
+
+	int n = tiff_16(tiff + ifd, big);
+	if (ifd + 2 + (size_t)n * 12 > size) return -1;
+
+	int found = 0;
+	uint32_t off = 0, len = 0;
+	for (int i = 0; i < n; i++) {
+		const uint8_t *entry = tiff + ifd + 2 + i * 12;
+		uint16_t tag = tiff_16(entry, big);
+		uint32_t value = tiff_16(entry + 2, big) == TIFF_SHORT ? tiff_16(entry + 8, big) : tiff_32(entry + 8, big);
+		if (tag == TAG_JPEG_INTERCHANGE_FORMAT) {
+			off = value;
+			found = 1;
+		} else if (tag == TAG_JPEG_INTERCHANGE_FORMAT_LENGTH) {
+			len = value;
+		}
+	}
+
+	if (!found || len == 0 || off > size || len > size - off) return -1;
+	(*offset) = off;
+	(*length) = len;
+	return 0;
+}
+
+static int locate_thumb(int fd, off_t *offset, uint32_t *length) {
+	uint8_t buf[4];
+	if (pread(fd, buf, 2, 0) != 2 || buf[0] != 0xff || buf[1] != 0xd8)
+		return -1;
+
+	off_t pos = 2;
+	while (1) {
+		if (pread(fd, buf, 4, pos) != 4 || buf[0] != 0xff)
+			return -1;
+		uint8_t marker = buf[1];
+		if (marker == 0xff) { /* fill byte */
+			pos++;
+			continue;
+		}
+		if (marker == 0xda || marker == 0xd9) /* SOS/EOI, no EXIF in front of the image */
+			return -1;
+		if ((marker >= 0xd0 && marker <= 0xd7) || marker == 0x01) { /* no length */
+			pos += 2;
+			continue;
+		}
+
+		int seglen = (buf[2] << 8) | buf[3];
+		if (seglen < 2)
+			return -1;
+
+		if (marker == 0xe1 && seglen > 2 + 6) { /* APP1, may also be XMP */
+			uint8_t *seg = malloc(seglen - 2);
+			if (seg == NULL) abort();
+			int rc = -1;
+			uint32_t off, len;
+			int is_exif = pread(fd, seg, seglen - 2, pos + 4) == seglen - 2 && !memcmp(seg, "Exif\0\0", 6);
+			if (is_exif)
+				rc = parse_tiff(seg + 6, seglen - 2 - 6, &off, &len);
+			free(seg);
+			if (is_exif) {
+				if (rc) return -1;
+				(*offset) = pos + 4 + 6 + off;
+				(*length) = len;
+				return 0;
+			}
+		}
+
+		pos += 2 + seglen;
+	}
+}
+
+int vcam_find_thumb(struct ptp_dirent *cur, off_t *offset, uint32_t *length) {
+	if (cur->thumb_state == THUMB_UNKNOWN || !vcam_filekey_matches(&cur->thumb_key, &cur->stbuf)) {
+		cur->thumb_state = THUMB_NONE;
+		vcam_filekey_set(&cur->thumb_key, &cur->stbuf);
+
+		int fd = open(cur->fsname, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			if (S_ISREG(cur->stbuf.st_mode) && locate_thumb(fd, &cur->thumb_offset, &cur->thumb_length) == 0)
+				cur->thumb_state = THUMB_FOUND;
+			close(fd);
+		}
+	}
+
+	if (cur->thumb_state != THUMB_FOUND)
+		return -1;
+	(*offset) = cur->thumb_offset;
+	(*length) = cur->thumb_length;
+	return 0;
+}
@@ -0,0 +1,714 @@
+// io_uring engine for the PTP/IP reactor, picked with --io-uring
+// Sockets are accepted and read by multishot requests, reads land in a ring of provided buffers.
+// Whatever a connection has queued - acks, data phase headers, payloads and the response - goes out
+// as one chain of linked sends: small pieces are copied into the connection's registered slot and
+// written with WRITE_FIXED, big payloads are sent in place from the camera with SENDMSG. WRITE_FIXED
+// can't take MSG_NOSIGNAL, so the program has to ignore SIGPIPE (main does). A single
+// io_uring_enter submits every chain and reaps every completion of a loop, so with many busy
+// cameras a transaction costs a fraction of a syscall instead of a recv, sendmsg and epoll_wait each.
+// liburing isn't needed, the rings are set up with the raw system calls.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <vcam.h>
+#include "reactor.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define RING_ENTRIES 1024
+// Provided receive buffers shared by all sockets, a power of two
+#define RECV_BUFFERS 256
+#define RECV_BUFFER_SIZE (16 * 1024)
+// Staging buffer of each connection, registered with the ring as long as the memlock limit allows
+#define SLOT_SIZE (16 * 1024)
+#define MAX_SLOTS 1024
+// Payloads up to this are copied into the slot, bigger ones are sent from the camera in place
+#define COPY_MAX 4096
+// Linked sends and camera spans in one chain
+#define CHAIN_MAX 16
+#define CHAIN_IOV 48
+// How long to wait for sockets to cancel their requests when shutting down
+#define DRAIN_MS 1000
+
+// Tag in the low bits of user_data, connections are calloc'd so those are free
+enum UringOp {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SEND,
+	OP_POLL,
+};
+#define OP_MASK 3
+
+struct Uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/// @brief SQEs filled in, and how many of those the kernel took
+	unsigned sqe_tail;
+	unsigned submitted;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint8_t *recv_buffers;
+	uint16_t br_tail;
+
+	/// @brief Registered staging slots, free ones are on a stack
+	uint8_t *slots;
+	size_t slots_size;
+	int *free_slots;
+	int free_length;
+};
+
+/// @brief One send of a chain
+struct ChainPart {
+	/// @brief Bytes copied into the slot at offset, otherwise iovcnt spans of camera memory from iov
+	int fixed;
+	size_t offset;
+	size_t length;
+	int iov;
+	int iovcnt;
+};
+
+struct UringConn {
+	/// @brief Registered slot of stage, -1 if it couldn't get one and stage was malloc'd
+	int slot;
+	uint8_t *stage;
+	int recv_armed;
+
+	/// @brief Send chain in flight, the bytes it sent are accounted for once all of it completed
+	int chain_length;
+	int chain_done;
+	size_t chain_sent;
+	int chain_error;
+
+	struct ChainPart parts[CHAIN_MAX];
+	int parts_length;
+	struct msghdr msg[CHAIN_MAX];
+	struct iovec iov[CHAIN_IOV];
+	int iov_length;
+	size_t fill;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_size) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned n) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static uint64_t tag(void *ptr, enum UringOp op) {
+	return (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+}
+
+static void uring_free(struct Uring *u) {
+	if (u->fd != -1) close(u->fd);
+	if (u->ring != NULL) munmap(u->ring, u->ring_size);
+	if (u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+	if (u->br != NULL) munmap(u->br, u->br_size);
+	if (u->slots != NULL) munmap(u->slots, u->slots_size);
+	free(u->recv_buffers);
+	free(u->free_slots);
+	free(u);
+}
+
+static void recycle_buffer(struct Uring *u, uint16_t bid) {
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (RECV_BUFFERS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(u->recv_buffers + (size_t)bid * RECV_BUFFER_SIZE);
+	buf->len = RECV_BUFFER_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+// Register as many slots as the memlock limit takes, connections past that stage in malloc'd memory
+static void register_slots(struct Uring *u, int n) {
+	for (; n >= 16; n /= 2) {
+		size_t size = (size_t)n * SLOT_SIZE;
+		void *slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slots == MAP_FAILED) continue;
+		struct iovec iov = {slots, size};
+		if (sys_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+			u->slots = slots;
+			u->slots_size = size;
+			u->free_slots = malloc(sizeof(int) * (size_t)n);
+			if (u->free_slots == NULL) abort();
+			for (int i = 0; i < n; i++) u->free_slots[i] = n - 1 - i;
+			u->free_length = n;
+			return;
+		}
+		munmap(slots, size);
+	}
+	vcam_log("io_uring: couldn't register send buffers (%s), sending from unregistered memory", strerror(errno));
+}
+
+// Returns NULL if the kernel lacks anything the engine relies on
+static struct Uring *uring_init(int n_slots) {
+	struct Uring *u = calloc(1, sizeof(struct Uring));
+	if (u == NULL) abort();
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	u->fd = sys_setup(RING_ENTRIES, &p);
+	if (u->fd == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		u->fd = sys_setup(RING_ENTRIES, &p);
+	}
+	if (u->fd == -1) {
+		vcam_log("io_uring_setup: %s", strerror(errno));
+		free(u);
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		vcam_log("io_uring: kernel is too old");
+		uring_free(u);
+		return NULL;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->ring == MAP_FAILED) u->ring = NULL;
+		if (u->sqes == MAP_FAILED) u->sqes = NULL;
+		uring_free(u);
+		return NULL;
+	}
+
+	uint8_t *ring = u->ring;
+	u->sq_head = (unsigned *)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	u->sqe_tail = *u->sq_tail;
+	u->submitted = u->sqe_tail;
+
+	// Multishot recv picks its buffers from here
+	u->br_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->recv_buffers = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+	if (u->br == MAP_FAILED || u->recv_buffers == NULL) {
+		if (u->br == MAP_FAILED) u->br = NULL;
+		uring_free(u);
+		return NULL;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = RECV_BUFFERS;
+	reg.bgid = 0;
+	if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		vcam_log("io_uring: no provided buffer rings: %s", strerror(errno));
+		uring_free(u);
+		return NULL;
+	}
+	for (uint16_t i = 0; i < RECV_BUFFERS; i++)
+		recycle_buffer(u, i);
+
+	register_slots(u, n_slots);
+	return u;
+}
+
+static unsigned sq_space(struct Uring *u) {
+	return u->sq_entries - (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static int cq_ready(struct Uring *u) {
+	return __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != *u->cq_head;
+}
+
+// Hand every filled SQE to the kernel, waiting for a completion if wait is set
+static int uring_enter(struct PtpIpReactor *r, struct Uring *u, int wait, int64_t timeout_us) {
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+	unsigned submit = u->sqe_tail - u->submitted;
+	if (submit == 0 && !wait) return 0;
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (timeout_us >= 0) {
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (long long)(timeout_us % 1000000) * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	if (wait) flags |= IORING_ENTER_GETEVENTS;
+	r->syscalls++;
+	int rc = sys_enter(u->fd, submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+	if (rc < 0) {
+		if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) return 0;
+		perror("io_uring_enter");
+		return -1;
+	}
+	u->submitted += (unsigned)rc;
+	return 0;
+}
+
+// Make room for n SQEs that have to go in the same submission
+static void reserve(struct PtpIpReactor *r, struct Uring *u, unsigned n) {
+	while (sq_space(u) < n) {
+		if (uring_enter(r, u, 0, 0)) abort();
+	}
+}
+
+static struct io_uring_sqe *get_sqe(struct PtpIpReactor *r, struct Uring *u) {
+	reserve(r, u, 1);
+	unsigned index = u->sqe_tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->sq_array[index] = index;
+	u->sqe_tail++;
+	return sqe;
+}
+
+static void arm_accept(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *l) {
+	struct io_uring_sqe *sqe = get_sqe(r, u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = tag(l, OP_ACCEPT);
+}
+
+// Multishot poll on a card watch, it stays armed until the watch is closed
+static void arm_poll(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *w) {
+	struct io_uring_sqe *sqe = get_sqe(r, u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = tag(w, OP_POLL);
+	w->pending_ops++;
+}
+
+static int uring_watch(struct PtpIpReactor *r, struct PtpIpConn *w) {
+	arm_poll(r, r->engine, w);
+	return 0;
+}
+
+static void uring_unwatch(struct PtpIpReactor *r, struct PtpIpConn *w) {
+	struct io_uring_sqe *sqe = get_sqe(r, r->engine);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = tag(w, OP_POLL);
+	// Nothing waits on the removal itself, the poll completes with -ECANCELED
+	sqe->user_data = 0;
+}
+
+static void arm_recv(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *c) {
+	struct UringConn *uc = c->engine;
+	struct io_uring_sqe *sqe = get_sqe(r, u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = tag(c, OP_RECV);
+	uc->recv_armed = 1;
+	c->pending_ops++;
+}
+
+// Copy into the slot, growing the fixed send at the end of the chain
+static size_t chain_copy(struct UringConn *uc, const void *data, size_t length) {
+	size_t room = SLOT_SIZE - uc->fill;
+	if (length > room) length = room;
+	if (length == 0) return 0;
+
+	struct ChainPart *part = uc->parts_length ? &uc->parts[uc->parts_length - 1] : NULL;
+	if (part == NULL || !part->fixed) {
+		if (uc->parts_length == CHAIN_MAX) return 0;
+		part = &uc->parts[uc->parts_length++];
+		part->fixed = 1;
+		part->offset = uc->fill;
+		part->length = 0;
+	}
+
+	memcpy(uc->stage + uc->fill, data, length);
+	uc->fill += length;
+	part->length += length;
+	return length;
+}
+
+static size_t chain_copy_window(struct UringConn *uc, struct PtpIpWindow *w, size_t n) {
+	size_t copied = 0;
+	while (copied < n) {
+		size_t room = SLOT_SIZE - uc->fill;
+		const uint8_t *data;
+		size_t span = ptpip_window_take(w, n - copied < room ? n - copied : room, &data);
+		if (span == 0 || chain_copy(uc, data, span) != span) break;
+		copied += span;
+	}
+	return copied;
+}
+
+// Send up to n bytes of the window straight from camera memory
+static size_t chain_ref(struct UringConn *uc, struct PtpIpWindow *w, size_t n) {
+	if (uc->parts_length == CHAIN_MAX) return 0;
+	struct ChainPart *part = &uc->parts[uc->parts_length];
+	part->fixed = 0;
+	part->iov = uc->iov_length;
+	part->iovcnt = 0;
+	part->length = 0;
+	while (part->length < n && uc->iov_length < CHAIN_IOV) {
+		const uint8_t *data;
+		size_t span = ptpip_window_take(w, n - part->length, &data);
+		if (span == 0) break;
+		uc->iov[uc->iov_length].iov_base = (void *)(uintptr_t)data;
+		uc->iov[uc->iov_length].iov_len = span;
+		uc->iov_length++;
+		part->iovcnt++;
+		part->length += span;
+	}
+	if (part->length) uc->parts_length++;
+	return part->length;
+}
+
+// Lay out everything queued on c as sends, in the order ptpip_conn_advance accounts for them
+// Stops at the first thing that doesn't fit, the rest goes out with the next chain
+static void plan_chain(struct PtpIpReactor *r, struct PtpIpConn *c, struct UringConn *uc) {
+	uc->parts_length = 0;
+	uc->iov_length = 0;
+	uc->fill = 0;
+
+	size_t out_left = c->out_length - c->out_sent;
+	if (chain_copy(uc, c->out + c->out_sent, out_left) != out_left) return;
+	if (c->cam == NULL) return;
+
+	struct PtpIpWindow w;
+	ptpip_window_init(&w, c->cam);
+	struct PtpIpSend s = c->send;
+	while (1) {
+		if (!ptpip_send_done(r, c, &s)) {
+			size_t hdr_left = (size_t)(s.hdr_length - s.hdr_sent);
+			if (chain_copy(uc, s.hdr + s.hdr_sent, hdr_left) != hdr_left) return;
+			s.hdr_sent = s.hdr_length;
+
+			size_t payload = s.chunk_left;
+			if (payload) {
+				size_t sent;
+				if (payload <= COPY_MAX && SLOT_SIZE - uc->fill >= payload) {
+					sent = chain_copy_window(uc, &w, payload);
+				} else {
+					sent = chain_ref(uc, &w, payload);
+				}
+				if (sent != payload) return;
+				s.payload_left -= (uint32_t)payload;
+				s.chunk_left = 0;
+			}
+			continue;
+		}
+
+		// The next container, if the camera has all of its header already
+		struct PtpBulkContainer usb;
+		if (ptpip_window_header(&w, &usb) || ptpip_send_start(r, c, &s, &usb)) return;
+	}
+}
+
+static int uring_flush(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	struct Uring *u = r->engine;
+	struct UringConn *uc = c->engine;
+	if (uc == NULL || uc->chain_length || c->kind == PTPIP_CONN_CLOSED) return 0;
+	if (ptpip_conn_next(r, c)) return 0;
+
+	plan_chain(r, c, uc);
+	if (uc->parts_length == 0) {
+		vcam_log("Camera is %u bytes short of a container", c->send.payload_left);
+		return -1;
+	}
+
+	// A link chain split over two submissions would lose its ordering
+	reserve(r, u, (unsigned)uc->parts_length);
+	for (int i = 0; i < uc->parts_length; i++) {
+		struct ChainPart *part = &uc->parts[i];
+		struct io_uring_sqe *sqe = get_sqe(r, u);
+		sqe->fd = c->fd;
+		if (part->fixed && uc->slot != -1) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->addr = (uint64_t)(uintptr_t)(uc->stage + part->offset);
+			sqe->len = (uint32_t)part->length;
+			sqe->buf_index = 0;
+		} else if (part->fixed) {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->addr = (uint64_t)(uintptr_t)(uc->stage + part->offset);
+			sqe->len = (uint32_t)part->length;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		} else {
+			struct msghdr *msg = &uc->msg[i];
+			memset(msg, 0, sizeof(struct msghdr));
+			msg->msg_iov = &uc->iov[part->iov];
+			msg->msg_iovlen = (size_t)part->iovcnt;
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->addr = (uint64_t)(uintptr_t)msg;
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		}
+		if (i != uc->parts_length - 1) sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = tag(c, OP_SEND);
+	}
+
+	uc->chain_length = uc->parts_length;
+	uc->chain_done = 0;
+	uc->chain_sent = 0;
+	uc->chain_error = 0;
+	c->pending_ops += uc->parts_length;
+	return 0;
+}
+
+static void uring_release(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	struct Uring *u = r->engine;
+	struct UringConn *uc = c->engine;
+	if (uc == NULL) return;
+	if (uc->slot != -1) {
+		u->free_slots[u->free_length++] = uc->slot;
+	} else {
+		free(uc->stage);
+	}
+	free(uc);
+	c->engine = NULL;
+}
+
+static void conn_start(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *c) {
+	struct UringConn *uc = calloc(1, sizeof(struct UringConn));
+	if (uc == NULL) abort();
+	if (u->free_length) {
+		uc->slot = u->free_slots[--u->free_length];
+		uc->stage = u->slots + (size_t)uc->slot * SLOT_SIZE;
+	} else {
+		uc->slot = -1;
+		uc->stage = malloc(SLOT_SIZE);
+		if (uc->stage == NULL) abort();
+	}
+	c->engine = uc;
+	arm_recv(r, u, c);
+}
+
+static void conn_append(struct PtpIpConn *c, const uint8_t *data, size_t length) {
+	if (c->in_capacity - c->in_length < length) {
+		size_t capacity = c->in_capacity ? c->in_capacity : RECV_BUFFER_SIZE;
+		while (capacity - c->in_length < length) capacity *= 2;
+		c->in = realloc(c->in, capacity);
+		if (c->in == NULL) abort();
+		c->in_capacity = capacity;
+	}
+	memcpy(c->in + c->in_length, data, length);
+	c->in_length += length;
+}
+
+// Handle what was received and send whatever that queued
+// Nothing is handled while a chain is in flight: it may point into camera memory that new commands would move
+static void conn_progress(struct PtpIpReactor *r, struct PtpIpConn *c) {
+	struct UringConn *uc = c->engine;
+	if (uc->chain_length) return;
+	if (ptpip_conn_dispatch(r, c) || uring_flush(r, c))
+		ptpip_conn_close(r, c);
+}
+
+static void on_accept(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *l, struct io_uring_cqe *cqe) {
+	if (cqe->res >= 0) {
+		struct PtpIpConn *c = ptpip_conn_accept(r, l, cqe->res);
+		if (c != NULL) conn_start(r, u, c);
+	} else if (cqe->res != -ECANCELED) {
+		vcam_log("Accept failed: %s", strerror(-cqe->res));
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !r->done)
+		arm_accept(r, u, l);
+}
+
+static void on_recv(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *c, struct io_uring_cqe *cqe) {
+	struct UringConn *uc = c->engine;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		uc->recv_armed = 0;
+		c->pending_ops--;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (cqe->res > 0 && c->kind != PTPIP_CONN_CLOSED)
+			conn_append(c, u->recv_buffers + (size_t)bid * RECV_BUFFER_SIZE, (size_t)cqe->res);
+		recycle_buffer(u, bid);
+	}
+
+	if (c->kind == PTPIP_CONN_CLOSED) return;
+	if (cqe->res == 0) {
+		ptpip_conn_close(r, c);
+		return;
+	}
+	if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+		if (cqe->res != -ECONNRESET && cqe->res != -ECANCELED)
+			vcam_log("Error reading data from socket: %s", strerror(-cqe->res));
+		ptpip_conn_close(r, c);
+		return;
+	}
+
+	// Multishot recv stops when the buffers ran out, or whenever the kernel decides to
+	if (!uc->recv_armed) arm_recv(r, u, c);
+	conn_progress(r, c);
+}
+
+static void on_send(struct PtpIpReactor *r, struct PtpIpConn *c, struct io_uring_cqe *cqe) {
+	struct UringConn *uc = c->engine;
+	c->pending_ops--;
+	uc->chain_done++;
+	if (cqe->res > 0) {
+		uc->chain_sent += (size_t)cqe->res;
+	} else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+		uc->chain_error = -cqe->res;
+	}
+	if (uc->chain_done < uc->chain_length) return;
+
+	// A short send cancels the rest of the chain, what did go out is accounted for and the rest is sent again
+	uc->chain_length = 0;
+	if (c->kind == PTPIP_CONN_CLOSED) return;
+	ptpip_conn_advance(r, c, uc->chain_sent);
+	if (uc->chain_error) {
+		if (uc->chain_error != EPIPE && uc->chain_error != ECONNRESET)
+			vcam_log("Error sending data to client: %s", strerror(uc->chain_error));
+		ptpip_conn_close(r, c);
+		return;
+	}
+	conn_progress(r, c);
+}
+
+static void on_poll(struct PtpIpReactor *r, struct Uring *u, struct PtpIpConn *w, struct io_uring_cqe *cqe) {
+	int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	if (!more) w->pending_ops--;
+	if (w->kind == PTPIP_CONN_CLOSED) return;
+	if (cqe->res > 0) ptpip_conn_watch_ready(r, w);
+	if (!more && cqe->res >= 0) arm_poll(r, u, w);
+}
+
+static int reap(struct PtpIpReactor *r, struct Uring *u) {
+	int n = 0;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		if (cqe->user_data == 0) continue;
+		struct PtpIpConn *c = (struct PtpIpConn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+		switch (cqe->user_data & OP_MASK) {
+		case OP_ACCEPT:
+			on_accept(r, u, c, cqe);
+			break;
+		case OP_RECV:
+			on_recv(r, u, c, cqe);
+			break;
+		case OP_SEND:
+			on_send(r, c, cqe);
+			break;
+		case OP_POLL:
+			on_poll(r, u, c, cqe);
+			break;
+		}
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int closed_pending(struct PtpIpReactor *r) {
+	for (struct PtpIpConn *c = r->closed; c != NULL; c = c->next_closed) {
+		if (c->pending_ops) return 1;
+	}
+	return 0;
+}
+
+int ptpip_uring_run(struct PtpIpReactor *r) {
+	int max = r->max_sessions > 1 ? r->max_sessions : 1;
+	int n_slots = 2 * max + 16;
+	if (n_slots > MAX_SLOTS) n_slots = MAX_SLOTS;
+	struct Uring *u = uring_init(n_slots);
+	if (u == NULL) return PTPIP_URING_UNAVAILABLE;
+
+	vcam_log("Serving PTP/IP with io_uring, %d registered send buffers", u->slots ? (int)(u->slots_size / SLOT_SIZE) : 0);
+
+	r->engine = u;
+	r->flush = uring_flush;
+	r->release = uring_release;
+	r->watch = uring_watch;
+	r->unwatch = uring_unwatch;
+
+	// Accepted sockets inherit blocking mode, the ring does the waiting
+	for (int i = 0; i < r->listeners_length; i++) {
+		set_nonblocking_io(r->listeners[i]->fd, 0);
+		arm_accept(r, u, r->listeners[i]);
+	}
+
+	int rc = 0;
+	while (!r->done) {
+		int64_t timeout = ptpip_deliver_events(r);
+		if (uring_enter(r, u, !cq_ready(u), timeout)) {
+			rc = -1;
+			break;
+		}
+		reap(r, u);
+		ptpip_free_closed(r);
+	}
+
+	// Closing the sockets cancels their requests, give the completions a moment to arrive
+	for (int i = 0; i < r->sessions_capacity; i++) {
+		if (r->sessions[i] != NULL)
+			ptpip_conn_close(r, r->sessions[i]);
+	}
+	for (int waited = 0; closed_pending(r) && waited < DRAIN_MS; waited += 10) {
+		if (uring_enter(r, u, !cq_ready(u), 10000)) break;
+		reap(r, u);
+	}
+	for (struct PtpIpConn *c = r->closed; c != NULL; c = c->next_closed)
+		c->pending_ops = 0;
+	ptpip_free_closed(r);
+
+	r->engine = NULL;
+	r->flush = NULL;
+	r->release = NULL;
+	r->watch = NULL;
+	r->unwatch = NULL;
+	uring_free(u);
+	return rc;
+}
+
+#else
+
+int ptpip_uring_run(struct PtpIpReactor *r) {
+	(void)r;
+	vcam_log("Built without io_uring headers");
+	return PTPIP_URING_UNAVAILABLE;
+}
+
+#endif
@@ -77,13 +77,28 @@ struct Config {
 	},
 };
 
+struct Device {
+	vcam *cam;
+	/// @brief Bytes of the current IN container that haven't been handed to the host yet
+	uint32_t last_length;
+	/// @brief Events sent on the interrupt endpoint, and how late they were in total and at worst (us)
+	unsigned long events;
+	uint64_t event_late_total;
+	uint64_t event_late_max;
+};
+
 struct Priv {
-	vcam *cam[5];
+	/// @brief One per device, n_devices long
+	struct Device *devs;
 };
 
+static inline struct Device *get_dev(struct UsbThing *ctx, int devn) {
+	if (devn < 0 || devn >= ctx->n_devices) abort();
+	return &((struct Priv *)ctx->priv_impl)->devs[devn];
+}
+
 static inline vcam *get_cam(struct UsbThing *ctx, int devn) {
-	if (devn > 5) abort();
-	return ((struct Priv *)ctx->priv_impl)->cam[devn];
+	return get_dev(ctx, devn)->cam;
 }
 
 int usb_get_string(struct UsbThing *ctx, int devn, int id, char buffer[127]) {
@@ -95,7 +110,8 @@ int usb_get_string(struct UsbThing *ctx, int devn, int id, char buffer[127]) {
 		strcpy(buffer, get_cam(ctx, devn)->model);
 		return 0;
 	case STRINGID_SERIAL:
-		strcpy(buffer, "123456");
+		// Hosts tell identical devices apart by serial
+		sprintf(buffer, "%06d", 123456 + devn);
 		return 0;
 	}
 	strcpy(buffer, "");
@@ -195,38 +211,54 @@ static int urb_splitter(struct UsbThing *ctx, int devn, int ep, void *data, int
 		max_packet = len;
 	}
 
-	static uint32_t last_length = 0;
-	if (last_length == 0) {
-		vcam_read(get_cam(ctx, devn), ep, data, 4);
-		ptp_read_u32(data, &last_length);
-		int max = (int)last_length;
+	struct Device *dev = get_dev(ctx, devn);
+	if (dev->last_length == 0) {
+		vcam_read(dev->cam, ep, data, 4);
+		ptp_read_u32(data, &dev->last_length);
+		int max = (int)dev->last_length;
 		if (max > max_packet) max = max_packet;
 		if (max > len) max = len;
-		vcam_read(get_cam(ctx, devn), ep, ((unsigned char *)data) + 4, max - 4);
-		last_length -= (uint32_t)max;
+		vcam_read(dev->cam, ep, ((unsigned char *)data) + 4, max - 4);
+		dev->last_length -= (uint32_t)max;
 		return max;
 	} else {
-		uint32_t max = last_length;
+		uint32_t max = dev->last_length;
 		if (max > max_packet) max = max_packet;
 		if (max > len) max = len;
-		vcam_read(get_cam(ctx, devn), ep, data, (int)max);
-		last_length -= max;
+		vcam_read(dev->cam, ep, data, (int)max);
+		dev->last_length -= max;
 		return (int)max;
 	}
 }
 
 static int handle_bulk(struct UsbThing *ctx, int devn, int ep, void *data, int len) {
+	vcam *cam = get_cam(ctx, devn);
 	if (ep == 0x2) {
 		vcam_log("Passing h->d to vcam %d", len);
-		return vcam_write(get_cam(ctx, devn), ep, (const unsigned char *)data, len);
+		return vcam_write(cam, ep, (const unsigned char *)data, len);
 	} else if (ep == 0x81) {
+		// The host may submit IN transfers before the command that fills them
+		if (get_dev(ctx, devn)->last_length == 0 && vcam_read_pending(cam) < 4)
+			return -1;
 		int rc = urb_splitter(ctx, devn, ep, data, len);
 		vcam_log("Reading bulk d->h to vcam (%d)", rc);
 		return rc;
 		//return vcam_read(get_cam(ctx, devn), ep, (unsigned char *)data, len);
 	} else if (ep == 0x83) {
-		// Don't respond to interrupt polling
-		return -1;
+		// Fuji hands out events through property D212 instead
+		if (cam->vendor_id == USB_VENDOR_FUJI) return -1;
+		int64_t due = vcam_next_event_due(cam);
+		if (due < 0) return -1;
+		int rc = vcam_readint(cam, (unsigned char *)data, len, 0);
+		if (rc < 0) return -1;
+		// Time from the trigger time to the transfer being handed to the backend
+		struct Device *dev = get_dev(ctx, devn);
+		uint64_t late = now_us() - (uint64_t)due;
+		dev->events++;
+		dev->event_late_total += late;
+		if (late > dev->event_late_max) dev->event_late_max = late;
+		vcam_log("Sending event on interrupt endpoint (%d), %lu us after its trigger time", rc, (unsigned long)late);
+		return rc;
 	} else {
 		vcam_log("Illegal endpoint 0x%x", ep);
 		abort();
@@ -234,13 +266,49 @@ static int handle_bulk(struct UsbThing *ctx, int devn, int ep, void *data, int l
 	return 0;
 }
 
+// OUT transfers are received straight into the camera's queue
+static int get_bulk_out_iov(struct UsbThing *ctx, int devn, int ep, struct iovec iov[2], int len) {
+	if (ep != 0x2) {
+		vcam_log("Illegal endpoint 0x%x", ep);
+		abort();
+	}
+	return vcam_write_iov(get_cam(ctx, devn), iov, len);
+}
+
+static int handle_bulk_out_done(struct UsbThing *ctx, int devn, int ep, int len) {
+	(void)ep;
+	vcam_log("Passing h->d to vcam %d", len);
+	return vcam_write_commit(get_cam(ctx, devn), len);
+}
+
+// Only events come in without the host asking, the interrupt endpoint has data once the next one is due
+static int64_t get_in_wakeup(struct UsbThing *ctx, int devn) {
+	vcam *cam = get_cam(ctx, devn);
+	if (cam->vendor_id == USB_VENDOR_FUJI) return -1;
+	int64_t due = vcam_next_event_due(cam);
+	if (due < 0) return -1;
+	int64_t now = (int64_t)now_us();
+	return due > now ? due - now : 0;
+}
+
+// Files dropped on the card turn into ObjectAdded/ObjectRemoved events
+static int get_wakeup_fd(struct UsbThing *ctx, int devn) {
+	return vcam_fs_watch_fd(get_cam(ctx, devn));
+}
+
+static void handle_wakeup_fd(struct UsbThing *ctx, int devn) {
+	vcam_poll_fs(get_cam(ctx, devn));
+}
+
 void usbt_user_init(struct UsbThing *ctx) {
 	// Add devices for libusb mode
 	if (ctx->n_devices == 0) {
 		ctx->priv_impl = malloc(sizeof(struct Priv));
 		struct Priv *priv = (struct Priv *)ctx->priv_impl;
-		priv->cam[0] = vcam_new("canon_1300d");
-		priv->cam[1] = vcam_fuji_new("fuji_x_h1", "--rawconv");
+		priv->devs = calloc(2, sizeof(struct Device));
+		if (priv->devs == NULL) abort();
+		priv->devs[0].cam = vcam_new("canon_1300d");
+		priv->devs[1].cam = vcam_fuji_new("fuji_x_h1", "--rawconv");
 		ctx->n_devices = 2;
 	}
 	ctx->get_string_descriptor = usb_get_string;
@@ -252,23 +320,42 @@ void usbt_user_init(struct UsbThing *ctx) {
 
 	ctx->handle_control_request = handle_control;
 	ctx->handle_bulk_transfer = handle_bulk;
+	ctx->get_bulk_out_iov = get_bulk_out_iov;
+	ctx->handle_bulk_out_done = handle_bulk_out_done;
+	ctx->get_in_wakeup = get_in_wakeup;
+	ctx->get_wakeup_fd = get_wakeup_fd;
+	ctx->handle_wakeup_fd = handle_wakeup_fd;
 }
 
-// TODO: This function will eventually be able to accept more than one camera
-// Or have an argument parser that accepts multiple cameras
-int vcam_start_usbthing(vcam *cam, enum CamBackendType backend) {
+int vcam_start_usbthing_multi(vcam **cams, int n, enum CamBackendType backend) {
 	struct UsbThing ctx;
 
 	struct Priv priv;
 	usbt_init(&ctx);
-	priv.cam[0] = cam;
+	priv.devs = calloc((size_t)n, sizeof(struct Device));
+	if (priv.devs == NULL) abort();
+	for (int i = 0; i < n; i++)
+		priv.devs[i].cam = cams[i];
 	ctx.priv_impl = (void *)&priv;
-	ctx.n_devices = 1;
+	ctx.n_devices = n;
 
 	usbt_user_init(&ctx);
+	int rc = 0;
 	if (backend == VCAM_VHCI) {
-		return usbt_vhci_init(&ctx);
+		rc = usbt_vhci_init(&ctx);
 	}
 
-	return 0;
+	for (int i = 0; i < n; i++) {
+		struct Device *dev = &priv.devs[i];
+		if (dev->events == 0) continue;
+		vcam_log("USB: device %d, %lu events, sent on average %lu us, at most %lu us after their trigger time", i,
+			dev->events, (unsigned long)(dev->event_late_total / dev->events), (unsigned long)dev->event_late_max);
+	}
+
+	free(priv.devs);
+	return rc;
+}
+
+int vcam_start_usbthing(vcam *cam, enum CamBackendType backend) {
+	return vcam_start_usbthing_multi(&cam, 1, backend);
 }
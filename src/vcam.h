@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <ptp.h>
+#include "bulk.h"
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -26,6 +27,9 @@ void vcam_log_func(const char *func, const char *format, ...);
 void vcam_log(const char *format, ...);
 void vcam_panic(const char *format, ...);
 
+/// @brief CLOCK_MONOTONIC time in microseconds, the clock event trigger times and timers are kept in
+uint64_t now_us(void);
+
 typedef struct ptpcontainer {
 	unsigned int size;
 	unsigned int type;
@@ -35,6 +39,73 @@ typedef struct ptpcontainer {
 	unsigned int params[6];
 }ptpcontainer;
 
+/// @brief Index of the object list by handle
+struct PtpObjectIndex {
+	/// @brief Number of objects in the list
+	int length;
+	/// @brief Open addressing (linear probing) index from object handle to dirent, 1 << bits entries
+	struct ptp_dirent **slots;
+	int bits;
+	int used;
+
+	/// @brief Set once the card has been opened (the root folder is read)
+	int loaded;
+	/// @brief Folders whose children haven't been read yet, in the order they were found (breadth first)
+	/// They are read in this order, so a card gets the same handles whichever folder is listed first
+	struct ptp_dirent *scan_head;
+	struct ptp_dirent *scan_tail;
+};
+
+/// @brief A pending interrupt, the event container is only built when it's delivered
+struct PtpEventNode {
+	/// @brief CLOCK_MONOTONIC trigger time in microseconds
+	uint64_t due;
+	/// @brief Insertion order, events with the same trigger time are delivered FIFO
+	uint64_t seq;
+	/// @brief CLOCK_MONOTONIC time the event was queued, start of its coalescing window
+	uint64_t queued;
+	uint16_t code;
+	uint32_t param1;
+	uint32_t transid;
+	/// @brief Next free node + 1, 0 for the end of the free list
+	int next_free;
+};
+
+/// @brief A pending property change that later changes of the same property are merged into
+struct PtpEventPending {
+	uint16_t code;
+	/// @brief Property code for PTP_EC_DevicePropChanged, 0 if the event code is the property code
+	uint32_t prop;
+	int node;
+};
+
+/// @brief Pending interrupts, binary min-heap of pooled nodes ordered by trigger time
+/// @note A zeroed struct is a valid empty queue with coalescing disabled
+struct PtpEventQueue {
+	/// @brief Node pool, nodes are recycled through the free list
+	struct PtpEventNode *nodes;
+	int capacity;
+	/// @brief Number of nodes handed out from the pool so far
+	int allocated;
+	/// @brief First free node + 1, 0 if the free list is empty
+	int free;
+	/// @brief Node indexes, heap ordered
+	int *heap;
+	int length;
+	uint64_t seq;
+
+	/// @brief Property changes queued within this many milliseconds of a pending change of the same
+	/// property replace its value instead of queuing another event, 0 to disable (--coalesce <ms>)
+	int coalesce_window;
+	struct PtpEventPending *pending;
+	int pending_length;
+	int pending_capacity;
+	/// @brief Number of events merged into a pending one
+	unsigned long merged;
+	/// @brief Number of events handed to the client
+	unsigned long delivered;
+};
+
 // All members are guaranteed to be zero by calloc()
 typedef struct vcam {
 	/// @brief Priv pointer for device-specific PTP code
@@ -61,22 +132,62 @@ typedef struct vcam {
 
 	/// @brief Optional PID of parent process, will signal it once PTP/IP is listening for connections
 	pid_t sig;
+	/// @brief PTP/IP initiators served at once (--sessions <n>), by default the server exits once the first one disconnects
+	int max_sessions;
+	/// @brief Serve PTP/IP with io_uring instead of epoll if the kernel supports it (--io-uring)
+	int io_uring;
+	/// @brief Max payload bytes in each PTP/IP data packet, 0 for the default of 64 KiB (--data-chunk <KiB>)
+	uint32_t data_chunk;
+	/// @brief Size of generated liveview frames, 0 to send the stock frames instead (--lv-synth <w>x<h>)
+	int lv_width;
+	int lv_height;
+	/// @brief JPEG quality of generated liveview frames, 1-100 (--lv-quality <q>)
+	int lv_quality;
+	/// @brief Liveview frames per second, 0 for the vendor's default (--lv-fps <n>)
+	int lv_fps;
+
+	/// @brief Model name and flags the camera was set up with, see vcam_new_session
+	const char *model_name;
+	int model_argc;
+	const char **model_argv;
 
 	FILE *comm_dump;
 
-	struct ptp_interrupt *first_interrupt;
+	/// @brief Events waiting for the interrupt endpoint or an event poll
+	struct PtpEventQueue events;
+	/// @brief All objects, most recently added first
 	struct ptp_dirent *first_dirent;
+	struct PtpObjectIndex objects;
+	/// @brief Object whose file is kept open by vcam_open_object, NULL if none
+	struct ptp_dirent *open_object;
+	int open_object_fd;
 
-	/// @note Internal counter for object list builder
+	/// @brief Next object handle, only given out by vcam_next_object_id
 	uint32_t ptp_objectid;
 
 	/// @brief Path to folder to scan for object list
 	const char *vcamera_filesystem;
-
-	unsigned char *inbulk;
-	int	nrinbulk;
-	unsigned char *outbulk;
-	int	nroutbulk;
+	/// @brief inotify descriptor watching the scanned folders, -1 if not open
+	int fs_watch_fd;
+	/// @brief Scanned folder for each watch descriptor
+	struct ptp_dirent **fs_watches;
+	int fs_watches_length;
+
+	/// @brief Bytes queued for the initiator (R->I)
+	struct VcamBulkQueue inbulk;
+	/// @brief Max bytes of an object file buffered at once while it is sent, 0 for VCAM_IO_WINDOW (--io-window <KiB>)
+	size_t io_window;
+	/// @brief Bytes received from the initiator that haven't been processed yet (I->R)
+	struct VcamRing outbulk;
+	/// @brief Reused for building data phase payloads, see vcam_scratch
+	unsigned char *scratch;
+	size_t scratch_size;
+	/// @brief Opcode whose data phase is being streamed to its data_chunk handler, 0 if none
+	int data_stream_code;
+	/// @brief Payload bytes of the streamed data phase that haven't arrived yet
+	uint32_t data_stream_left;
+	/// @brief Set when data_begin refused the data phase, the rest of it is dropped
+	int data_stream_drop;
 	unsigned int seqnr;
 	unsigned int session;
 	ptpcontainer ptpcmd;
@@ -99,19 +210,53 @@ typedef struct vcam {
 /// @brief Initialize vcam with standard properties and opcodes
 vcam *vcam_init_standard(void);
 
+/// @brief Free the buffers, objects and handlers owned by the camera
+int vcam_close(vcam *cam);
+
 /// @brief Invoke main command line interpreter
 int vcam_main(vcam *cam, const char *name, enum CamBackendType backend, int argc, const char **argv);
 
+/// @brief Set up cam as the named model and parse its flags, without starting a backend
+/// @returns 0 on success, -1 if the model is unknown
+int vcam_init_model(vcam *cam, const char *name, int argc, const char **argv);
+
+/// @brief Create another camera of the same model and flags as cam, for a concurrent session
+/// The COMM_DUMP file, --ip address and --sig pid are cam's, only vcam_close it and free priv and the camera itself
+/// @returns NULL on failure
+vcam *vcam_new_session(vcam *cam);
+
+/// @brief Run every camera listed in a config file from one process
+/// Each line is '<model> <backend> [flags...]', # starts a comment
+int vcam_run_config(const char *path);
+
 /// @brief Calls vcam_init_standard and inits camera from name
 vcam *vcam_new(const char *name);
 
 /// @brief Called by variant CLI parser to handle generic vcam parameters
+/// @returns 1 if argv[*i] was one (*i is left on its value, if it takes one), 0 if not, -1 if its value is missing
 int vcam_parse_args(vcam *cam, int argc, const char **argv, int *i);
 
 /// @brief Read bytes from internal buffer (R->I)
 int vcam_read(vcam *cam, int ep, unsigned char *data, int bytes);
+/// @brief Copy bytes from internal buffer (R->I) without consuming them
+int vcam_peek(vcam *cam, unsigned char *data, int bytes);
+/// @brief Number of bytes waiting to be read (R->I)
+int vcam_read_pending(vcam *cam);
+/// @brief Describe up to `bytes` queued bytes (R->I) as iovecs for writev/sendmsg, consume them with vcam_read_consume
+/// @returns number of iovecs filled
+int vcam_read_iov(vcam *cam, struct iovec *iov, int max_iov, int bytes);
+/// @brief Get the next queued bytes (R->I) without copying them, at most VCAM_RING_STEP bytes
+/// @returns number of bytes available at *data, 0 if nothing is queued
+int vcam_read_peek(vcam *cam, const unsigned char **data);
+/// @brief Drop bytes returned by vcam_read_peek/vcam_read_iov once they have been sent
+void vcam_read_consume(vcam *cam, int bytes);
 /// @brief Write bytes into internal buffer for processing (I->R)
 int vcam_write(vcam *cam, int ep, const unsigned char *data, int bytes);
+/// @brief Describe room for `bytes` more bytes (I->R) as iovecs, for recvmsg to fill in place before vcam_write_commit
+/// @returns number of iovecs filled, at most 2
+int vcam_write_iov(vcam *cam, struct iovec iov[2], int bytes);
+/// @brief Process bytes received into the room from vcam_write_iov, like vcam_write
+int vcam_write_commit(vcam *cam, int bytes);
 /// @brief Poll interrupt endpoint
 int vcam_readint(vcam *cam, unsigned char *data, int bytes, int timeout);
 
@@ -119,11 +264,29 @@ int vcam_readint(vcam *cam, unsigned char *data, int bytes, int timeout);
 /// If the opcode is already registered, the old handlers will be replaced
 int vcam_register_opcode(vcam *cam, int code, int (*write)(vcam *cam, ptpcontainer *ptp), int (*write_data)(vcam *cam, ptpcontainer *ptp, unsigned char *data, unsigned int size));
 
-/// @brief
+/// @brief Register an opcode whose data phase is handed over in chunks as it arrives, instead of in one buffer
+/// begin gets the payload size, chunk is called for every received piece, end must send the response.
+/// begin returns 0 if it has already sent an error response, the data phase is then dropped without calling chunk or end.
+/// @note begin and end may be NULL. The ptpcontainer passed to them is the command phase.
+int vcam_register_opcode_stream(vcam *cam, int code, int (*write)(vcam *cam, ptpcontainer *ptp),
+	int (*data_begin)(vcam *cam, ptpcontainer *ptp, unsigned int size),
+	int (*data_chunk)(vcam *cam, ptpcontainer *ptp, const unsigned char *data, unsigned int size),
+	int (*data_end)(vcam *cam, ptpcontainer *ptp));
+
+/// @brief Find the handlers for an opcode in O(1)
+/// @returns NULL if the opcode isn't registered
+struct PtpOpcode *vcam_get_opcode(vcam *cam, int code);
+
+/// @brief Attach a camera to a usbthing backend and serve it until it's detached
 int vcam_start_usbthing(vcam *cam, enum CamBackendType backend);
+/// @brief Attach n cameras as separate devices of one usbthing backend, all served from one loop
+int vcam_start_usbthing_multi(vcam **cams, int n, enum CamBackendType backend);
 
 int get_local_ip(char buffer[64]);
 
+/// @brief Number of objects, not counting the root
+int vcam_get_object_count(vcam *cam);
+
 __attribute__((deprecated))
 int ptp_get_object_count(vcam *cam);
 
@@ -133,15 +296,42 @@ int vcam_generic_send_file(char *path, vcam *cam, int file_of, ptpcontainer *ptp
 /// @brief Send a data packet to initiator
 void ptp_senddata(vcam *cam, uint16_t code, unsigned char *data, int bytes);
 
+/// @brief Send a data packet without copying the payload
+/// @param release Called once the payload has been read out, NULL if data outlives the transfer
+void ptp_senddata_ref(vcam *cam, uint16_t code, void *data, int bytes, vcam_seg_release *release, void *arg);
+
+/// @brief Queue the header of a data packet with a payload of `bytes`, which must be followed
+/// by ptp_data_add/ptp_data_add_ref calls adding up to exactly `bytes`
+void ptp_data_start(vcam *cam, uint16_t code, int bytes);
+/// @brief Copy part of a data phase payload into the queue
+void ptp_data_add(vcam *cam, const void *data, int bytes);
+/// @brief Reference part of a data phase payload, see ptp_senddata_ref
+void ptp_data_add_ref(vcam *cam, void *data, int bytes, vcam_seg_release *release, void *arg);
+/// @brief Add part of a file to a data phase, it is read in windows of cam->io_window as it is sent
+/// @note Takes ownership of fd
+void ptp_data_add_file(vcam *cam, int fd, off_t offset, int bytes);
+/// @brief Buffer owned by the camera to build a data phase payload in, at least size bytes
+/// @note Valid until the next call, ptp_senddata copies out of it so it can be reused right away
+unsigned char *vcam_scratch(vcam *cam, size_t size);
+
 /// @brief Send a response packet to initiator
 void ptp_response(vcam *cam, uint16_t code, int nparams, ...);
 
 struct PtpOpcodeList {
 	int length;
+	/// @brief Number of handler slots allocated after this struct
+	int capacity;
+	/// @brief Dispatch table, split by the high byte of the opcode (0x10, 0x91, ...) then the low byte
+	/// @note Holds index into handlers + 1, 0 if the opcode isn't registered. Pages are allocated on demand.
+	uint16_t *pages[256];
 	struct PtpOpcode {
 		int code;
 		int (*write)(vcam *cam, ptpcontainer *ptp);
 		int (*write_data)(vcam *cam, ptpcontainer *ptp, unsigned char *data, unsigned int size);
+		/// @brief Streaming data phase, see vcam_register_opcode_stream. Used instead of write_data if data_chunk is set.
+		int (*data_begin)(vcam *cam, ptpcontainer *ptp, unsigned int size);
+		int (*data_chunk)(vcam *cam, ptpcontainer *ptp, const unsigned char *data, unsigned int size);
+		int (*data_end)(vcam *cam, ptpcontainer *ptp);
 	}handlers[];
 };
 
@@ -217,20 +407,29 @@ typedef int ptp_prop_getvalue(vcam *cam, struct PtpPropDesc *desc, int *optional
 /// @note Implementation must assume data length from data type
 typedef int ptp_prop_setvalue(vcam *cam, struct PtpPropDesc *desc, const void *data);
 
-struct PtpPropList {
-	int length;
-	struct PtpProp {
-		int code;
+struct PtpProp {
+	int code;
 
-		/// @note may be NULL
-		ptp_prop_getdesc *getdesc;
-		/// @note may be NULL
-		ptp_prop_getvalue *getvalue;
-		/// @note may be NULL
-		ptp_prop_setvalue *setvalue;
+	/// @note may be NULL
+	ptp_prop_getdesc *getdesc;
+	/// @note may be NULL
+	ptp_prop_getvalue *getvalue;
+	/// @note may be NULL
+	ptp_prop_setvalue *setvalue;
 
-		struct PtpPropDesc desc;
-	}handlers[];
+	struct PtpPropDesc desc;
+};
+
+struct PtpPropList {
+	int length;
+	int capacity;
+	/// @brief Registered props in registration order
+	/// @note Each prop is allocated once, so pointers stay valid across later registrations
+	struct PtpProp **handlers;
+
+	/// @brief Open addressing (linear probing) index from prop code to prop, 1 << index_bits entries
+	struct PtpProp **index;
+	int index_bits;
 };
 
 /// @brief Register a property with handlers
@@ -241,6 +440,10 @@ int vcam_register_prop_handlers(vcam *cam, int code, struct PtpPropDesc *desc, p
 /// @brief Register a property from description struct
 int vcam_register_prop(vcam *cam, int code, struct PtpPropDesc *desc);
 
+/// @brief Find a registered prop by code
+/// @returns NULL if not registered
+struct PtpProp *vcam_get_prop(vcam *cam, int code);
+
 /// Return the property description for a prop
 /// @note This does not allocate memory, it returns data from a runtime list
 struct PtpPropDesc *vcam_get_prop_desc(vcam *cam, int code);
@@ -270,6 +473,17 @@ int vcam_check_session(vcam *cam);
 int vcam_check_trans_id(vcam *cam, ptpcontainer *ptp);
 int vcam_check_param_count(vcam *cam, ptpcontainer *ptp, int n);
 
+/// @brief Identifies the file contents a cached value was derived from
+struct ptp_filekey {
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+};
+
+/// @brief Check if st describes the same file contents as key
+int vcam_filekey_matches(const struct ptp_filekey *key, const struct stat *st);
+void vcam_filekey_set(struct ptp_filekey *key, const struct stat *st);
+
 struct ptp_dirent {
 	uint32_t id;
 	char *name;
@@ -277,14 +491,70 @@ struct ptp_dirent {
 	struct stat stbuf;
 	struct ptp_dirent *parent;
 	struct ptp_dirent *next;
+	struct ptp_dirent *prev;
+
+	/// @brief Set once the children of a folder have been read from the filesystem
+	int scanned;
+	/// @brief inotify watch descriptor of a scanned folder, 0 if not watched
+	int wd;
+	/// @brief Next folder in the scan queue, see PtpObjectIndex.scan_head
+	struct ptp_dirent *scan_next;
+
+	/// @brief Cached ObjectInfo dataset, NULL until first requested
+	unsigned char *info;
+	int info_length;
+	/// @brief File and parent the cached dataset was built from
+	struct ptp_filekey info_key;
+	uint32_t info_parent;
+
+	/// @brief Cached location of the EXIF thumbnail in the file, see vcam_find_thumb
+	enum { THUMB_UNKNOWN, THUMB_FOUND, THUMB_NONE } thumb_state;
+	struct ptp_filekey thumb_key;
+	off_t thumb_offset;
+	uint32_t thumb_length;
+
+	/// @brief Objects directly inside this one, in the order they were added
+	struct ptp_dirent **children;
+	int nchildren;
+	int children_capacity;
 };
 
-struct ptp_interrupt {
-	unsigned char *data;
-	int size;
-	struct timeval triggertime;
-	struct ptp_interrupt *next;
-};
+/// @brief Add a dirent (allocated with calloc) to the front of first_dirent, under parent (may be NULL for the root)
+void vcam_add_object(vcam *cam, struct ptp_dirent *ent, struct ptp_dirent *parent);
+/// @brief Take a handle for a new object, scanned, watched and captured objects all number from here
+uint32_t vcam_next_object_id(vcam *cam);
+/// @brief Find an object by handle in O(1)
+/// If the handle hasn't been given out yet, queued folders are read until it shows up,
+/// unless it is above what the rest of the card could possibly hold
+/// @returns NULL if there is no such object
+struct ptp_dirent *vcam_get_object(vcam *cam, uint32_t id);
+/// @brief Get the root folder of the card, opening the card on first use
+struct ptp_dirent *vcam_get_root(vcam *cam);
+/// @brief Read the children of a folder if that hasn't been done yet, after the folders queued before it
+void vcam_scan_dir(vcam *cam, struct ptp_dirent *dir);
+/// @brief Read every folder on the card
+void vcam_scan_all(vcam *cam);
+/// @brief Apply changes to the card folders and queue ObjectAdded/ObjectRemoved events, doesn't block
+void vcam_poll_fs(vcam *cam);
+/// @brief Descriptor that becomes readable when a watched card folder changes, call vcam_poll_fs then
+/// Opened on first call, -1 if inotify isn't available
+int vcam_fs_watch_fd(vcam *cam);
+/// @brief Change the handle of an object, it shadows any other object that had the same handle
+void vcam_set_object_id(vcam *cam, struct ptp_dirent *ent, uint32_t id);
+/// @brief Remove an object from the object list and index, without freeing it
+void vcam_unlink_object(vcam *cam, struct ptp_dirent *ent);
+/// @brief Free all objects and reset the index
+void vcam_free_objects(vcam *cam);
+/// @brief Find a direct child by name
+struct ptp_dirent *vcam_find_child(struct ptp_dirent *parent, const char *name);
+/// @brief Find the EXIF (IFD1) thumbnail of a JPEG object without reading the whole file
+/// Only the marker segments up to APP1 are read, the result is cached until cur->stbuf changes
+/// @returns 0 and the byte range of the thumbnail in the file, -1 if there is none
+int vcam_find_thumb(struct ptp_dirent *cur, off_t *offset, uint32_t *length);
+/// @brief Open an object's file for a data phase
+/// The last opened object stays open, so chunked GetPartialObject reads don't reopen it every time
+/// @returns a new descriptor owned by the caller, -1 on error
+int vcam_open_object(vcam *cam, struct ptp_dirent *ent);
 
 void vcam_dump(void *ptr, size_t len);
 
@@ -292,11 +562,14 @@ void ptp_free_devicepropdesc(struct PtpPropDesc *dpd);
 
 void *read_file(struct ptp_dirent *cur);
 void free_dirent(struct ptp_dirent *ent);
+/// @brief Open the card at path, only the root folder is read
+void read_tree(vcam *cam, const char *path);
 
 // Deletes the first object from the list
 void vcam_virtual_pop_object(int id);
 
 /// @brief Inject an interrupt into the general purpose event list
+/// @param when Delay in milliseconds, events with the same trigger time are delivered in order
 int ptp_inject_interrupt(vcam *cam, int when, uint16_t code, int nparams, uint32_t param1, uint32_t transid);
 
 struct GenericEvent {
@@ -307,12 +580,20 @@ struct GenericEvent {
 	uint32_t value;
 };
 
-/// @brief Shortcut for ptp_inject_interrupt
+/// @brief Shortcut for ptp_inject_interrupt, queues a property change where code is the property code
+/// @note With --coalesce, a change of a property that is still pending only updates its value
 int ptp_notify_event(vcam *cam, uint16_t code, uint32_t value);
 
-/// @brief Pop event from the interrupt list, FIFO
+/// @brief Free the event list, logs the coalescing counters if it was enabled
+void vcam_free_events(vcam *cam);
+
+/// @brief Pop the next event from the interrupt list, whether its trigger time has passed or not
+/// @returns 0 if an event was popped, 1 if the list is empty
 int ptp_pop_event(vcam *cam, struct GenericEvent *ev);
 
+/// @brief Trigger time of the next event in now_us() microseconds, -1 if the list is empty
+int64_t vcam_next_event_due(vcam *cam);
+
 void fuji_register_opcodes(vcam *cam);
 int fuji_init_cam(vcam *cam, const char *name, int argc, const char **argv);
 vcam *vcam_fuji_new(const char *name, const char *arg);
@@ -320,6 +601,8 @@ int canon_init_cam(vcam *cam, const char *name, int argc, const char **argv);
 
 int fuji_wifi_main(vcam *cam);
 int ptpip_generic_main(vcam *cam);
+/// @brief Serve n standard PTP/IP cameras from one reactor, each one listens on the PTP/IP port of its --ip address
+int ptpip_generic_multi(vcam **cams, int n);
 
 #include "data.h"
 #include "socket.h"
@@ -4,13 +4,12 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
-#include <dirent.h>
+#include <unistd.h>
 #include <usbthing.h>
 #include "vcam.h"
 
@@ -50,95 +49,147 @@ int vcam_check_param_count(vcam *cam, ptpcontainer *ptp, int n) {
 int vcam_generic_send_file(char *path, vcam *cam, int file_of, ptpcontainer *ptp) {
 	char new[64];
 	sprintf(new, "%s/%s", PWD, path);
-	FILE *file = fopen(new, "rb");
-	if (file == NULL) {
+	int fd = open(new, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
 		vcam_panic("vcam_generic_send_file: File %s not found", path);
 	}
 
-	fseek(file, 0, SEEK_END);
-	long file_size = ftell(file);
-	fseek(file, file_of, SEEK_SET);
+	int size = (int)st.st_size - file_of;
+	if (size < 0) size = 0;
 
-	char *buffer = malloc(file_size);
-	fread(buffer, 1, file_size, file);
-
-	ptp_senddata(cam, ptp->code, (unsigned char *)buffer, file_size);
-	free(buffer);
-	vcam_log("Generic sending %d", file_size);
-
-	fclose(file);
+	// The file is read as the data phase goes out
+	ptp_data_start(cam, ptp->code, size);
+	ptp_data_add_file(cam, fd, file_of, size);
+	vcam_log("Generic sending %d", size);
 
 	return 0;
 }
 
+struct PtpOpcode *vcam_get_opcode(vcam *cam, int code) {
+	uint16_t *page = cam->opcodes->pages[(code >> 8) & 0xff];
+	if (page == NULL || page[code & 0xff] == 0) return NULL;
+	return &cam->opcodes->handlers[page[code & 0xff] - 1];
+}
+
 int vcam_register_opcode(vcam *cam, int code, int (*write)(vcam *cam, ptpcontainer *ptp), int (*write_data)(vcam *cam, ptpcontainer *ptp, unsigned char *data, unsigned int size)) {
-	for (int i = 0; i < cam->opcodes->length; i++) {
-		struct PtpOpcode *c = &cam->opcodes->handlers[i];
-		if (c->code == code) {
-			c->write = write;
-			c->write_data = write_data;
-			return 0;
-		}
+	struct PtpOpcode *c = vcam_get_opcode(cam, code);
+	if (c != NULL) {
+		c->write = write;
+		c->write_data = write_data;
+		c->data_begin = NULL;
+		c->data_chunk = NULL;
+		c->data_end = NULL;
+		return 0;
 	}
 
-	cam->opcodes = realloc(cam->opcodes, sizeof(struct PtpOpcodeList) + (sizeof(struct PtpOpcode) * (cam->opcodes->length + 1)));
+	if (cam->opcodes->length == cam->opcodes->capacity) {
+		int capacity = cam->opcodes->capacity ? cam->opcodes->capacity * 2 : 64;
+		cam->opcodes = realloc(cam->opcodes, sizeof(struct PtpOpcodeList) + (sizeof(struct PtpOpcode) * capacity));
+		if (cam->opcodes == NULL) abort();
+		cam->opcodes->capacity = capacity;
+	}
+
+	uint16_t **page = &cam->opcodes->pages[(code >> 8) & 0xff];
+	if (*page == NULL) {
+		*page = calloc(256, sizeof(uint16_t));
+		if (*page == NULL) abort();
+	}
 
-	struct PtpOpcode *c = &cam->opcodes->handlers[cam->opcodes->length];
+	c = &cam->opcodes->handlers[cam->opcodes->length];
 	memset(c, 0, sizeof(struct PtpOpcode));
 	c->code = code;
 	c->write = write;
 	c->write_data = write_data;
 
 	cam->opcodes->length += 1;
+	(*page)[code & 0xff] = (uint16_t)cam->opcodes->length;
 	return 0;
 }
 
-// TODO: Add a 'void *param' parameter that will be passed to handlers
-int vcam_register_prop_handlers(vcam *cam, int code, struct PtpPropDesc *desc, ptp_prop_getvalue *getvalue, ptp_prop_setvalue *setvalue) {
-	cam->props = realloc(cam->props, sizeof(struct PtpPropList) + (sizeof(struct PtpProp) * (cam->props->length + 1)));
+int vcam_register_opcode_stream(vcam *cam, int code, int (*write)(vcam *cam, ptpcontainer *ptp),
+	int (*data_begin)(vcam *cam, ptpcontainer *ptp, unsigned int size),
+	int (*data_chunk)(vcam *cam, ptpcontainer *ptp, const unsigned char *data, unsigned int size),
+	int (*data_end)(vcam *cam, ptpcontainer *ptp)) {
+	vcam_register_opcode(cam, code, write, NULL);
+	struct PtpOpcode *c = vcam_get_opcode(cam, code);
+	c->data_begin = data_begin;
+	c->data_chunk = data_chunk;
+	c->data_end = data_end;
+	return 0;
+}
 
-	struct PtpProp *prop = &cam->props->handlers[cam->props->length];
-	memset(prop, 0, sizeof(struct PtpProp));
-	prop->code = code;
-	memcpy(&prop->desc, desc, sizeof(struct PtpPropDesc));
-	prop->getvalue = getvalue;
-	prop->setvalue = setvalue;
+static inline uint32_t prop_hash(int code, int bits) {
+	return ((uint32_t)code * 2654435761u) >> (32 - bits);
+}
 
-	cam->props->length += 1;
-	return 0;
+struct PtpProp *vcam_get_prop(vcam *cam, int code) {
+	struct PtpPropList *list = cam->props;
+	if (list->index == NULL) return NULL;
+	uint32_t mask = (1u << list->index_bits) - 1;
+	for (uint32_t i = prop_hash(code, list->index_bits);; i = (i + 1) & mask) {
+		struct PtpProp *prop = list->index[i];
+		if (prop == NULL) return NULL;
+		if (prop->code == code) return prop;
+	}
 }
 
-int vcam_register_prop(vcam *cam, int code, struct PtpPropDesc *desc) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
+static void prop_index_insert(struct PtpPropList *list, struct PtpProp *prop) {
+	uint32_t mask = (1u << list->index_bits) - 1;
+	uint32_t i = prop_hash(prop->code, list->index_bits);
+	while (list->index[i] != NULL)
+		i = (i + 1) & mask;
+	list->index[i] = prop;
+}
+
+// Returns the existing slot for code, or a zeroed new one appended to the list
+static struct PtpProp *prop_get_slot(vcam *cam, int code) {
+	struct PtpPropList *list = cam->props;
+	struct PtpProp *prop = vcam_get_prop(cam, code);
+	if (prop != NULL) return prop;
+
+	if (list->length == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->handlers = realloc(list->handlers, sizeof(struct PtpProp *) * list->capacity);
+		if (list->handlers == NULL) abort();
 	}
-	if (prop == NULL) {
-		cam->props = realloc(cam->props, sizeof(struct PtpPropList) + (sizeof(struct PtpProp) * (cam->props->length + 1)));
-		prop = &cam->props->handlers[cam->props->length];
+
+	// Keep the index at most half full
+	if ((list->length + 1) * 2 > (1 << list->index_bits)) {
+		free(list->index);
+		list->index_bits = list->index_bits ? list->index_bits + 1 : 7;
+		list->index = calloc(1 << list->index_bits, sizeof(struct PtpProp *));
+		if (list->index == NULL) abort();
+		for (int i = 0; i < list->length; i++)
+			prop_index_insert(list, list->handlers[i]);
 	}
 
-	memset(prop, 0, sizeof(struct PtpProp));
+	prop = calloc(1, sizeof(struct PtpProp));
+	if (prop == NULL) abort();
 	prop->code = code;
-	prop->getdesc = NULL;
-	prop->getvalue = NULL;
-	prop->setvalue = NULL;
+	list->handlers[list->length] = prop;
+	list->length += 1;
+	prop_index_insert(list, prop);
+	return prop;
+}
 
+// TODO: Add a 'void *param' parameter that will be passed to handlers
+int vcam_register_prop_handlers(vcam *cam, int code, struct PtpPropDesc *desc, ptp_prop_getvalue *getvalue, ptp_prop_setvalue *setvalue) {
+	struct PtpProp *prop = prop_get_slot(cam, code);
+	memset(prop, 0, sizeof(struct PtpProp));
+	prop->code = code;
 	memcpy(&prop->desc, desc, sizeof(struct PtpPropDesc));
-
-	cam->props->length += 1;
+	prop->getvalue = getvalue;
+	prop->setvalue = setvalue;
 	return 0;
 }
 
+int vcam_register_prop(vcam *cam, int code, struct PtpPropDesc *desc) {
+	return vcam_register_prop_handlers(cam, code, desc, NULL, NULL);
+}
+
 int vcam_set_prop_data(vcam *cam, int code, void *data, int length) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
-	}
+	struct PtpProp *prop = vcam_get_prop(cam, code);
 	if (prop == NULL) return -1;
 	if (prop->setvalue) {
 		return prop->setvalue(cam, &prop->desc, data);
@@ -155,12 +206,7 @@ int vcam_set_prop(vcam *cam, int code, uint32_t data) {
 }
 
 int vcam_get_prop_size(vcam *cam, int code) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
-	}
+	struct PtpProp *prop = vcam_get_prop(cam, code);
 	if (prop == NULL) return -1;
 	if (prop->desc.DataType == PTP_TC_UNDEF) {
 		return prop->desc.value_length;
@@ -169,12 +215,7 @@ int vcam_get_prop_size(vcam *cam, int code) {
 }
 
 struct PtpPropDesc *vcam_get_prop_desc(vcam *cam, int code) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
-	}
+	struct PtpProp *prop = vcam_get_prop(cam, code);
 	if (prop == NULL) return NULL;
 	if (prop->getdesc) {
 		prop->getdesc(cam, &prop->desc);
@@ -183,12 +224,7 @@ struct PtpPropDesc *vcam_get_prop_desc(vcam *cam, int code) {
 }
 
 void *vcam_get_prop_data(vcam *cam, int code, int *length) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
-	}
+	struct PtpProp *prop = vcam_get_prop(cam, code);
 	if (prop == NULL) return NULL;
 	int optional_len = -1;
 	if (prop->getvalue) {
@@ -209,12 +245,7 @@ void *vcam_get_prop_data(vcam *cam, int code, int *length) {
 }
 
 int vcam_set_prop_avail(vcam *cam, int code, void *list, int cnt) {
-	struct PtpProp *prop = NULL;
-	for (int i = 0; i < cam->props->length; i++) {
-		prop = &cam->props->handlers[i];
-		if (prop->code == code) break;
-		prop = NULL;
-	}
+	struct PtpProp *prop = vcam_get_prop(cam, code);
 	if (prop == NULL) {
 		vcam_log("WARN: %s %04x prop that doesn't exist", __func__, code);
 		return -1;
@@ -229,48 +260,70 @@ int vcam_set_prop_avail(vcam *cam, int code, void *list, int cnt) {
 	return 0;
 }
 
-void ptp_senddata(vcam *cam, uint16_t code, unsigned char *data, int bytes) {
-	unsigned char *offset;
-	int size = bytes + 12;
+void ptp_data_start(vcam *cam, uint16_t code, int bytes) {
+	unsigned char header[12];
 
-	if (!cam->inbulk) {
-		cam->inbulk = malloc(size);
-	} else {
-		cam->inbulk = realloc(cam->inbulk, cam->nrinbulk + size);
+	put_32bit_le(header, bytes + 12);
+	put_16bit_le(header + 4, 0x2);
+	put_16bit_le(header + 6, code);
+	put_32bit_le(header + 8, cam->seqnr);
+
+	vcam_queue_append(&cam->inbulk, header, sizeof(header));
+}
+
+void ptp_data_add(vcam *cam, const void *data, int bytes) {
+	vcam_queue_append(&cam->inbulk, data, bytes);
+}
+
+void ptp_data_add_ref(vcam *cam, void *data, int bytes, vcam_seg_release *release, void *arg) {
+	vcam_queue_append_ref(&cam->inbulk, data, bytes, release, arg);
+}
+
+void ptp_data_add_file(vcam *cam, int fd, off_t offset, int bytes) {
+	vcam_queue_append_file(&cam->inbulk, fd, offset, bytes, cam->io_window);
+}
+
+unsigned char *vcam_scratch(vcam *cam, size_t size) {
+	if (size > cam->scratch_size) {
+		size_t capacity = cam->scratch_size ? cam->scratch_size : 4096;
+		while (capacity < size) capacity *= 2;
+		free(cam->scratch);
+		cam->scratch = malloc(capacity);
+		if (cam->scratch == NULL) abort();
+		cam->scratch_size = capacity;
 	}
-	offset = cam->inbulk + cam->nrinbulk;
-	cam->nrinbulk += size;
+	return cam->scratch;
+}
+
+void ptp_senddata(vcam *cam, uint16_t code, unsigned char *data, int bytes) {
+	ptp_data_start(cam, code, bytes);
+	ptp_data_add(cam, data, bytes);
+}
 
-	put_32bit_le(offset, size);
-	put_16bit_le(offset + 4, 0x2);
-	put_16bit_le(offset + 6, code);
-	put_32bit_le(offset + 8, cam->seqnr);
-	if (bytes)
-		memcpy(offset + 12, data, bytes);
+void ptp_senddata_ref(vcam *cam, uint16_t code, void *data, int bytes, vcam_seg_release *release, void *arg) {
+	ptp_data_start(cam, code, bytes);
+	ptp_data_add_ref(cam, data, bytes, release, arg);
 }
 
 void ptp_response(vcam *cam, uint16_t code, int nparams, ...) {
-	unsigned char *offset;
+	unsigned char packet[12 + 5 * 4];
 	int i, x = 0;
 	va_list args;
 
-	if (!cam->inbulk) {
-		cam->inbulk = malloc(12 + nparams * 4);
-	} else {
-		cam->inbulk = realloc(cam->inbulk, cam->nrinbulk + 12 + nparams * 4);
-	}
-	offset = cam->inbulk + cam->nrinbulk;
-	cam->nrinbulk += 12 + nparams * 4;
-	x += put_32bit_le(offset + x, 12 + nparams * 4);
-	x += put_16bit_le(offset + x, 0x3);
-	x += put_16bit_le(offset + x, code);
-	x += put_32bit_le(offset + x, cam->seqnr);
+	if (nparams > 5) vcam_panic("%s: too many params (%d)", __func__, nparams);
+
+	x += put_32bit_le(packet + x, 12 + nparams * 4);
+	x += put_16bit_le(packet + x, 0x3);
+	x += put_16bit_le(packet + x, code);
+	x += put_32bit_le(packet + x, cam->seqnr);
 
 	va_start(args, nparams);
 	for (i = 0; i < nparams; i++)
-		x += put_32bit_le(offset + x, va_arg(args, uint32_t));
+		x += put_32bit_le(packet + x, va_arg(args, uint32_t));
 	va_end(args);
 
+	vcam_queue_append(&cam->inbulk, packet, x);
+
 	cam->seqnr++;
 }
 
@@ -294,105 +347,6 @@ void *read_file(struct ptp_dirent *cur) {
 	return data;
 }
 
-int ptp_get_object_count(vcam *cam) {
-	int cnt = 0;
-	struct ptp_dirent *cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id) { /* do not include 0 entry */
-			cnt++;
-		}
-		cur = cur->next;
-	}
-	return cnt;
-}
-
-void read_directories(vcam *cam, const char *path, struct ptp_dirent *parent) {
-	struct ptp_dirent *cur;
-	struct dirent *de;
-
-	DIR *dir = opendir(path);
-	if (!dir)
-		return;
-	while ((de = readdir(dir))) {
-		if (!strcmp(de->d_name, "."))
-			continue;
-		if (!strcmp(de->d_name, ".."))
-			continue;
-
-		cur = malloc(sizeof(struct ptp_dirent));
-		if (!cur)
-			break;
-		cur->name = strdup(de->d_name);
-		cur->fsname = malloc(strlen(path) + 1 + strlen(de->d_name) + 1);
-		strcpy(cur->fsname, path);
-		strcat(cur->fsname, "/");
-		strcat(cur->fsname, de->d_name);
-		//gp_log_("Found filename: %s\n", cur->fsname);
-		cur->id = cam->ptp_objectid++;
-		cur->next = cam->first_dirent;
-		cur->parent = parent;
-		cam->first_dirent = cur;
-		if (-1 == stat(cur->fsname, &cur->stbuf))
-			continue;
-		if (S_ISDIR(cur->stbuf.st_mode))
-			read_directories(cam, cur->fsname, cur); /* recurse! */
-	}
-	closedir(dir);
-}
-
-int vcam_get_object_count(vcam *cam) {
-	int cnt = 0;
-	struct ptp_dirent *cur = cam->first_dirent;
-	while (cur) {
-		if (cur->id) { /* do not include 0 entry */
-			cnt++;
-		}
-		cur = cur->next;
-	}
-
-	return cnt;
-}
-
-void free_dirent(struct ptp_dirent *ent) {
-	free(ent->name);
-	free(ent->fsname);
-	free(ent);
-}
-
-void read_tree(vcam *cam, const char *path) {
-	struct ptp_dirent *root = NULL, *dir, *dcim = NULL;
-
-	if (cam->first_dirent)
-		return;
-
-	cam->first_dirent = malloc(sizeof(struct ptp_dirent));
-	cam->first_dirent->name = strdup("");
-	cam->first_dirent->fsname = strdup(path);
-	cam->first_dirent->id = cam->ptp_objectid++;
-	cam->first_dirent->next = NULL;
-	stat(cam->first_dirent->fsname, &cam->first_dirent->stbuf); /* assuming it works */
-	root = cam->first_dirent;
-	read_directories(cam, path, cam->first_dirent);
-
-	/* See if we have a DCIM directory, if not, create one. */
-	dir = cam->first_dirent;
-	while (dir) {
-		if (!strcmp(dir->name, "DCIM") && dir->parent && !dir->parent->id)
-			dcim = dir;
-		dir = dir->next;
-	}
-	if (!dcim) {
-		dcim = malloc(sizeof(struct ptp_dirent));
-		dcim->name = strdup("DCIM");
-		dcim->fsname = strdup(path);
-		dcim->id = cam->ptp_objectid++;
-		dcim->next = cam->first_dirent;
-		dcim->parent = root;
-		stat(dcim->fsname, &dcim->stbuf); /* assuming it works */
-		cam->first_dirent = dcim;
-	}
-}
-
 int vcam_init(vcam *cam) {
 	return 0;
 }
@@ -402,9 +356,20 @@ int vcam_exit(vcam *cam) {
 }
 
 int vcam_close(vcam *cam) {
-	free(cam->inbulk);
-	free(cam->outbulk);
+	vcam_queue_free(&cam->inbulk);
+	vcam_ring_free(&cam->outbulk);
+	free(cam->scratch);
+	vcam_free_objects(cam);
+	vcam_free_events(cam);
+	if (cam->fs_watch_fd >= 0)
+		close(cam->fs_watch_fd);
+	for (int i = 0; i < cam->props->length; i++)
+		free(cam->props->handlers[i]);
+	free(cam->props->handlers);
+	free(cam->props->index);
 	free(cam->props);
+	for (int i = 0; i < 256; i++)
+		free(cam->opcodes->pages[i]);
 	free(cam->opcodes);
 	return 0;
 }
@@ -415,6 +380,12 @@ static long get_ms(void) {
 	return (long)(ts.tv_sec * 1000000L + ts.tv_nsec / 1000L);
 }
 
+uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
 static void hexdump(void *buffer, int size) {
 	unsigned char *buf = (unsigned char *)buffer;
 	for (int i = 0; i < size; i++) {
@@ -427,52 +398,121 @@ static void hexdump(void *buffer, int size) {
 }
 
 
-void vcam_process_output(vcam *cam) {
-	ptpcontainer ptp;
-	int i, j;
+// Hand the received part of a streamed data phase to the opcode handler
+static void stream_data(vcam *cam) {
+	struct PtpOpcode *h = vcam_get_opcode(cam, cam->data_stream_code);
 
-	if (cam->next_cmd_kills_connection) {
-		vcam_log("Killing connection");
-		exit(0);
+	while (cam->data_stream_left && cam->outbulk.length) {
+		size_t n;
+		const uint8_t *data = vcam_ring_contig(&cam->outbulk, &n);
+		if (n > cam->data_stream_left)
+			n = cam->data_stream_left;
+		if (!cam->data_stream_drop)
+			h->data_chunk(cam, &cam->ptpcmd, data, (unsigned int)n);
+		vcam_ring_consume(&cam->outbulk, n);
+		cam->data_stream_left -= (uint32_t)n;
+	}
+
+	if (cam->data_stream_left == 0) {
+		cam->data_stream_code = 0;
+		if (h->data_end != NULL && !cam->data_stream_drop)
+			h->data_end(cam, &cam->ptpcmd);
 	}
+}
+
+// Start streaming a data phase once its header is in, rather than waiting for the whole container
+static int start_stream(vcam *cam, uint32_t size) {
+	unsigned char header[12];
+	if (vcam_ring_peek(&cam->outbulk, header, 12) != 12)
+		return 0;
+	if (get_16bit_le(header + 4) != PTP_PACKET_TYPE_DATA)
+		return 0;
+	uint16_t code = get_16bit_le(header + 6);
+	struct PtpOpcode *h = vcam_get_opcode(cam, code);
+	if (h == NULL || h->data_chunk == NULL)
+		return 0;
+
+	vcam_log("Streaming data phase 0x%X (%u bytes)", code, size - 12);
+	vcam_poll_fs(cam);
+	vcam_ring_consume(&cam->outbulk, 12);
+	cam->data_stream_code = code;
+	cam->data_stream_left = size - 12;
+	cam->data_stream_drop = 0;
+	if (h->data_begin != NULL && h->data_begin(cam, &cam->ptpcmd, size - 12) == 0) {
+		vcam_log("Dropping data phase 0x%X", code);
+		cam->data_stream_drop = 1;
+	}
+	stream_data(cam);
+	return 1;
+}
+
+// Most of a buffered container that is reserved up front, the length comes from the initiator
+#define OUT_RESERVE_MAX (64 * 1024 * 1024)
+
+// Handle the first container in outbulk
+// Returns 1 if it was consumed, 0 if more data is needed
+static int process_container(vcam *cam) {
+	ptpcontainer ptp;
+	int i;
 
 	long now = get_ms();
 	int milis_since_last = (int)(now - cam->last_cmd_timestamp);
 	cam->last_cmd_timestamp = get_ms();
 
-	if (cam->nroutbulk < 4)
-		return; /* wait for more data */
+	if (cam->data_stream_code) {
+		stream_data(cam);
+		return cam->data_stream_code == 0;
+	}
+
+	if (cam->outbulk.length < 4)
+		return 0; /* wait for more data */
 
-	ptp.size = get_32bit_le(cam->outbulk);
-	if (ptp.size > cam->nroutbulk)
-		return; /* wait for more data */
+	unsigned char size_buf[4];
+	vcam_ring_peek(&cam->outbulk, size_buf, 4);
+	ptp.size = get_32bit_le(size_buf);
+	if (ptp.size >= 12 && start_stream(cam, ptp.size))
+		return cam->data_stream_code == 0;
+	if (ptp.size > cam->outbulk.length) {
+		/* Make room for the rest now instead of doubling the ring into it as it arrives */
+		struct iovec iov[2];
+		size_t rest = ptp.size - cam->outbulk.length;
+		vcam_ring_reserve(&cam->outbulk, rest < OUT_RESERVE_MAX ? rest : OUT_RESERVE_MAX, iov);
+		return 0; /* wait for more data */
+	}
 
 	if (ptp.size < 12) { /* No ptp command can be less than 12 bytes */
 		/* not clear if normal cameras react like this */
 		vcam_log_func(__func__, "input size was %d, minimum is 12", ptp.size);
 
-		//hexdump(cam->outbulk, ptp.size);
-
 		// Does this work on PTP/IP?
 		ptp_response(cam, PTP_RC_GeneralError, 0);
-		memmove(cam->outbulk, cam->outbulk + ptp.size, cam->nroutbulk - ptp.size);
-		cam->nroutbulk -= ptp.size;
-		return;
+		if (ptp.size < 4) {
+			// Can't find the next container from here, drop everything
+			vcam_ring_consume(&cam->outbulk, cam->outbulk.length);
+			return 0;
+		}
+		vcam_ring_consume(&cam->outbulk, ptp.size);
+		return 1;
 	}
 
+	/* Pick up card changes before the handlers look at the object list */
+	vcam_poll_fs(cam);
+
+	/* The whole container is queued, make it contiguous for the handlers */
+	unsigned char *packet = vcam_ring_linearize(&cam->outbulk, ptp.size);
+
 	/* ptp:  4 byte size, 2 byte opcode, 2 byte type, 4 byte serial number */
-	ptp.type = get_16bit_le(cam->outbulk + 4);
-	ptp.code = get_16bit_le(cam->outbulk + 6);
-	ptp.seqnr = get_32bit_le(cam->outbulk + 8);
+	ptp.type = get_16bit_le(packet + 4);
+	ptp.code = get_16bit_le(packet + 6);
+	ptp.seqnr = get_32bit_le(packet + 8);
 
 	/* We want either CMD or DATA phase. */
 	if ((ptp.type != PTP_PACKET_TYPE_COMMAND) && (ptp.type != PTP_PACKET_TYPE_DATA)) {
 		/* not clear if normal cameras react like this */
 		vcam_log_func(__func__, "expected CMD or DATA, but type was %d", ptp.type);
 		ptp_response(cam, PTP_RC_GeneralError, 0);
-		memmove(cam->outbulk, cam->outbulk + ptp.size, cam->nroutbulk - ptp.size);
-		cam->nroutbulk -= (int)ptp.size;
-		return;
+		vcam_ring_consume(&cam->outbulk, ptp.size);
+		return 1;
 	}
 
 	// Allow our special BEEF code for testing
@@ -480,9 +520,8 @@ void vcam_process_output(vcam *cam) {
 		/* not clear if normal cameras react like this */
 		vcam_log_func(__func__, "OPCODE 0x%04x does not start with 0x1 or 0x9", ptp.code);
 		ptp_response(cam, PTP_RC_GeneralError, 0);
-		memmove(cam->outbulk, cam->outbulk + ptp.size, cam->nroutbulk - ptp.size);
-		cam->nroutbulk -= (int)ptp.size;
-		return;
+		vcam_ring_consume(&cam->outbulk, ptp.size);
+		return 1;
 	}
 
 	if (ptp.type == PTP_PACKET_TYPE_COMMAND) {
@@ -490,23 +529,21 @@ void vcam_process_output(vcam *cam) {
 			/* not clear if normal cameras react like this */
 			vcam_log_func(__func__, "SIZE-12 is not divisible by 4, but is %d", ptp.size - 12);
 			ptp_response(cam, PTP_RC_GeneralError, 0);
-			memmove(cam->outbulk, cam->outbulk + ptp.size, cam->nroutbulk - ptp.size);
-			cam->nroutbulk -= ptp.size;
-			return;
+			vcam_ring_consume(&cam->outbulk, ptp.size);
+			return 1;
 		}
 
 		if ((ptp.size - 12) / 4 >= 6) {
 			/* not clear if normal cameras react like this */
 			vcam_log_func(__func__, "(SIZE-12)/4 is %d, exceeds maximum arguments", (ptp.size - 12) / 4);
 			ptp_response(cam, PTP_RC_GeneralError, 0);
-			memmove(cam->outbulk, cam->outbulk + ptp.size, cam->nroutbulk - ptp.size);
-			cam->nroutbulk -= ptp.size;
-			return;
+			vcam_ring_consume(&cam->outbulk, ptp.size);
+			return 1;
 		}
 
 		ptp.nparams = (ptp.size - 12) / 4;
 		for (i = 0; i < ptp.nparams; i++) {
-			ptp.params[i] = get_32bit_le(cam->outbulk + 12 + i * 4);
+			ptp.params[i] = get_32bit_le(packet + 12 + i * 4);
 		}
 		if (ptp.nparams == 0) {
 			vcam_log("Request phase 0x%X (0 params)", ptp.code);
@@ -520,51 +557,91 @@ void vcam_process_output(vcam *cam) {
 		vcam_log("Time since last command: %dms", milis_since_last / 1000);
 	}
 
-	// We have read the first packet, discard it
-	cam->nroutbulk -= ptp.size;
-
 	/* call the opcode handler */
-	for (i = 0; i < cam->opcodes->length; i++) {
-		struct PtpOpcode *h = &cam->opcodes->handlers[i];
-		if (h->code == ptp.code) {
-			if (ptp.type == 1) {
-				h->write(cam, &ptp);
-				memcpy(&cam->ptpcmd, &ptp, sizeof(ptp));
+	struct PtpOpcode *h = vcam_get_opcode(cam, (int)ptp.code);
+	if (h != NULL) {
+		if (ptp.type == 1) {
+			h->write(cam, &ptp);
+			memcpy(&cam->ptpcmd, &ptp, sizeof(ptp));
+		} else {
+			if (h->write_data == NULL) {
+				vcam_log_func(__func__, "opcode 0x%04x received with dataphase, but no dataphase expected", ptp.code);
+				ptp_response(cam, PTP_RC_GeneralError, 0);
 			} else {
-				if (h->write_data == NULL) {
-					vcam_log_func(__func__, "opcode 0x%04x received with dataphase, but no dataphase expected", ptp.code);
-					ptp_response(cam, PTP_RC_GeneralError, 0);
-				} else {
-					h->write_data(cam, &cam->ptpcmd, cam->outbulk + 12, ptp.size - 12);
-				}
+				h->write_data(cam, &cam->ptpcmd, packet + 12, ptp.size - 12);
 			}
-			return;
 		}
+	} else {
+		vcam_log_func(__func__, "received an unsupported opcode 0x%04x", ptp.code);
+		ptp_response(cam, PTP_RC_OperationNotSupported, 0);
+	}
+
+	// We have handled the packet, discard it
+	vcam_ring_consume(&cam->outbulk, ptp.size);
+	return 1;
+}
+
+void vcam_process_output(vcam *cam) {
+	// Only checked on entry: the command that set it still has its data phase and response queued for the backend
+	if (cam->next_cmd_kills_connection) {
+		vcam_log("Killing connection");
+		exit(0);
 	}
 
-	vcam_log_func(__func__, "received an unsupported opcode 0x%04x", ptp.code);
-	ptp_response(cam, PTP_RC_OperationNotSupported, 0);
+	// The initiator may have sent several containers in one transfer, handle all that are complete
+	while (process_container(cam));
 }
 
 int vcam_read(vcam *cam, int ep, unsigned char *data, int bytes) {
 	(void)ep;
-	int toread = bytes;
-
-	if (toread > cam->nrinbulk)
-		toread = cam->nrinbulk;
+	int toread = (int)vcam_queue_read(&cam->inbulk, data, bytes);
 
 	if (cam->comm_dump) {
-		fwrite(cam->inbulk, 1, toread, cam->comm_dump);
+		fwrite(data, 1, toread, cam->comm_dump);
 		fflush(cam->comm_dump);
 	}
 
-
-	memcpy(data, cam->inbulk, toread);
-	memmove(cam->inbulk, cam->inbulk + toread, (cam->nrinbulk - toread));
-	cam->nrinbulk -= toread;
 	return toread;
 }
 
+int vcam_peek(vcam *cam, unsigned char *data, int bytes) {
+	return (int)vcam_queue_peek(&cam->inbulk, data, bytes);
+}
+
+int vcam_read_pending(vcam *cam) {
+	return (int)cam->inbulk.length;
+}
+
+int vcam_read_peek(vcam *cam, const unsigned char **data) {
+	size_t n;
+	(*data) = vcam_queue_contig(&cam->inbulk, &n);
+	return (int)n;
+}
+
+int vcam_read_iov(vcam *cam, struct iovec *iov, int max_iov, int bytes) {
+	return vcam_queue_iov(&cam->inbulk, iov, max_iov, bytes);
+}
+
+void vcam_read_consume(vcam *cam, int bytes) {
+	if (cam->comm_dump) {
+		struct iovec iov[16];
+		int left = bytes;
+		while (left) {
+			int cnt = vcam_read_iov(cam, iov, 16, left);
+			if (cnt == 0) break;
+			for (int i = 0; i < cnt; i++) {
+				fwrite(iov[i].iov_base, 1, iov[i].iov_len, cam->comm_dump);
+				left -= iov[i].iov_len;
+			}
+			// Only the first 16 spans can be described at once
+			vcam_queue_consume(&cam->inbulk, bytes - left);
+			bytes = left;
+		}
+		fflush(cam->comm_dump);
+	}
+	vcam_queue_consume(&cam->inbulk, bytes);
+}
+
 int vcam_write(vcam *cam, int ep, const unsigned char *data, int bytes) {
 	(void)ep;
 	if (cam->comm_dump) {
@@ -572,140 +649,96 @@ int vcam_write(vcam *cam, int ep, const unsigned char *data, int bytes) {
 		fflush(cam->comm_dump);
 	}
 
-	if (!cam->outbulk) {
-		cam->outbulk = malloc(bytes);
-	} else {
-		cam->outbulk = realloc(cam->outbulk, cam->nroutbulk + bytes);
-	}
-	memcpy(cam->outbulk + cam->nroutbulk, data, bytes);
-	cam->nroutbulk += bytes;
+	vcam_ring_append(&cam->outbulk, data, bytes);
 
 	vcam_process_output(cam);
 
 	return bytes;
 }
 
-int ptp_notify_event(vcam *cam, uint16_t code, uint32_t value) {
-	return ptp_inject_interrupt(cam, 1000, code, 1, value, 0);
+int vcam_write_iov(vcam *cam, struct iovec iov[2], int bytes) {
+	return vcam_ring_reserve(&cam->outbulk, (size_t)bytes, iov);
 }
 
-int ptp_inject_interrupt(vcam *cam, int when, uint16_t code, int nparams, uint32_t param1, uint32_t transid) {
-	struct ptp_interrupt *interrupt, **pint;
-	struct timeval now;
-	unsigned char *data;
-	int x = 0;
-
-	vcam_log_func(__func__, "generate interrupt 0x%04x, %d params, param1 0x%08x, timeout=%d", code, nparams, param1, when);
-
-	gettimeofday(&now, NULL);
-	now.tv_usec += (when % 1000) * 1000;
-	now.tv_sec += when / 1000;
-	if (now.tv_usec > 1000000) {
-		now.tv_usec -= 1000000;
-		now.tv_sec++;
+int vcam_write_commit(vcam *cam, int bytes) {
+	if (cam->comm_dump) {
+		// Still the same room, nothing was appended since vcam_write_iov
+		struct iovec iov[2];
+		int cnt = vcam_ring_reserve(&cam->outbulk, (size_t)bytes, iov);
+		for (int i = 0; i < cnt; i++)
+			fwrite(iov[i].iov_base, 1, iov[i].iov_len, cam->comm_dump);
+		fflush(cam->comm_dump);
 	}
 
-	data = malloc(0x10);
-	x += put_32bit_le(data + x, 0x10);
-	x += put_16bit_le(data + x, 4);
-	x += put_16bit_le(data + x, code);
-	x += put_32bit_le(data + x, transid);
-	x += put_32bit_le(data + x, param1);
-
-	interrupt = malloc(sizeof(struct ptp_interrupt));
-	interrupt->data = data;
-	interrupt->size = x;
-	interrupt->triggertime = now;
-	interrupt->next = NULL;
+	vcam_ring_commit(&cam->outbulk, (size_t)bytes);
 
-	/* Insert into list, sorted by trigger time, next triggering one first */
-	pint = &cam->first_interrupt;
-	while (*pint) {
-		if (now.tv_sec > (*pint)->triggertime.tv_sec) {
-			pint = &((*pint)->next);
-			continue;
-		}
-		if ((now.tv_sec == (*pint)->triggertime.tv_sec) &&
-		    (now.tv_usec > (*pint)->triggertime.tv_usec)) {
-			pint = &((*pint)->next);
-			continue;
-		}
-		interrupt->next = *pint;
-		*pint = interrupt;
-		break;
-	}
-	if (!*pint) /* single entry */
-		*pint = interrupt;
-	return 1;
-}
-
-int ptp_pop_event(vcam *cam, struct GenericEvent *ev) {
-	// first_interrupt is allowed to be NULL, will produce timeout (no events)
-	if (cam->first_interrupt == NULL) return 1;
-
-	memcpy(ev, cam->first_interrupt->data, sizeof(struct GenericEvent));
-
-	struct ptp_interrupt *prev = cam->first_interrupt;
-	cam->first_interrupt = cam->first_interrupt->next;
-	free(prev->data);
-	free(prev);
+	vcam_process_output(cam);
 
-	return 0;
+	return bytes;
 }
 
-// Reads ints into 'data' with max 'bytes'
-int vcam_readint(vcam *cam, unsigned char *data, int bytes, int timeout) {
-	struct timeval now, end;
-	int newtimeout, tocopy;
-	struct ptp_interrupt *pint;
-
-	if (!cam->first_interrupt) {
-		return GP_ERROR_TIMEOUT;
-	}
-	gettimeofday(&now, NULL);
-	end = now;
-	end.tv_usec += (timeout % 1000) * 1000;
-	end.tv_sec += timeout / 1000;
-	if (end.tv_usec > 1000000) {
-		end.tv_usec -= 1000000;
-		end.tv_sec++;
-	}
-	if (cam->first_interrupt->triggertime.tv_sec > end.tv_sec) {
-		return GP_ERROR_TIMEOUT;
-	}
-	if ((cam->first_interrupt->triggertime.tv_sec == end.tv_sec) &&
-	    (cam->first_interrupt->triggertime.tv_usec > end.tv_usec)) {
-		return GP_ERROR_TIMEOUT;
-	}
-	newtimeout = (cam->first_interrupt->triggertime.tv_sec - now.tv_sec) * 1000 + (cam->first_interrupt->triggertime.tv_usec - now.tv_usec) / 1000;
-	if (newtimeout > timeout)
-		vcam_log_func(__func__, "miscalculated? %d vs %d", timeout, newtimeout);
-	tocopy = cam->first_interrupt->size;
-	if (tocopy > bytes)
-		tocopy = bytes;
-	memcpy(data, cam->first_interrupt->data, tocopy);
-	pint = cam->first_interrupt;
-	cam->first_interrupt = cam->first_interrupt->next;
-	free(pint->data);
-	free(pint);
-	return tocopy;
+// Step i to the value of the flag at argv[*i]
+// @returns NULL if the flag is the last argument
+static const char *flag_value(int argc, const char **argv, int *i) {
+	if ((*i) + 1 >= argc) {
+		vcam_log("%s takes a value", argv[(*i)]);
+		return NULL;
+	}
+	(*i)++;
+	return argv[(*i)];
 }
 
 int vcam_parse_args(vcam *cam, int argc, const char **argv, int *i) {
+	const char *value;
+	// --ip, --local-ip and --dump are left alone if the camera is a session sharing them with its parent
 	if (!strcmp(argv[(*i)], "--ip")) {
-		(*i)++;
-		cam->custom_ip_addr = strdup(argv[(*i)]);
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		if (cam->custom_ip_addr == NULL)
+			cam->custom_ip_addr = strdup(value);
 	} else if (!strcmp(argv[(*i)], "--local-ip")) {
-		cam->custom_ip_addr = malloc(64);
-		get_local_ip(cam->custom_ip_addr);
+		if (cam->custom_ip_addr == NULL) {
+			cam->custom_ip_addr = malloc(64);
+			get_local_ip(cam->custom_ip_addr);
+		}
 	} else if (!strcmp(argv[(*i)], "--fs")) {
-		cam->vcamera_filesystem = argv[(*i) + 1];
-		(*i)++;
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->vcamera_filesystem = value;
+	} else if (!strcmp(argv[(*i)], "--io-window")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->io_window = (size_t)atoi(value) * 1024;
+	} else if (!strcmp(argv[(*i)], "--coalesce")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->events.coalesce_window = atoi(value);
 	} else if (!strcmp(argv[(*i)], "--dump")) {
-		cam->comm_dump = fopen("COMM_DUMP", "wb");
+		if (cam->comm_dump == NULL)
+			cam->comm_dump = fopen("COMM_DUMP", "wb");
 	} else if (!strcmp(argv[(*i)], "--sig")) {
-		(*i)++;
-		cam->sig = atoi(argv[(*i)]);
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->sig = atoi(value);
+	} else if (!strcmp(argv[(*i)], "--sessions")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->max_sessions = atoi(value);
+	} else if (!strcmp(argv[(*i)], "--io-uring")) {
+		cam->io_uring = 1;
+	} else if (!strcmp(argv[(*i)], "--data-chunk")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->data_chunk = (uint32_t)atoi(value) * 1024;
+	} else if (!strcmp(argv[(*i)], "--lv-synth")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		if (sscanf(value, "%dx%d", &cam->lv_width, &cam->lv_height) != 2) {
+			vcam_log("--lv-synth takes <width>x<height>, not %s", value);
+			cam->lv_width = 0;
+		}
+	} else if (!strcmp(argv[(*i)], "--lv-quality")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->lv_quality = atoi(value);
+	} else if (!strcmp(argv[(*i)], "--lv-fps")) {
+		if ((value = flag_value(argc, argv, i)) == NULL) return -1;
+		cam->lv_fps = atoi(value);
+		if (cam->lv_fps <= 0 || cam->lv_fps > 1000) {
+			vcam_log("Invalid --lv-fps %s", value);
+			return -1;
+		}
 	} else {
 		return 0;
 	}
@@ -716,15 +749,16 @@ vcam *vcam_init_standard(void) {
 	vcam *cam = calloc(1, sizeof(vcam));
 	if (!cam) abort();
 
+	// The card is opened on first use, after --fs has been parsed
 	cam->vcamera_filesystem = PWD "/bin/card";
-
-	read_tree(cam, cam->vcamera_filesystem);
+	cam->fs_watch_fd = -1;
 
 	cam->props = calloc(1, sizeof(struct PtpPropList));
 	cam->opcodes = calloc(1, sizeof(struct PtpOpcodeList));
 	cam->seqnr = 0;
 
 	cam->last_cmd_timestamp = 0;
+	cam->lv_quality = 75;
 
 	// blah blah
 	cam->battery = 50;
@@ -736,7 +770,37 @@ vcam *vcam_init_standard(void) {
 	return cam;
 }
 
+static void set_model_args(vcam *cam, const char *name, int argc, const char **argv) {
+	cam->model_name = name;
+	cam->model_argc = argc;
+	cam->model_argv = argv;
+}
+
+int vcam_init_model(vcam *cam, const char *name, int argc, const char **argv) {
+	set_model_args(cam, name, argc, argv);
+	if (fuji_init_cam(cam, name, argc, argv) == 0) return 0;
+	if (canon_init_cam(cam, name, argc, argv) == 0) return 0;
+	vcam_log("Invalid camera '%s' or flags", name);
+	return -1;
+}
+
+vcam *vcam_new_session(vcam *cam) {
+	vcam *new = vcam_init_standard();
+	// Process wide settings come from the parent, parsing the flags again doesn't touch them
+	new->comm_dump = cam->comm_dump;
+	new->custom_ip_addr = cam->custom_ip_addr;
+	new->sig = cam->sig;
+	if (vcam_init_model(new, cam->model_name, cam->model_argc, cam->model_argv)) {
+		vcam_close(new);
+		free(new->priv);
+		free(new);
+		return NULL;
+	}
+	return new;
+}
+
 int vcam_main(vcam *cam, const char *name, enum CamBackendType backend, int argc, const char **argv) {
+	set_model_args(cam, name, argc, argv);
 	if (fuji_init_cam(cam, name, argc, argv) == 0) {
 		if (backend == VCAM_TCP) {
 			int rc = fuji_wifi_main(cam);
@@ -750,7 +814,7 @@ int vcam_main(vcam *cam, const char *name, enum CamBackendType backend, int argc
 			return rc;
 		}
 	} else {
-		vcam_log("Invalid camera '%s'", name);
+		vcam_log("Invalid camera '%s' or flags", name);
 		return -1;
 	}
 
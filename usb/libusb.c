@@ -203,6 +203,11 @@ int libusb_release_interface(libusb_device_handle *dev_handle, int interface_num
 int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char endpoint,
 		unsigned char *data, int length, int *transferred, unsigned int timeout) {
 	(*transferred) = dev->usb->handle_bulk_transfer(dev->usb, dev->devn, endpoint, data, length);
+	// Nothing to send yet, there's no event loop to complete it later
+	if ((*transferred) < 0) {
+		(*transferred) = 0;
+		return LIBUSB_ERROR_TIMEOUT;
+	}
 	return 0;
 }
 
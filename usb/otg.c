@@ -138,21 +138,28 @@ static void* io_thread(void* arg)
 
 		//ret = poll(&pfd, 1, 2000);
 
-		vcam_log("%d bytes in queue\n", priv_gpport->pl->vcamera->nrinbulk);
-
-		struct PtpBulkContainer *first = (struct PtpBulkContainer *)priv_gpport->pl->vcamera->inbulk;
-
-		ret = write (thread_args->fd_in, first, first->length);
-		printf("otg: Was able to write %d bytes\n", ret);
-
-		if (first->type == PTP_PACKET_TYPE_DATA) {
-			first = (struct PtpBulkContainer *)(priv_gpport->pl->vcamera->inbulk + first->length);
-			ret = write(thread_args->fd_in, first, first->length);
-			printf("otg: Was able to write %d bytes\n", ret);
+		vcam *cam = priv_gpport->pl->vcamera;
+		vcam_log("%d bytes in queue\n", vcam_read_pending(cam));
+
+		// Write out each queued container as its own transfer, in 64KiB steps
+		uint32_t left = 0;
+		while (vcam_read_pending(cam) >= 4) {
+			unsigned char length[4];
+			vcam_peek(cam, length, 4);
+			left = get_32bit_le(length);
+			while (left) {
+				const unsigned char *chunk;
+				int n = vcam_read_peek(cam, &chunk);
+				if (n > left) n = left;
+				ret = write(thread_args->fd_in, chunk, n);
+				if (ret <= 0) break;
+				vcam_read_consume(cam, ret);
+				left -= ret;
+			}
+			printf("otg: Was able to write container, %u bytes left\n", left);
+			if (left) break;
 		}
 
-		priv_gpport->pl->vcamera->nrinbulk = 0;
-
 		//fcntl(thread_args->fd_in, F_SETFL, fcntl(thread_args->fd_in, F_GETFL) & ~O_NONBLOCK);
 		fflush(stdout);
     }
@@ -1,6 +1,7 @@
 #pragma once
 #include <linux/usb/ch9.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #define usbt_dbg(...) printf(__VA_ARGS__)
 
@@ -15,10 +16,26 @@ struct UsbThing {
 	/// @param out_length Is set to zero by caller
 	/// @returns bytes written, -1 for error
 	int (*handle_control_request)(struct UsbThing *ctx, int devn, int endpoint, const void *data, int length, void *out);
-	/// @brief Handle bulk transfers IN/OUT
+	/// @brief Handle bulk and interrupt transfers IN/OUT
 	/// @param data Buffer for reading/writing, will be at least the size of maxPacketSize for this endpoint
-	/// @returns bytes read/written, -1 for no response
+	/// @returns bytes read/written, -1 if an IN endpoint has nothing to send yet, the backend retries it later
 	int (*handle_bulk_transfer)(struct UsbThing *ctx, int devn, int endpoint, void *data, int length);
+	/// @brief Optional, describe where `length` bytes of a bulk OUT transfer can be received to in place
+	/// Backends that use it pass the transfer to handle_bulk_out_done instead of handle_bulk_transfer
+	/// @returns number of iovecs filled, at most 2
+	int (*get_bulk_out_iov)(struct UsbThing *ctx, int devn, int endpoint, struct iovec iov[2], int length);
+	/// @brief Handle a bulk OUT transfer that was received into the space from get_bulk_out_iov
+	/// @returns bytes written
+	int (*handle_bulk_out_done)(struct UsbThing *ctx, int devn, int endpoint, int length);
+	/// @brief Optional, when an IN endpoint will have data without the host sending anything (a timed event)
+	/// Waiting IN transfers are always retried after every OUT and control transfer.
+	/// @returns microseconds from now, -1 for nothing scheduled
+	int64_t (*get_in_wakeup)(struct UsbThing *ctx, int devn);
+	/// @brief Optional, a descriptor that becomes readable when the device may have something new to send
+	/// @returns -1 for none
+	int (*get_wakeup_fd)(struct UsbThing *ctx, int devn);
+	/// @brief Called once the get_wakeup_fd descriptor is readable, before waiting IN transfers are retried
+	void (*handle_wakeup_fd)(struct UsbThing *ctx, int devn);
 
 	/// @returns nonzero for error
 	int (*get_device_descriptor)(struct UsbThing *ctx, int devn, struct usb_device_descriptor *desc);
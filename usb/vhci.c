@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <byteswap.h>
@@ -11,10 +16,34 @@
 #include "usbip.h"
 #include "usbthing.h"
 
+#define VHCI_MAX_EP 16
+/// @brief Transfer buffers come in power of two size classes from VHCI_POOL_MIN bytes, larger ones aren't kept
+#define VHCI_POOL_MIN 4096
+#define VHCI_POOL_CLASSES 12
+
+/// @brief An IN transfer waiting for the device to have something to send
+struct Urb {
+	/// @brief Kept in network order, as echoed back in RET_SUBMIT
+	uint32_t seqnum;
+	uint32_t devid;
+	uint32_t ep;
+	int length;
+	struct Urb *next;
+};
+
+struct VhciDevice {
+	int fd;
+	/// @brief Waiting IN transfers per endpoint number, completed in the order they were submitted
+	struct Urb *head[VHCI_MAX_EP];
+	struct Urb *tail[VHCI_MAX_EP];
+};
+
 struct Priv {
-	int sockfd;
-	uint8_t *buffer;
-	size_t buffer_length;
+	struct VhciDevice *devs;
+	/// @brief Finished Urbs for reuse
+	struct Urb *free_urbs;
+	/// @brief One spare buffer per size class, a transfer is finished before the next one is looked at
+	uint8_t *pool[VHCI_POOL_CLASSES];
 };
 
 static void hexdump(void *buffer, int size) {
@@ -28,91 +57,358 @@ static void hexdump(void *buffer, int size) {
 	printf("\n");
 }
 
-static int handle_submit(struct UsbThing *ctx, int sockfd, struct usbip_header *header) {
-	int resp_len = 0;
-	uint32_t len = bswap_32(header->u.cmd_submit.transfer_buffer_length);
-	uint32_t dir = bswap_32(header->base.direction);
-	uint32_t ep = bswap_32(header->base.ep);
-	uint32_t ep_addr = (dir << 7) | ep;
-	usbt_dbg("submit ep:%x len:%d dir:%d\n", ep_addr, len, dir);
+static int pool_class(size_t length) {
+	int c = 0;
+	while (c < VHCI_POOL_CLASSES && ((size_t)VHCI_POOL_MIN << c) < length)
+		c++;
+	return c;
+}
+
+static uint8_t *pool_get(struct Priv *p, size_t length) {
+	int c = pool_class(length);
+	if (c < VHCI_POOL_CLASSES && p->pool[c] != NULL) {
+		uint8_t *buffer = p->pool[c];
+		p->pool[c] = NULL;
+		return buffer;
+	}
+	uint8_t *buffer = malloc(c < VHCI_POOL_CLASSES ? (size_t)VHCI_POOL_MIN << c : length);
+	assert(buffer != NULL);
+	return buffer;
+}
 
+static void pool_put(struct Priv *p, uint8_t *buffer, size_t length) {
+	int c = pool_class(length);
+	if (c < VHCI_POOL_CLASSES && p->pool[c] == NULL) {
+		p->pool[c] = buffer;
+	} else {
+		free(buffer);
+	}
+}
+
+static int send_all(int sockfd, struct iovec *iov, int iovcnt) {
+	while (iovcnt) {
+		// The host detaching shouldn't kill the process with SIGPIPE
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)iovcnt};
+		ssize_t rc = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			printf("Failed to send %d\n", errno);
+			return -1;
+		}
+		while (iovcnt && (size_t)rc >= iov->iov_len) {
+			rc -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + rc;
+			iov->iov_len -= (size_t)rc;
+		}
+	}
+	return 0;
+}
+
+// seqnum, devid and ep are in network order
+static int send_ret_submit(int sockfd, uint32_t seqnum, uint32_t devid, uint32_t dir, uint32_t ep, int actual_length, void *data, int data_length) {
 	struct usbip_header resp = {0};
 	resp.base.command = bswap_32(USBIP_RET_SUBMIT);
-	resp.base.seqnum = header->base.seqnum;
-	resp.base.devid = header->base.devid;
-	resp.base.direction = header->base.direction;
-	resp.base.ep = header->base.ep;
+	resp.base.seqnum = seqnum;
+	resp.base.devid = devid;
+	resp.base.direction = bswap_32(dir);
+	resp.base.ep = ep;
 	resp.u.ret_submit.status = bswap_32(0);
+	resp.u.ret_submit.actual_length = (int32_t)bswap_32((uint32_t)actual_length);
 	resp.u.ret_submit.start_frame = bswap_32(0);
 	resp.u.ret_submit.number_of_packets = bswap_32(0);
 	resp.u.ret_submit.error_count = bswap_32(0);
 
-	uint8_t *buffer = NULL;
+	struct iovec iov[2] = {
+		{&resp, sizeof(resp)},
+		{data, (size_t)data_length},
+	};
+	return send_all(sockfd, iov, data_length ? 2 : 1);
+}
+
+// Try to complete an IN transfer, returns 1 if it was, 0 if the endpoint has nothing to send yet
+static int complete_in(struct UsbThing *ctx, int devn, struct VhciDevice *d, const struct Urb *urb) {
+	struct Priv *p = (struct Priv *)ctx->priv_backend;
+	uint8_t *buffer = pool_get(p, (size_t)urb->length);
+	int ep_addr = 0x80 | (int)bswap_32(urb->ep);
+	int rc = ctx->handle_bulk_transfer(ctx, devn, ep_addr, buffer, urb->length);
+	int done = rc >= 0;
+	if (done && send_ret_submit(d->fd, urb->seqnum, urb->devid, USBIP_DIR_IN, urb->ep, rc, buffer, rc))
+		done = -1;
+	pool_put(p, buffer, (size_t)urb->length);
+	return done;
+}
+
+static void park_urb(struct Priv *p, struct VhciDevice *d, const struct Urb *urb) {
+	struct Urb *u = p->free_urbs;
+	if (u != NULL) {
+		p->free_urbs = u->next;
+	} else {
+		u = malloc(sizeof(struct Urb));
+		assert(u != NULL);
+	}
+	(*u) = (*urb);
+	u->next = NULL;
+	int n = (int)bswap_32(urb->ep) % VHCI_MAX_EP;
+	if (d->tail[n] != NULL)
+		d->tail[n]->next = u;
+	else
+		d->head[n] = u;
+	d->tail[n] = u;
+}
+
+// Complete waiting IN transfers that the device now has data for, returns -1 if the connection failed
+static int complete_parked(struct UsbThing *ctx, int devn) {
+	struct Priv *p = (struct Priv *)ctx->priv_backend;
+	struct VhciDevice *d = &p->devs[devn];
+	for (int n = 0; n < VHCI_MAX_EP; n++) {
+		while (d->head[n] != NULL) {
+			struct Urb *u = d->head[n];
+			int rc = complete_in(ctx, devn, d, u);
+			if (rc < 0) return -1;
+			if (rc == 0) break;
+			d->head[n] = u->next;
+			if (d->head[n] == NULL) d->tail[n] = NULL;
+			u->next = p->free_urbs;
+			p->free_urbs = u;
+		}
+	}
+	return 0;
+}
+
+// Remove a waiting transfer, seqnum in network order. Returns 0 if it already completed.
+static int unlink_urb(struct Priv *p, struct VhciDevice *d, uint32_t seqnum) {
+	for (int n = 0; n < VHCI_MAX_EP; n++) {
+		struct Urb *prev = NULL;
+		for (struct Urb *u = d->head[n]; u != NULL; prev = u, u = u->next) {
+			if (u->seqnum != seqnum) continue;
+			if (prev != NULL)
+				prev->next = u->next;
+			else
+				d->head[n] = u->next;
+			if (d->tail[n] == u) d->tail[n] = prev;
+			u->next = p->free_urbs;
+			p->free_urbs = u;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int has_parked(const struct VhciDevice *d) {
+	for (int n = 0; n < VHCI_MAX_EP; n++) {
+		if (d->head[n] != NULL) return 1;
+	}
+	return 0;
+}
+
+static void free_urbs(struct Urb *u) {
+	while (u != NULL) {
+		struct Urb *next = u->next;
+		free(u);
+		u = next;
+	}
+}
+
+static int handle_submit(struct UsbThing *ctx, int devn, int sockfd, struct usbip_header *header) {
+	struct Priv *p = (struct Priv *)ctx->priv_backend;
+	struct VhciDevice *d = &p->devs[devn];
+	int resp_len = 0;
+	uint32_t len = bswap_32(header->u.cmd_submit.transfer_buffer_length);
+	uint32_t dir = bswap_32(header->base.direction);
+	uint32_t ep = bswap_32(header->base.ep);
+	uint32_t ep_addr = (dir << 7) | ep;
+	usbt_dbg("submit ep:%x len:%d dir:%d\n", ep_addr, len, dir);
 
 	if (ep == 0) {
-		buffer = malloc(65535);
 		// Handle control request payloads
 		int payload_size = 0;
 		if (dir == 0 && len != 0) {
-			int rc = recv(sockfd, &header->u.cmd_submit.setup[8], len, 0);
+			int rc = recv(sockfd, &header->u.cmd_submit.setup[8], len, MSG_WAITALL);
 			if (rc != len) return -1;
 			payload_size += (int)len;
 		}
 
-		int rc = ctx->handle_control_request(ctx, 0, (int)ep, header->u.cmd_submit.setup, 8 + payload_size, buffer);
-		if (rc < 0) return rc;
-		resp_len = rc;
-		if (dir == 0 && len != 0 && resp_len != 0) {
-			printf("Illegal double data phase in control request\n");
-			abort();
+		uint8_t *buffer = pool_get(p, 65535);
+		int rc = ctx->handle_control_request(ctx, devn, (int)ep, header->u.cmd_submit.setup, 8 + payload_size, buffer);
+		if (rc >= 0) {
+			resp_len = rc;
+			if (dir == 0 && len != 0 && resp_len != 0) {
+				printf("Illegal double data phase in control request\n");
+				abort();
+			}
+			rc = send_ret_submit(sockfd, header->base.seqnum, header->base.devid, dir, header->base.ep, resp_len, buffer, resp_len);
 		}
-		resp.u.ret_submit.actual_length = bswap_32(resp_len);
+		pool_put(p, buffer, 65535);
+		return rc;
 	} else if (dir == 1) {
-		buffer = malloc(len);
-		assert(buffer != NULL);
-
-		resp_len = ctx->handle_bulk_transfer(ctx, 0, (int)ep_addr, buffer, (int)len);
-		if (resp_len == -1) {
-			return 0;
+		struct Urb urb = {
+			.seqnum = header->base.seqnum,
+			.devid = header->base.devid,
+			.ep = header->base.ep,
+			.length = (int)len,
+		};
+		// Nothing can overtake a transfer that is already waiting on this endpoint
+		if (d->head[ep % VHCI_MAX_EP] == NULL) {
+			int rc = complete_in(ctx, devn, d, &urb);
+			if (rc) return rc < 0 ? -1 : 0;
 		}
-		resp.u.ret_submit.actual_length = bswap_32(resp_len);
+		park_urb(p, d, &urb);
+		return 0;
 	} else if (dir == 0) {
-		buffer = malloc(len);
-		assert(buffer != NULL);
-
-		int read = 0;
-		for (int i = 0; i < 10; i++) {
-			printf("Trying again...\n");
-			int rc = recv(sockfd, buffer + read, len - read, 0);
-			assert(rc >= 0);
-			read += rc;
-			if (read == len) break;
-		}
-		assert(read == len);
-
-		ctx->handle_bulk_transfer(ctx, 0, (int)ep_addr, buffer, (int)len);
-		resp_len = 0;
-		resp.u.ret_submit.actual_length = bswap_32(len);
+		if (ctx->get_bulk_out_iov != NULL) {
+			// Straight into the device's own buffer
+			struct iovec iov[2];
+			struct msghdr msg = {.msg_iov = iov};
+			msg.msg_iovlen = (size_t)ctx->get_bulk_out_iov(ctx, devn, (int)ep_addr, iov, (int)len);
+			ssize_t rc = len ? recvmsg(sockfd, &msg, MSG_WAITALL) : 0;
+			if (rc != (ssize_t)len) {
+				printf("Failed to receive OUT data %d\n", errno);
+				return -1;
+			}
+			ctx->handle_bulk_out_done(ctx, devn, (int)ep_addr, (int)len);
+		} else {
+			uint8_t *buffer = pool_get(p, len);
+			int rc = recv(sockfd, buffer, len, MSG_WAITALL);
+			if (rc == len)
+				ctx->handle_bulk_transfer(ctx, devn, (int)ep_addr, buffer, (int)len);
+			pool_put(p, buffer, len);
+			if (rc != len) {
+				printf("Failed to receive OUT data %d\n", errno);
+				return -1;
+			}
+		}
+		return send_ret_submit(sockfd, header->base.seqnum, header->base.devid, dir, header->base.ep, (int)len, NULL, 0);
 	} else {
 		printf("Illegal state\n");
 		abort();
 	}
+}
 
-	send(sockfd, &resp, 0x30, 0);
-	if (resp_len && buffer != NULL)
-		send(sockfd, buffer, resp_len, 0);
+#define VHCI_PATH "/sys/devices/platform/vhci_hcd.0"
+#define VDEV_ST_NULL 4
 
-	if (buffer != NULL)
-		free(buffer);
+// Find n free high speed ports, every controller has its own status file (status, status.1, ...)
+static int find_free_ports(int *ports, int n) {
+	int found = 0;
+	for (int c = 0; found < n; c++) {
+		char path[128];
+		if (c == 0)
+			sprintf(path, VHCI_PATH "/status");
+		else
+			sprintf(path, VHCI_PATH "/status.%d", c);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) break;
+
+		char line[256];
+		while (found < n && fgets(line, sizeof(line), f) != NULL) {
+			char hub[4];
+			unsigned int port, status;
+			if (sscanf(line, "%3s %u %u", hub, &port, &status) != 3) continue;
+			if (!strcmp(hub, "hs") && status == VDEV_ST_NULL)
+				ports[found++] = (int)port;
+		}
+		fclose(f);
+	}
+	return found;
+}
+
+// Take over a port, returns our end of the usbip connection
+static int attach_port(int attach_fd, int port, int devid) {
+	int sockets[2] = {-1, -1};
+	int ir = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	if (ir == -1) return -1;
+
+	int speed = 2;
+
+	// Write the command to take over the port
+	char cmd[255];
+	sprintf(cmd, "%d %d %d %d", port, sockets[1], devid, speed);
+	if (write(attach_fd, cmd, strlen(cmd)) != strlen(cmd)) {
+		printf("Failed to write attach cmd %d\n", errno);
+		close(sockets[0]);
+		close(sockets[1]);
+		return -1;
+	}
+
+	close(sockets[1]);
+	return sockets[0];
+}
+
+// Connect to a usbip host listening on a unix socket instead of the kernel, like scripts/vhci_bench.c
+static int connect_host(const char *path) {
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path, path);
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd == -1) return -1;
+	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("Failed to connect to usbip host %s %d\n", path, errno);
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
 
+// Handle one usbip command from a device's socket, returns nonzero once the device is gone
+static int handle_command(struct UsbThing *ctx, int devn, int sockfd) {
+	char packet[512] = {0};
+	int rc = recv(sockfd, packet, sizeof(struct usbip_header), MSG_WAITALL);
+	if (rc < 0) {
+		printf("Failed to receive data %d\n", errno);
+		return -1;
+	} else if (rc == 0) {
+		printf("Device %d detached\n", devn);
+		return -1;
+	} else if (rc != sizeof(struct usbip_header)) {
+		printf("Received partial packet %d\n", rc);
+		abort();
+	}
+	//printf("Received %d\n", rc);
+
+	struct usbip_header *header = (struct usbip_header *)packet;
+	uint32_t command = bswap_32(header->base.command);
+	switch (command) {
+	case USBIP_CMD_SUBMIT:
+		return handle_submit(ctx, devn, sockfd, header);
+	case USBIP_CMD_UNLINK: {
+		struct Priv *p = (struct Priv *)ctx->priv_backend;
+		int unlinked = unlink_urb(p, &p->devs[devn], header->u.cmd_unlink.seqnum);
+		usbt_dbg("USBIP_CMD_UNLINK %u %s\n", bswap_32(header->u.cmd_unlink.seqnum), unlinked ? "dequeued" : "already completed");
+		struct usbip_header resp = {0};
+		resp.base.command = bswap_32(USBIP_RET_UNLINK);
+		resp.base.seqnum = header->base.seqnum;
+		resp.base.devid = header->base.devid;
+		resp.base.direction = header->base.direction;
+		resp.base.ep = header->base.ep;
+		// The kernel expects -ECONNRESET for a transfer that was dequeued before it completed
+		resp.u.ret_unlink.status = (int32_t)bswap_32((uint32_t)(unlinked ? -ECONNRESET : 0));
+		struct iovec iov = {&resp, sizeof(resp)};
+		if (send_all(sockfd, &iov, 1)) return -1;
+		} break;
+	case USBIP_RESET_DEV:
+		printf("USBIP_RESET_DEV\n");
+		break;
+	default:
+		printf("Unknown usbip command %x\n", command);
+		hexdump(header, rc);
+		abort();
+	}
 	return 0;
 }
 
 int usbt_vhci_init(struct UsbThing *ctx) {
-	const char *attach_path = "/sys/devices/platform/vhci_hcd.0/attach";
+	const char *attach_path = VHCI_PATH "/attach";
+	// Benchmarks can be the host themselves and skip vhci-hcd
+	const char *host = getenv("VCAM_VHCI_HOST");
 
-	int fd = open(attach_path, O_WRONLY);
-	if (fd == -1) {
+	int fd = -1;
+	if (host == NULL) fd = open(attach_path, O_WRONLY);
+	if (host == NULL && fd == -1) {
 		if (errno == 2) {
 			printf(
 				"Kernel module not loaded, run:\n"
@@ -127,72 +423,87 @@ int usbt_vhci_init(struct UsbThing *ctx) {
 		return -1;
 	}
 
-	int sockets[2] = {-1, -1};
-	int ir = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
-	if (ir == -1) return -1;
+	int n = ctx->n_devices;
+	int *ports = malloc(sizeof(int) * n);
+	// Device connections first, then the wakeup descriptor of each device
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * 2 * n);
+	struct Priv priv = {0};
+	priv.devs = calloc((size_t)n, sizeof(struct VhciDevice));
+	assert(ports != NULL && fds != NULL && priv.devs != NULL);
+	ctx->priv_backend = &priv;
 
-	int port = 0;
-	int devid = 1;
-	int speed = 2;
+	if (host == NULL && find_free_ports(ports, n) != n) {
+		printf("Not enough free vhci ports for %d devices, load vhci-hcd with more (num_controllers=)\n", n);
+		goto exit;
+	}
 
-	// Write the command to take over the port
-	char cmd[255];
-	sprintf(cmd, "%d %d %d %d", port, sockets[1], devid, speed);
-	if (write(fd, cmd, strlen(cmd)) != strlen(cmd)) {
-		printf("Failed to write attach cmd %d\n", errno);
-		return -1;
+	// Every device gets its own port and connection, the device number is the index into fds
+	for (int i = 0; i < n; i++) {
+		fds[i].fd = host ? connect_host(host) : attach_port(fd, ports[i], i + 1);
+		fds[i].events = POLLIN;
+		priv.devs[i].fd = fds[i].fd;
+		if (fds[i].fd == -1) {
+			for (int j = 0; j < i; j++) close(fds[j].fd);
+			goto exit;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		fds[n + i].fd = ctx->get_wakeup_fd ? ctx->get_wakeup_fd(ctx, i) : -1;
+		fds[n + i].events = POLLIN;
 	}
 
-	close(sockets[1]);
+	// IN transfers the device has no data for are parked instead of holding up the connection, so the host
+	// can keep several in flight on every endpoint. Each one completes once a later command or a timed event
+	// gives its endpoint something to send, or goes away with CMD_UNLINK.
+	int alive = n;
+	while (alive) {
+		int64_t wait = -1;
+		for (int i = 0; i < n; i++) {
+			if (fds[i].fd < 0 || ctx->get_in_wakeup == NULL || !has_parked(&priv.devs[i])) continue;
+			int64_t w = ctx->get_in_wakeup(ctx, i);
+			if (w >= 0 && (wait < 0 || w < wait)) wait = w;
+		}
+		struct timespec ts = {(time_t)(wait / 1000000), (long)(wait % 1000000) * 1000};
+		if (ppoll(fds, (nfds_t)(2 * n), wait < 0 ? NULL : &ts, NULL) < 0) {
+			if (errno == EINTR) continue;
+			printf("poll failed %d\n", errno);
+			break;
+		}
 
-	int sockfd = sockets[0];
+		for (int i = 0; i < n; i++) {
+			if (fds[n + i].fd >= 0 && fds[n + i].revents)
+				ctx->handle_wakeup_fd(ctx, i);
+		}
 
-	while (1) {
-		char packet[512] = {0};
-		int rc = recv(sockfd, packet, sizeof(struct usbip_header), 0);
-		if (rc < 0) {
-			printf("Failed to receive data %d\n", errno);
-			return -1;
-		} else if (rc == 0) {
-			continue;
-		} else if (rc != sizeof(struct usbip_header)) {
-			printf("Received partial packet %d\n", rc);
-			abort();
-		}
-		//printf("Received %d\n", rc);
-
-		struct usbip_header *header = (struct usbip_header *)packet;
-		uint32_t command = bswap_32(header->base.command);
-		switch (command) {
-		case USBIP_CMD_SUBMIT:
-			rc = handle_submit(ctx, sockfd, header);
-			if (rc) goto exit;
-			break;
-		case USBIP_CMD_UNLINK: {
-			printf("USBIP_CMD_UNLINK\n");
-			struct usbip_header resp = {0};
-			resp.base.command = bswap_32(USBIP_RET_UNLINK);
-			resp.base.seqnum = header->base.seqnum;
-			resp.base.devid = header->base.devid;
-			resp.base.direction = header->base.direction;
-			resp.base.ep = header->base.ep;
-			resp.u.ret_unlink.status = bswap_32(0);
-			send(sockfd, &resp, 48, 0);
-			} break;
-		case USBIP_RESET_DEV:
-			printf("USBIP_RESET_DEV\n");
-			break;
-		default:
-			printf("Unknown usbip command %x\n", command);
-			hexdump(header, rc);
-			abort();
+		for (int i = 0; i < n; i++) {
+			if (fds[i].fd < 0) continue;
+			if ((fds[i].revents && handle_command(ctx, i, fds[i].fd)) || complete_parked(ctx, i)) {
+				close(fds[i].fd);
+				// Negative fds are ignored by poll
+				fds[i].fd = -1;
+				fds[n + i].fd = -1;
+				alive--;
+			}
 		}
 	}
 
-	close(fd);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < VHCI_MAX_EP; j++)
+			free_urbs(priv.devs[i].head[j]);
+	}
+	free_urbs(priv.free_urbs);
+	for (int i = 0; i < VHCI_POOL_CLASSES; i++)
+		free(priv.pool[i]);
+	free(priv.devs);
+	free(ports);
+	free(fds);
+	if (fd != -1) close(fd);
 	return 0;
 
 	exit:;
-	close(fd);
+	free(priv.devs);
+	free(ports);
+	free(fds);
+	if (fd != -1) close(fd);
 	return -1;
 }